@@ -0,0 +1,650 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fatscan.h>
+#include <freemap.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)			\
+do {					\
+	bench_error(__VA_ARGS__);	\
+	exit(1);			\
+} while (0)
+
+/* Scratch image: 64 MiB of data blocks, default journal */
+#define BENCH_DATA_BLOCKS 16384
+/* File used by the read and write workloads */
+#define BENCH_FILE_SIZE (32 << 20)
+/* Bytes moved by each random workload */
+#define BENCH_RANDOM_BYTES (8 << 20)
+/* Rounds of the create/delete and open/stat/close workloads */
+#define BENCH_CHURN_ROUNDS 20
+#define BENCH_META_ROUNDS 200
+/* Size of each write of the allocation workload */
+#define BENCH_FILL_CHUNK (64 << 10)
+/* Image of the mount workload: 4 GiB of data blocks on a version 2 disk */
+#define BENCH_MOUNT_DATA_BLOCKS (1 << 20)
+#define BENCH_MOUNT_FILES 4096
+#define BENCH_MOUNT_ROUNDS 200
+/* In-memory FATs of the FAT scan microbenchmarks */
+#define BENCH_FAT_ENTRIES (1 << 20)
+#define BENCH_FAT_BLOCK_ENTRIES 2048
+#define BENCH_FAT_ROUNDS 20
+
+static const size_t io_sizes[] = { 512, 4096, 65536, 1 << 20 };
+
+/* Options */
+static const char *image = "fs_bench.fs";
+static uint64_t seed = 1;
+
+/* Latencies of the operations of the current workload, in nanoseconds */
+static uint64_t *lat;
+static size_t nlat, lat_capacity;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, so that every run issues the same offsets */
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static void record(uint64_t start)
+{
+	if (nlat == lat_capacity) {
+		lat_capacity = lat_capacity ? 2 * lat_capacity : 4096;
+		lat = realloc(lat, lat_capacity * sizeof(*lat));
+		if (!lat)
+			die("Cannot allocate latencies");
+	}
+	lat[nlat++] = now_ns() - start;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+	size_t i = (size_t)(p / 100 * nlat);
+
+	if (!nlat)
+		return 0;
+	if (i >= nlat)
+		i = nlat - 1;
+	return lat[i] / 1e3;
+}
+
+/* Print one JSON object per workload, and reset the latencies */
+static void report(const char *workload, size_t io_size, uint64_t bytes,
+		   uint64_t start, int errors)
+{
+	double secs = (now_ns() - start) / 1e9;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	printf("{\"workload\": \"%s\", \"io_size\": %zu, \"ops\": %zu, "
+	       "\"bytes\": %" PRIu64 ", \"seconds\": %.6f, "
+	       "\"mib_per_s\": %.1f, \"ops_per_s\": %.0f, "
+	       "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+	       "\"max_us\": %.1f, \"errors\": %d}\n",
+	       workload, io_size, nlat, bytes, secs,
+	       bytes / secs / (1 << 20), nlat / secs,
+	       percentile_us(50), percentile_us(90), percentile_us(99),
+	       nlat ? lat[nlat - 1] / 1e3 : 0, errors);
+	fflush(stdout);
+	nlat = 0;
+}
+
+static void mount_fresh(void)
+{
+	if (fs_format(image, BENCH_DATA_BLOCKS, FS_JOURNAL_DEFAULT_BLOCKS))
+		die("Cannot format '%s'", image);
+	if (fs_mount(image))
+		die("Cannot mount '%s'", image);
+}
+
+static void unmount(void)
+{
+	if (fs_umount())
+		die("Cannot unmount '%s'", image);
+}
+
+static int open_new(const char *name)
+{
+	int fd;
+
+	if (fs_create(name) || (fd = fs_open(name)) < 0)
+		die("Cannot create '%s'", name);
+	return fd;
+}
+
+/* Sequential and random reads and writes of one file, at every I/O size */
+static void bench_rw(void)
+{
+	char *buf;
+	char name[32];
+	uint64_t start, t;
+	int fd, errors;
+
+	if (posix_memalign((void **)&buf, 4096, io_sizes[ARRAY_SIZE(io_sizes) - 1]))
+		die("Cannot allocate buffer");
+	memset(buf, 0x5a, io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+
+	for (size_t s = 0; s < ARRAY_SIZE(io_sizes); s++) {
+		size_t io = io_sizes[s], nops = BENCH_FILE_SIZE / io;
+		size_t nrand = BENCH_RANDOM_BYTES / io;
+
+		mount_fresh();
+		snprintf(name, sizeof(name), "rw%zu", io);
+		fd = open_new(name);
+
+		errors = 0;
+		start = now_ns();
+		for (size_t i = 0; i < nops; i++) {
+			t = now_ns();
+			if (fs_write(fd, buf, io) != (int)io)
+				errors++;
+			record(t);
+		}
+		report("seq_write", io, (uint64_t)nops * io, start, errors);
+
+		errors = 0;
+		fs_lseek(fd, 0);
+		start = now_ns();
+		for (size_t i = 0; i < nops; i++) {
+			t = now_ns();
+			if (fs_read(fd, buf, io) != (int)io)
+				errors++;
+			record(t);
+		}
+		report("seq_read", io, (uint64_t)nops * io, start, errors);
+
+		errors = 0;
+		rng_state = seed;
+		start = now_ns();
+		for (size_t i = 0; i < nrand; i++) {
+			size_t off = rng() % nops * io;
+
+			t = now_ns();
+			if (fs_pwrite(fd, buf, io, off) != (int)io)
+				errors++;
+			record(t);
+		}
+		report("rand_write", io, (uint64_t)nrand * io, start, errors);
+
+		errors = 0;
+		rng_state = seed;
+		start = now_ns();
+		for (size_t i = 0; i < nrand; i++) {
+			size_t off = rng() % nops * io;
+
+			t = now_ns();
+			if (fs_pread(fd, buf, io, off) != (int)io)
+				errors++;
+			record(t);
+		}
+		report("rand_read", io, (uint64_t)nrand * io, start, errors);
+
+		if (fs_close(fd))
+			die("Cannot close '%s'", name);
+		unmount();
+	}
+
+	free(buf);
+}
+
+/* Fill the root directory with small files and empty it again */
+static void bench_churn(void)
+{
+	char name[FS_FILENAME_LEN], data[1024];
+	uint64_t start, t;
+	int fd, errors = 0;
+
+	memset(data, 'c', sizeof(data));
+	mount_fresh();
+	start = now_ns();
+	for (int r = 0; r < BENCH_CHURN_ROUNDS; r++) {
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			snprintf(name, sizeof(name), "churn%d", i);
+			t = now_ns();
+			if (fs_create(name) || (fd = fs_open(name)) < 0) {
+				errors++;
+				continue;
+			}
+			if (fs_write(fd, data, sizeof(data)) != sizeof(data))
+				errors++;
+			fs_close(fd);
+			record(t);
+		}
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			snprintf(name, sizeof(name), "churn%d", i);
+			t = now_ns();
+			if (fs_delete(name))
+				errors++;
+			record(t);
+		}
+	}
+	report("create_delete", sizeof(data),
+	       (uint64_t)BENCH_CHURN_ROUNDS * FS_FILE_MAX_COUNT * sizeof(data),
+	       start, errors);
+	unmount();
+}
+
+/* Open, stat and close every file of a full root directory */
+static void bench_meta(void)
+{
+	char name[FS_FILENAME_LEN];
+	uint64_t start, t;
+	int fd, errors = 0;
+
+	mount_fresh();
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		snprintf(name, sizeof(name), "meta%d", i);
+		if (fs_create(name))
+			die("Cannot create '%s'", name);
+	}
+
+	start = now_ns();
+	for (int r = 0; r < BENCH_META_ROUNDS; r++) {
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			snprintf(name, sizeof(name), "meta%d", i);
+			t = now_ns();
+			fd = fs_open(name);
+			if (fd < 0 || fs_stat(fd) != 0 || fs_close(fd))
+				errors++;
+			record(t);
+		}
+	}
+	report("open_stat_close", 0, 0, start, errors);
+	unmount();
+}
+
+/*
+ * Fill the disk, free every other file, then fill it again, so that the last
+ * allocations have to look for scattered free blocks
+ */
+static void bench_fill(void)
+{
+	char *buf, name[FS_FILENAME_LEN];
+	uint64_t start, t, bytes;
+	int fds[FS_OPEN_MAX_COUNT], errors = 0, ret;
+	int nfiles = FS_OPEN_MAX_COUNT;
+
+	buf = malloc(BENCH_FILL_CHUNK);
+	if (!buf)
+		die("Cannot allocate buffer");
+	memset(buf, 'f', BENCH_FILL_CHUNK);
+
+	mount_fresh();
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "fill%d", i);
+		fds[i] = open_new(name);
+	}
+
+	/* Round-robin appends, so that the files are interleaved on disk */
+	bytes = 0;
+	start = now_ns();
+	for (int full = 0; !full; ) {
+		for (int i = 0; i < nfiles && !full; i++) {
+			t = now_ns();
+			ret = fs_write(fds[i], buf, BENCH_FILL_CHUNK);
+			record(t);
+			if (ret < 0)
+				errors++;
+			if (ret != BENCH_FILL_CHUNK)
+				full = 1;
+			bytes += ret > 0 ? ret : 0;
+		}
+	}
+	report("fill", BENCH_FILL_CHUNK, bytes, start, errors);
+
+	for (int i = 0; i < nfiles; i += 2) {
+		snprintf(name, sizeof(name), "fill%d", i);
+		if (fs_close(fds[i]) || fs_delete(name))
+			die("Cannot delete '%s'", name);
+	}
+
+	/* Refill the holes left by the deleted files */
+	bytes = 0;
+	start = now_ns();
+	for (int i = 0; i < nfiles; i += 2) {
+		snprintf(name, sizeof(name), "fill%d", i);
+		fds[i] = open_new(name);
+	}
+	for (int full = 0; !full; ) {
+		for (int i = 0; i < nfiles && !full; i += 2) {
+			t = now_ns();
+			ret = fs_write(fds[i], buf, BENCH_FILL_CHUNK);
+			record(t);
+			if (ret < 0)
+				errors++;
+			if (ret != BENCH_FILL_CHUNK)
+				full = 1;
+			bytes += ret > 0 ? ret : 0;
+		}
+	}
+	report("refill_fragmented", BENCH_FILL_CHUNK, bytes, start, errors);
+
+	for (int i = 0; i < nfiles; i++)
+		fs_close(fds[i]);
+	unmount();
+	free(buf);
+}
+
+/*
+ * Mount a large image, stat one of its files and unmount it again, as short-lived
+ * tools do. The bytes reported are those the rounds read from the disk.
+ */
+static void bench_mount(void)
+{
+	struct fs_stats stats;
+	char name[FS_FILENAME_LEN], data[4096];
+	uint64_t start, t, bytes = 0;
+	int fd, errors = 0;
+
+	if (fs_format_version(image, BENCH_MOUNT_DATA_BLOCKS, FS_JOURNAL_AUTO,
+			      FS_VERSION_2) || fs_mount(image))
+		die("Cannot format '%s'", image);
+	memset(data, 'm', sizeof(data));
+	for (int i = 0; i < BENCH_MOUNT_FILES; i++) {
+		snprintf(name, sizeof(name), "mount%d", i);
+		fd = open_new(name);
+		if (fs_write(fd, data, sizeof(data)) != sizeof(data) || fs_close(fd))
+			die("Cannot write '%s'", name);
+	}
+	unmount();
+
+	rng_state = seed;
+	start = now_ns();
+	for (int r = 0; r < BENCH_MOUNT_ROUNDS; r++) {
+		snprintf(name, sizeof(name), "mount%d",
+			 (int)(rng() % BENCH_MOUNT_FILES));
+		t = now_ns();
+		if (fs_mount(image))
+			die("Cannot mount '%s'", image);
+		fd = fs_open(name);
+		if (fd < 0 || fs_stat(fd) != sizeof(data) || fs_close(fd))
+			errors++;
+		if (!fs_stats(&stats))
+			bytes += stats.disk_read_bytes;
+		unmount();
+		record(t);
+	}
+	report("mount_stat", 0, bytes, start, errors);
+}
+
+/* FAT entry @i the way fs.c read them before the scan kernels, -1 at the end
+ * of a chain */
+static __attribute__((noinline)) long fat_entry(const void *fat, int width,
+						size_t i)
+{
+	if (width == 2) {
+		uint16_t e = ((const uint16_t *)fat)[i];
+		return e == UINT16_MAX ? -1 : e;
+	}
+
+	uint32_t e = ((const uint32_t *)fat)[i];
+	return e == UINT32_MAX ? -1 : (long)e;
+}
+
+/*
+ * Fill @fat with @n entries of @width bytes: chains of 256 consecutive blocks
+ * for a full disk, or else random runs of free and used blocks, the used runs
+ * chaining to blocks anywhere on the disk
+ */
+static void fill_fat(void *fat, int width, size_t n, int fragmented)
+{
+	uint32_t eoc = width == 2 ? UINT16_MAX : UINT32_MAX;
+	uint32_t limit = n < eoc ? n : eoc - 1;
+
+	for (size_t i = 0; i < n; ) {
+		size_t len = fragmented ? 1 + rng() % 8 : 256;
+		int used = !fragmented || rng() % 2;
+
+		for (size_t j = 0; j < len && i < n; j++, i++) {
+			uint32_t e = !used ? 0 : j + 1 < len ? i + 1
+				   : rng() % 4 ? rng() % limit : eoc;
+
+			if (width == 2)
+				((uint16_t *)fat)[i] = e;
+			else
+				((uint32_t *)fat)[i] = e;
+		}
+	}
+}
+
+/* Count the free entries and add them to a free-space index, as mounts do */
+static size_t scan_free(const void *fat, int width, size_t n, int loop)
+{
+	uint64_t mask[BENCH_FAT_BLOCK_ENTRIES / 64];
+	struct freemap *map = freemap_create(n);
+	size_t count = 0;
+
+	if (!map)
+		die("Cannot allocate free-space index");
+	for (size_t i = 0; i < n; i += BENCH_FAT_BLOCK_ENTRIES) {
+		size_t len = n - i < BENCH_FAT_BLOCK_ENTRIES ?
+			n - i : BENCH_FAT_BLOCK_ENTRIES;
+
+		if (loop) {
+			for (size_t j = i; j < i + len; j++) {
+				if (fat_entry(fat, width, j) == 0) {
+					freemap_set_free(map, j);
+					count++;
+				}
+			}
+		} else {
+			count += fatscan_free_mask((const char *)fat + i * width,
+						   width, len, mask);
+			freemap_set_free_mask(map, i, mask, len);
+		}
+	}
+	if (freemap_count(map) != count)
+		count = 0;
+	freemap_destroy(map);
+	return count;
+}
+
+/* Measure every contiguous run of chains over the whole FAT, as reads and
+ * deletions of files do */
+static size_t scan_runs(const void *fat, int width, size_t n, int loop)
+{
+	size_t total = 0, run;
+
+	for (size_t i = 0; i < n; i += run + 1) {
+		if (loop) {
+			for (run = 0; i + run + 1 < n &&
+			     fat_entry(fat, width, i + run) == (long)(i + run + 1);
+			     run++)
+				;
+		} else {
+			run = fatscan_chain_run(fat, width, n - 1, i, n);
+		}
+		total += run;
+	}
+	return total;
+}
+
+/*
+ * Scan full and fragmented in-memory FATs for free entries and for
+ * contiguous chains, with the per-entry loops that fs.c used to have and
+ * with the kernels of each instruction set the CPU supports. The bytes
+ * reported are the FAT bytes scanned.
+ */
+static void bench_fat(void)
+{
+	static const char *const layouts[] = { "full", "fragmented" };
+	static const char *const scans[] = { "free", "runs" };
+	int isa = fatscan_isa();
+	void *fat = malloc(BENCH_FAT_ENTRIES * sizeof(uint32_t));
+
+	if (!fat)
+		die("Cannot allocate FAT");
+
+	for (int width = 2; width <= 4; width += 2) {
+		/* 16-bit FATs cannot be longer, they are scanned more often */
+		size_t n = width == 2 ? UINT16_MAX : BENCH_FAT_ENTRIES;
+		int rounds = BENCH_FAT_ROUNDS * (BENCH_FAT_ENTRIES / UINT16_MAX);
+
+		if (width != 2)
+			rounds = BENCH_FAT_ROUNDS;
+		for (int l = 0; l < 2; l++) {
+			rng_state = seed;
+			fill_fat(fat, width, n, l);
+
+			for (int s = 0; s < 2; s++) {
+				size_t expected = 0;
+
+				/* The loop first, then the kernels */
+				for (int k = -1; k <= FATSCAN_AVX2; k++) {
+					char name[64];
+					uint64_t start, t;
+					int errors = 0;
+
+					if (k >= 0 && fatscan_set_isa(k))
+						continue;
+					snprintf(name, sizeof(name), "fat%d_%s_%s_%s",
+						 width * 8, scans[s], layouts[l],
+						 k < 0 ? "loop" : fatscan_isa_name(k));
+					start = now_ns();
+					for (int r = 0; r < rounds; r++) {
+						size_t found;
+
+						t = now_ns();
+						found = s ? scan_runs(fat, width, n, k < 0)
+							  : scan_free(fat, width, n, k < 0);
+						record(t);
+						if (k < 0 && !r)
+							expected = found;
+						else if (found != expected)
+							errors++;
+					}
+					report(name, width, (uint64_t)rounds * n * width,
+					       start, errors);
+				}
+			}
+		}
+	}
+
+	fatscan_set_isa(isa);
+	free(fat);
+}
+
+static struct {
+	const char *name;
+	void (*func)(void);
+} workloads[] = {
+	{ "rw",		bench_rw },
+	{ "churn",	bench_churn },
+	{ "meta",	bench_meta },
+	{ "fill",	bench_fill },
+	{ "mount",	bench_mount },
+	{ "fat",	bench_fat },
+};
+
+static const char *const backends[] = { "fd", "mmap", "io_uring", "threads" };
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fs_bench.x [-f <scratch image>] [-s <seed>] "
+		"[-c <cache blocks>] [-D] [-b|--backend <backend>] "
+		"[-q|--queue-depth <requests>] [<workload>...]\n");
+	fprintf(stderr, "Possible backends are fd (default), mmap, io_uring "
+		"and threads\n");
+	fprintf(stderr, "Possible workloads are (all by default):\n");
+	for (size_t i = 0; i < ARRAY_SIZE(workloads); i++)
+		fprintf(stderr, "\t%s\n", workloads[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "backend",		required_argument, NULL, 'b' },
+		{ "queue-depth",	required_argument, NULL, 'q' },
+		{ NULL,			0,		   NULL, 0 },
+	};
+	int opt, ran = 0, backend = FS_BACKEND_DEFAULT;
+	unsigned depth = 0;
+
+	while ((opt = getopt_long(argc, argv, "f:s:c:Db:q:", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			image = optarg;
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			if (!seed)
+				die("Seed must not be 0");
+			break;
+		case 'c':
+			if (fs_cache_config(strtoul(optarg, NULL, 0), FS_CACHE_LRU))
+				die("Invalid cache size");
+			break;
+		case 'D':
+			fs_direct_config(1);
+			break;
+		case 'b':
+			for (backend = 0; backend < (int)ARRAY_SIZE(backends); backend++)
+				if (!strcmp(optarg, backends[backend]))
+					break;
+			if (backend == ARRAY_SIZE(backends))
+				die("Invalid backend '%s'", optarg);
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			if (!depth)
+				die("Queue depth must be at least 1");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (fs_backend_config(backend, depth))
+		die("Invalid backend");
+
+	for (size_t i = 0; i < ARRAY_SIZE(workloads); i++) {
+		int wanted = optind == argc;
+
+		for (int j = optind; j < argc; j++)
+			if (!strcmp(argv[j], workloads[i].name))
+				wanted = 1;
+		if (wanted) {
+			workloads[i].func();
+			ran++;
+		}
+	}
+	if (!ran)
+		usage();
+
+	unlink(image);
+	free(lat);
+
+	return 0;
+}
@@ -0,0 +1,477 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <trace.h>
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)			\
+do {					\
+	replay_error(__VA_ARGS__);	\
+	exit(1);			\
+} while (0)
+
+/* Bytes written at once when recreating the files of a trace */
+#define REPLAY_FILL_CHUNK (64 << 10)
+
+/* Options */
+static const char *image = "fs_replay.fs";
+static const char *replay_trace;
+static long cache_blocks = -1;
+static int direct, paced, print;
+
+/* Trace file loaded in memory */
+struct trace_data {
+	char *buf;
+	size_t len;
+	size_t pos;
+	struct trace_header header;
+};
+
+/* Block transfers found in a trace */
+struct block_totals {
+	uint64_t reads, read_blocks;
+	uint64_t writes, write_blocks;
+};
+
+/* Calls of one kind, as traced and as replayed */
+struct op_totals {
+	uint64_t calls;
+	uint64_t mismatches;
+	uint64_t trace_ns;
+	uint64_t replay_ns;
+};
+
+static struct op_totals ops[FS_OP_COUNT];
+
+/* Replay buffer, grown to the largest transfer */
+static char *data;
+static size_t data_size;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void load_trace(struct trace_data *t, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (!f)
+		die("Cannot open '%s'", path);
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+		die("Cannot read '%s'", path);
+
+	t->len = len;
+	t->buf = malloc(len ? len : 1);
+	if (!t->buf || fread(t->buf, 1, len, f) != (size_t)len)
+		die("Cannot read '%s'", path);
+	fclose(f);
+
+	if (t->len < sizeof(t->header))
+		die("'%s' is not a trace", path);
+	memcpy(&t->header, t->buf, sizeof(t->header));
+	if (memcmp(t->header.magic, TRACE_MAGIC, sizeof(t->header.magic))
+	    || t->header.record_size < sizeof(struct trace_record))
+		die("'%s' is not a trace", path);
+	t->pos = sizeof(t->header);
+}
+
+static int has_name(struct trace_record *rec)
+{
+	if (rec->type == TRACE_FILE)
+		return 1;
+	return rec->type == TRACE_CALL && (rec->op == FS_OP_CREATE
+					   || rec->op == FS_OP_DELETE
+					   || rec->op == FS_OP_OPEN);
+}
+
+/* Read the next record of @t and its filename, if any. Return 0 at the end */
+static int next_record(struct trace_data *t, struct trace_record *rec,
+		       char name[FS_FILENAME_LEN])
+{
+	if (t->pos == t->len)
+		return 0;
+	if (t->len - t->pos < t->header.record_size)
+		die("Truncated trace");
+	memcpy(rec, t->buf + t->pos, sizeof(*rec));
+	t->pos += t->header.record_size;
+
+	name[0] = '\0';
+	if (has_name(rec)) {
+		if (t->len - t->pos < rec->arg1)
+			die("Truncated trace");
+		/* Longer names are invalid anyway, and fail the same way */
+		snprintf(name, FS_FILENAME_LEN, "%.*s", (int)rec->arg1,
+			 t->buf + t->pos);
+		t->pos += rec->arg1;
+	}
+
+	return 1;
+}
+
+static void count_block(struct block_totals *b, struct trace_record *rec)
+{
+	if (rec->type == TRACE_READ) {
+		b->reads++;
+		b->read_blocks += rec->arg1;
+	} else if (rec->type == TRACE_WRITE) {
+		b->writes++;
+		b->write_blocks += rec->arg1;
+	}
+}
+
+static void *replay_buffer(size_t count)
+{
+	if (count > data_size) {
+		free(data);
+		data = malloc(count);
+		if (!data)
+			die("Cannot allocate %zu bytes", count);
+		memset(data, 0xA5, count);
+		data_size = count;
+	}
+	return data;
+}
+
+static void print_trace(struct trace_data *t)
+{
+	struct trace_record rec;
+	char name[FS_FILENAME_LEN];
+
+	printf("# Version %" PRIu32 ", %" PRIu32 " data blocks, "
+	       "%" PRIu32 " journal blocks, cache of %" PRIu32 " blocks "
+	       "(%s), %s\n", t->header.version,
+	       t->header.data_blocks, t->header.journal_blocks,
+	       t->header.cache_blocks,
+	       t->header.cache_policy == FS_CACHE_LRU ? "LRU" : "CLOCK",
+	       t->header.direct ? "O_DIRECT" : "buffered");
+
+	while (next_record(t, &rec, name)) {
+		printf("%14.3f t%-3u ", rec.time / 1e3, rec.thread);
+		switch (rec.type) {
+		case TRACE_CALL:
+			if (has_name(&rec))
+				printf("%s(\"%s\")", fs_op_name(rec.op), name);
+			else if (rec.op == FS_OP_SYNC)
+				printf("%s()", fs_op_name(rec.op));
+			else if (rec.op == FS_OP_CLOSE || rec.op == FS_OP_STAT)
+				printf("%s(%d)", fs_op_name(rec.op), rec.fd);
+			else if (rec.op == FS_OP_LSEEK)
+				printf("%s(%d, %" PRIu64 ")", fs_op_name(rec.op),
+				       rec.fd, rec.arg0);
+			else if (rec.op == FS_OP_READ || rec.op == FS_OP_WRITE)
+				printf("%s(%d, %" PRIu64 ")", fs_op_name(rec.op),
+				       rec.fd, rec.arg1);
+			else
+				printf("%s(%d, %" PRIu64 ", %" PRIu64 ")",
+				       fs_op_name(rec.op), rec.fd, rec.arg0,
+				       rec.arg1);
+			printf(" = %d [%.1f us]\n", rec.ret, rec.duration / 1e3);
+			break;
+		case TRACE_READ:
+		case TRACE_WRITE:
+			printf("%s %" PRIu64 "+%" PRIu64 "\n",
+			       rec.type == TRACE_READ ? "read" : "write",
+			       rec.arg0, rec.arg1);
+			break;
+		case TRACE_FILE:
+			printf("file \"%s\" %" PRIu64 " bytes\n", name, rec.arg0);
+			break;
+		case TRACE_END:
+			printf("end\n");
+			break;
+		default:
+			printf("unknown record %u\n", rec.type);
+		}
+	}
+}
+
+/* Recreate the files present when tracing started */
+static void create_files(struct trace_data *t)
+{
+	struct trace_record rec;
+	char name[FS_FILENAME_LEN];
+	fs_t *fs = fs_mount_ex(image);
+	void *buf = replay_buffer(REPLAY_FILL_CHUNK);
+
+	if (!fs)
+		die("Cannot mount '%s'", image);
+
+	while (next_record(t, &rec, name)) {
+		if (rec.type != TRACE_FILE)
+			continue;
+
+		int fd;
+		if (fs_create_ex(fs, name) || (fd = fs_open_ex(fs, name)) < 0)
+			die("Cannot create '%s'", name);
+		for (uint64_t done = 0; done < rec.arg0; done += REPLAY_FILL_CHUNK) {
+			size_t len = rec.arg0 - done < REPLAY_FILL_CHUNK ?
+				rec.arg0 - done : REPLAY_FILL_CHUNK;
+
+			if (fs_write_ex(fs, fd, buf, len) != len)
+				die("Cannot fill '%s'", name);
+		}
+		fs_close_ex(fs, fd);
+	}
+
+	if (fs_umount_ex(fs))
+		die("Cannot unmount '%s'", image);
+	t->pos = sizeof(t->header);
+}
+
+/* Issue the call of @rec on @fs, with the descriptors of the replay */
+static int replay_call(fs_t *fs, struct trace_record *rec, const char *name,
+		       int *fds)
+{
+	int fd = rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT ? fds[rec->fd] : -1;
+	int ret;
+
+	switch (rec->op) {
+	case FS_OP_CREATE:
+		return fs_create_ex(fs, name);
+	case FS_OP_DELETE:
+		return fs_delete_ex(fs, name);
+	case FS_OP_OPEN:
+		ret = fs_open_ex(fs, name);
+		if (rec->ret >= 0 && rec->ret < FS_OPEN_MAX_COUNT)
+			fds[rec->ret] = ret;
+		return ret;
+	case FS_OP_CLOSE:
+		ret = fs_close_ex(fs, fd);
+		if (!rec->ret && rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT)
+			fds[rec->fd] = -1;
+		return ret;
+	case FS_OP_STAT:
+		return fs_stat_ex(fs, fd);
+	case FS_OP_LSEEK:
+		return fs_lseek_ex(fs, fd, rec->arg0);
+	case FS_OP_READ:
+		return fs_read_ex(fs, fd, replay_buffer(rec->arg1), rec->arg1);
+	case FS_OP_WRITE:
+		return fs_write_ex(fs, fd, replay_buffer(rec->arg1), rec->arg1);
+	case FS_OP_PREAD:
+		return fs_pread_ex(fs, fd, replay_buffer(rec->arg1), rec->arg1,
+				   rec->arg0);
+	case FS_OP_PWRITE:
+		return fs_pwrite_ex(fs, fd, replay_buffer(rec->arg1), rec->arg1,
+				    rec->arg0);
+	case FS_OP_FALLOCATE:
+		return fs_fallocate_ex(fs, fd, rec->arg0, rec->arg1);
+	case FS_OP_SYNC:
+		return fs_sync_ex(fs);
+	}
+
+	die("Unknown call %u", rec->op);
+}
+
+static void replay(struct trace_data *t, struct block_totals *traced,
+		   uint64_t *trace_ns, uint64_t *replay_ns, unsigned *threads)
+{
+	struct trace_record rec;
+	char name[FS_FILENAME_LEN];
+	int fds[FS_OPEN_MAX_COUNT];
+	fs_t *fs;
+	uint64_t start;
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i] = -1;
+
+	fs_trace_config(replay_trace);
+	fs = fs_mount_ex(image);
+	fs_trace_config(NULL);
+	if (!fs)
+		die("Cannot mount '%s'", image);
+
+	start = now_ns();
+	while (next_record(t, &rec, name)) {
+		if (rec.thread > *threads)
+			*threads = rec.thread;
+		*trace_ns = rec.time;
+		if (rec.type != TRACE_CALL) {
+			count_block(traced, &rec);
+			continue;
+		}
+		if (rec.op >= FS_OP_COUNT)
+			die("Unknown call %u", rec.op);
+
+		/* Wait until the call started in the trace */
+		if (paced) {
+			uint64_t due = start + rec.time - rec.duration;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000,
+				.tv_nsec = due % 1000000000,
+			};
+
+			if (now_ns() < due)
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&ts, NULL);
+		}
+
+		uint64_t call = now_ns();
+		int ret = replay_call(fs, &rec, name, fds);
+		struct op_totals *op = &ops[rec.op];
+
+		op->replay_ns += now_ns() - call;
+		op->trace_ns += rec.duration;
+		op->calls++;
+		/* Descriptor numbers may differ, only their validity counts */
+		if (rec.op == FS_OP_OPEN ? (ret < 0) != (rec.ret < 0) : ret != rec.ret)
+			op->mismatches++;
+	}
+
+	if (fs_umount_ex(fs))
+		die("Cannot unmount '%s'", image);
+	*replay_ns = now_ns() - start;
+}
+
+static void report(struct trace_data *t, const char *path)
+{
+	struct block_totals traced = { 0 }, replayed = { 0 };
+	struct trace_data mine = { 0 };
+	struct trace_record rec;
+	char name[FS_FILENAME_LEN];
+	uint64_t trace_ns = 0, replay_ns = 0, calls = 0, mismatches = 0;
+	unsigned threads = 0;
+
+	replay(t, &traced, &trace_ns, &replay_ns, &threads);
+
+	/* The replay traced itself, its transfers are counted the same way */
+	load_trace(&mine, replay_trace);
+	while (next_record(&mine, &rec, name))
+		count_block(&replayed, &rec);
+	free(mine.buf);
+
+	for (int i = 0; i < FS_OP_COUNT; i++) {
+		struct op_totals *op = &ops[i];
+
+		if (!op->calls)
+			continue;
+		calls += op->calls;
+		mismatches += op->mismatches;
+		printf("{\"op\": \"%s\", \"calls\": %" PRIu64 ", "
+		       "\"mismatches\": %" PRIu64 ", "
+		       "\"trace_avg_us\": %.2f, \"replay_avg_us\": %.2f, "
+		       "\"trace_total_ms\": %.3f, \"replay_total_ms\": %.3f}\n",
+		       fs_op_name(i), op->calls, op->mismatches,
+		       op->trace_ns / 1e3 / op->calls,
+		       op->replay_ns / 1e3 / op->calls,
+		       op->trace_ns / 1e6, op->replay_ns / 1e6);
+	}
+
+	printf("{\"op\": \"total\", \"trace\": \"%s\", \"threads\": %u, "
+	       "\"calls\": %" PRIu64 ", \"mismatches\": %" PRIu64 ", "
+	       "\"paced\": %s, \"trace_ms\": %.3f, \"replay_ms\": %.3f, "
+	       "\"trace_block_reads\": %" PRIu64 ", "
+	       "\"trace_blocks_read\": %" PRIu64 ", "
+	       "\"trace_block_writes\": %" PRIu64 ", "
+	       "\"trace_blocks_written\": %" PRIu64 ", "
+	       "\"replay_block_reads\": %" PRIu64 ", "
+	       "\"replay_blocks_read\": %" PRIu64 ", "
+	       "\"replay_block_writes\": %" PRIu64 ", "
+	       "\"replay_blocks_written\": %" PRIu64 "}\n",
+	       path, threads, calls, mismatches, paced ? "true" : "false",
+	       trace_ns / 1e6, replay_ns / 1e6,
+	       traced.reads, traced.read_blocks,
+	       traced.writes, traced.write_blocks,
+	       replayed.reads, replayed.read_blocks,
+	       replayed.writes, replayed.write_blocks);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fs_replay.x [-f <scratch image>] "
+		"[-c <cache blocks>] [-D] [-r] [-o <replay trace>] <trace>\n");
+	fprintf(stderr, "       fs_replay.x -p <trace>\n");
+	fprintf(stderr, "\t-r\tkeep the timing of the trace (as fast as "
+		"possible otherwise)\n");
+	fprintf(stderr, "\t-o\tkeep the trace of the replay\n");
+	fprintf(stderr, "\t-p\tprint the trace instead of replaying it\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_data t = { 0 };
+	char *own_trace = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:c:Dro:p")) != -1) {
+		switch (opt) {
+		case 'f':
+			image = optarg;
+			break;
+		case 'c':
+			cache_blocks = strtol(optarg, NULL, 0);
+			if (cache_blocks < 0)
+				die("Invalid cache size");
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		case 'r':
+			paced = 1;
+			break;
+		case 'o':
+			replay_trace = optarg;
+			break;
+		case 'p':
+			print = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	load_trace(&t, argv[optind]);
+	if (print) {
+		print_trace(&t);
+		free(t.buf);
+		return 0;
+	}
+
+	/* Only the replay itself is traced, never over the trace it reads */
+	unsetenv("FS_TRACE");
+	if (!replay_trace) {
+		own_trace = malloc(strlen(image) + sizeof(".trace"));
+		if (!own_trace)
+			die("Cannot allocate memory");
+		sprintf(own_trace, "%s.trace", image);
+		replay_trace = own_trace;
+	}
+
+	/* Same image geometry and mount options as the trace, unless told otherwise */
+	if (fs_cache_config(cache_blocks >= 0 ? cache_blocks : t.header.cache_blocks,
+			    t.header.cache_policy))
+		die("Invalid cache configuration");
+	fs_direct_config(direct || t.header.direct);
+	if (fs_format_version(image, t.header.data_blocks,
+			      t.header.journal_blocks, t.header.version))
+		die("Cannot format '%s'", image);
+
+	create_files(&t);
+	report(&t, argv[optind]);
+
+	unlink(image);
+	if (own_trace)
+		unlink(own_trace);
+	free(own_trace);
+	free(t.buf);
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,544 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* <linux/io_uring.h> pulls in the kernel's own BLOCK_SIZE */
+#undef BLOCK_SIZE
+#include "aio.h"
+
+#define aio_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Worker threads of the fallback engine */
+#define AIO_MAX_THREADS 8
+
+enum aio_engine {
+	AIO_URING,
+	AIO_THREADS,
+};
+
+/* Request in flight, with its transfer progress */
+struct aio_slot {
+	struct block_req *req;
+	struct iovec iov;
+	off_t offset;
+};
+
+/* io_uring rings, mapped from the kernel */
+struct uring {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* SQEs filled but not handed to the kernel yet */
+	unsigned to_submit;
+};
+
+/* Worker thread pool */
+struct pool {
+	pthread_t threads[AIO_MAX_THREADS];
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	/* Rings of slot indexes waiting for a worker and completed */
+	unsigned *queue, qhead, qcount;
+	unsigned *completed, chead, ccount;
+	int stop;
+};
+
+struct aio {
+	enum aio_engine engine;
+	int fd;
+	unsigned depth;
+	struct aio_slot *slots;
+	/* Stack of unused slot indexes */
+	unsigned *free_slots, nfree;
+	/* A request reaped to make room for another one failed */
+	int failed;
+	union {
+		struct uring ring;
+		struct pool pool;
+	};
+};
+
+/* Move as much of @slot as one system call allows */
+static ssize_t slot_xfer(int fd, struct aio_slot *slot)
+{
+	if (slot->req->write)
+		return pwritev(fd, &slot->iov, 1, slot->offset);
+	return preadv(fd, &slot->iov, 1, slot->offset);
+}
+
+/* Account for @ret bytes moved; return 1 when the slot is finished */
+static int slot_advance(struct aio_slot *slot, ssize_t ret)
+{
+	if (ret == 0) {
+		aio_error("unexpected end of disk image");
+		slot->req->result = -1;
+		return 1;
+	}
+
+	slot->offset += ret;
+	slot->iov.iov_base = (char *)slot->iov.iov_base + ret;
+	slot->iov.iov_len -= ret;
+	if (slot->iov.iov_len)
+		return 0;
+
+	slot->req->result = 0;
+	return 1;
+}
+
+/*
+ * io_uring engine
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min, flags, NULL, 0);
+}
+
+static void uring_exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_init(struct uring *ring, unsigned depth)
+{
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(depth, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sq_ptr = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		ring->cq_ptr = ptr;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sqes = ptr;
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	return 0;
+
+fail:
+	uring_exit(ring);
+	return -1;
+}
+
+/* Fill an SQE for slot @s; the kernel sees it at the next enter */
+static void uring_queue(struct aio *aio, unsigned s)
+{
+	struct uring *ring = &aio->ring;
+	struct aio_slot *slot = &aio->slots[s];
+	unsigned tail = *ring->sq_tail;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = slot->req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = aio->fd;
+	sqe->addr = (uintptr_t)&slot->iov;
+	sqe->len = 1;
+	sqe->off = slot->offset;
+	sqe->user_data = s;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+static size_t uring_reap(struct aio *aio, size_t min, int *failed)
+{
+	struct uring *ring = &aio->ring;
+	size_t reaped = 0;
+
+	while (1) {
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		unsigned flags = 0, wait = 0;
+		int ret;
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe =
+				&ring->cqes[head & *ring->cq_mask];
+			unsigned s = cqe->user_data;
+			struct aio_slot *slot = &aio->slots[s];
+
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+				uring_queue(aio, s);
+				continue;
+			}
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror(slot->req->write ? "io_uring write" :
+				       "io_uring read");
+				slot->req->result = -1;
+			} else if (!slot_advance(slot, cqe->res)) {
+				/* Short transfer, send the rest */
+				uring_queue(aio, s);
+				continue;
+			}
+
+			if (slot->req->result)
+				*failed = 1;
+			__atomic_store_n(&slot->req->done, 1, __ATOMIC_RELEASE);
+			aio->free_slots[aio->nfree++] = s;
+			reaped++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (reaped < min && aio->nfree < aio->depth) {
+			flags = IORING_ENTER_GETEVENTS;
+			wait = 1;
+		}
+		if (!ring->to_submit && !wait)
+			return reaped;
+
+		ret = sys_io_uring_enter(ring->fd, ring->to_submit, wait, flags);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			perror("io_uring_enter");
+			return reaped;
+		}
+		ring->to_submit -= ret;
+	}
+}
+
+/* Hand the filled SQEs to the kernel without waiting for completions */
+static void uring_push(struct aio *aio)
+{
+	struct uring *ring = &aio->ring;
+	int ret;
+
+	while (ring->to_submit) {
+		ret = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Left for the next reap, which waits for room */
+			if (errno != EAGAIN && errno != EBUSY)
+				perror("io_uring_enter");
+			return;
+		}
+		ring->to_submit -= ret;
+	}
+}
+
+/*
+ * Thread pool engine
+ */
+
+static void *pool_worker(void *arg)
+{
+	struct aio *aio = arg;
+	struct pool *pool = &aio->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		unsigned s;
+		struct aio_slot *slot;
+		ssize_t ret;
+
+		while (!pool->qcount && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->qcount)
+			break;
+
+		s = pool->queue[pool->qhead];
+		pool->qhead = (pool->qhead + 1) % aio->depth;
+		pool->qcount--;
+		pthread_mutex_unlock(&pool->lock);
+
+		slot = &aio->slots[s];
+		while (1) {
+			ret = slot_xfer(aio->fd, slot);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				perror(slot->req->write ? "pwritev" : "preadv");
+				slot->req->result = -1;
+				break;
+			}
+			if (slot_advance(slot, ret))
+				break;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->completed[(pool->chead + pool->ccount) % aio->depth] = s;
+		pool->ccount++;
+		pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void pool_exit(struct aio *aio)
+{
+	struct pool *pool = &aio->pool;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->queue);
+	free(pool->completed);
+}
+
+static int pool_init(struct aio *aio)
+{
+	struct pool *pool = &aio->pool;
+	int n = aio->depth < AIO_MAX_THREADS ? aio->depth : AIO_MAX_THREADS;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->queue = malloc(aio->depth * sizeof(unsigned));
+	pool->completed = malloc(aio->depth * sizeof(unsigned));
+	if (!pool->queue || !pool->completed) {
+		free(pool->queue);
+		free(pool->completed);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (pool->nthreads = 0; pool->nthreads < n; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+				   pool_worker, aio))
+			break;
+	}
+	if (!pool->nthreads) {
+		pool_exit(aio);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void pool_queue(struct aio *aio, unsigned s)
+{
+	struct pool *pool = &aio->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queue[(pool->qhead + pool->qcount) % aio->depth] = s;
+	pool->qcount++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static size_t pool_reap(struct aio *aio, size_t min, int *failed)
+{
+	struct pool *pool = &aio->pool;
+	size_t reaped = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->ccount) {
+			unsigned s = pool->completed[pool->chead];
+
+			pool->chead = (pool->chead + 1) % aio->depth;
+			pool->ccount--;
+			if (aio->slots[s].req->result)
+				*failed = 1;
+			__atomic_store_n(&aio->slots[s].req->done, 1, __ATOMIC_RELEASE);
+			aio->free_slots[aio->nfree++] = s;
+			reaped++;
+		}
+		if (reaped >= min || aio->nfree == aio->depth)
+			break;
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return reaped;
+}
+
+/*
+ * Common interface
+ */
+
+struct aio *aio_create(int fd, unsigned depth, int uring)
+{
+	struct aio *aio;
+	unsigned i;
+
+	if (!depth)
+		depth = 1;
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio)
+		return NULL;
+
+	aio->fd = fd;
+	aio->depth = depth;
+	aio->slots = calloc(depth, sizeof(*aio->slots));
+	aio->free_slots = malloc(depth * sizeof(unsigned));
+	if (!aio->slots || !aio->free_slots)
+		goto fail;
+
+	for (i = 0; i < depth; i++)
+		aio->free_slots[i] = depth - 1 - i;
+	aio->nfree = depth;
+
+	if (uring && !uring_init(&aio->ring, depth)) {
+		aio->engine = AIO_URING;
+		return aio;
+	}
+
+	if (!pool_init(aio)) {
+		aio->engine = AIO_THREADS;
+		return aio;
+	}
+
+	aio_error("cannot start an asynchronous engine");
+fail:
+	free(aio->slots);
+	free(aio->free_slots);
+	free(aio);
+	return NULL;
+}
+
+void aio_destroy(struct aio *aio)
+{
+	int failed = 0;
+
+	aio_reap(aio, aio->depth, &failed);
+
+	if (aio->engine == AIO_URING)
+		uring_exit(&aio->ring);
+	else
+		pool_exit(aio);
+
+	free(aio->slots);
+	free(aio->free_slots);
+	free(aio);
+}
+
+const char *aio_name(struct aio *aio)
+{
+	return aio->engine == AIO_URING ? "io_uring" : "threads";
+}
+
+int aio_submit(struct aio *aio, struct block_req *req)
+{
+	struct aio_slot *slot;
+	unsigned s;
+	int failed = 0;
+
+	/* Make room by completing older requests (their results are set) */
+	if (!aio->nfree) {
+		aio_reap(aio, 1, &failed);
+		aio->failed |= failed;
+	}
+
+	s = aio->free_slots[--aio->nfree];
+	slot = &aio->slots[s];
+	slot->req = req;
+	slot->iov.iov_base = req->buf;
+	slot->iov.iov_len = req->count * BLOCK_SIZE;
+	slot->offset = (off_t)req->block * BLOCK_SIZE;
+	req->result = 0;
+	req->done = 0;
+
+	if (aio->engine == AIO_URING)
+		uring_queue(aio, s);
+	else
+		pool_queue(aio, s);
+
+	return 0;
+}
+
+void aio_push(struct aio *aio)
+{
+	if (aio->engine == AIO_URING)
+		uring_push(aio);
+}
+
+size_t aio_reap(struct aio *aio, size_t min, int *failed)
+{
+	if (aio->failed) {
+		*failed = 1;
+		aio->failed = 0;
+	}
+
+	if (aio->engine == AIO_URING)
+		return uring_reap(aio, min, failed);
+	return pool_reap(aio, min, failed);
+}
+
+size_t aio_inflight(struct aio *aio)
+{
+	return aio->depth - aio->nfree;
+}
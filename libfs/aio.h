@@ -0,0 +1,90 @@
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <stddef.h>
+
+#include "disk.h"
+
+/*
+ * Asynchronous engines behind the %BLOCK_BACKEND_ASYNC disk backend. This
+ * header is private to libfs; users go through block_submit() and friends.
+ */
+
+/** Opaque engine instance */
+struct aio;
+
+/**
+ * aio_create - Start an asynchronous engine on a virtual disk file
+ * @fd: File descriptor of the virtual disk file
+ * @depth: Maximum number of requests in flight
+ * @uring: Try io_uring first
+ *
+ * Use io_uring if @uring is set and the kernel allows it, and fall back to a
+ * pool of worker threads otherwise.
+ *
+ * Return: NULL if no engine can be started. The engine otherwise.
+ */
+struct aio *aio_create(int fd, unsigned depth, int uring);
+
+/**
+ * aio_destroy - Stop an asynchronous engine
+ * @aio: Engine to stop
+ *
+ * Wait for requests still in flight, then release the engine.
+ */
+void aio_destroy(struct aio *aio);
+
+/**
+ * aio_name - Get engine name
+ * @aio: Engine
+ *
+ * Return: "io_uring" or "threads".
+ */
+const char *aio_name(struct aio *aio);
+
+/**
+ * aio_submit - Queue a request
+ * @aio: Engine
+ * @req: Request to queue, already checked against the disk bounds
+ *
+ * If @aio already has its maximum number of requests in flight, wait for one of
+ * them to complete first. @req must stay valid until it has been reaped.
+ *
+ * Return: -1 if the request cannot be queued. 0 otherwise.
+ */
+int aio_submit(struct aio *aio, struct block_req *req);
+
+/**
+ * aio_push - Start queued requests
+ * @aio: Engine
+ *
+ * Hand the requests queued by aio_submit() to the engine without waiting for
+ * any of them, so that they make progress while the caller does something
+ * else. Worker threads pick requests up as soon as they are queued; io_uring
+ * only sees them once pushed (or reaped).
+ */
+void aio_push(struct aio *aio);
+
+/**
+ * aio_reap - Wait for requests to complete
+ * @aio: Engine
+ * @min: Minimum number of requests to wait for
+ * @failed: Set to 1 if one of the reaped requests failed (left alone otherwise)
+ *
+ * Push queued requests to the engine and wait until at least @min of them
+ * (capped to the number of requests in flight) have completed. The result of
+ * every reaped request is set.
+ *
+ * Return: Number of requests reaped.
+ */
+size_t aio_reap(struct aio *aio, size_t min, int *failed);
+
+/**
+ * aio_inflight - Get number of requests in flight
+ * @aio: Engine
+ *
+ * Return: Number of requests submitted but not reaped yet.
+ */
+size_t aio_inflight(struct aio *aio);
+
+#endif /* _AIO_H */
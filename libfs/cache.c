@@ -0,0 +1,777 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of a hash chain or of the LRU list */
+#define NIL -1
+
+/* Largest request submitted to an asynchronous backend (128 KiB) */
+#define CACHE_IO_MAX_BLOCKS 32
+
+/* Disk request issued on behalf of a cache caller */
+struct cache_req {
+	struct block_req req;
+	/* Cache the request was issued on */
+	struct cache *cache;
+	struct cache_req *next;
+};
+
+/* Readahead of consecutive blocks, installed in the cache once it is read */
+struct cache_fill {
+	struct block_req req;
+	struct cache_fill *next;
+};
+
+/* Cached block description */
+struct cache_entry {
+	/* Disk block held by this entry */
+	size_t block;
+	/* Content was modified and must be written back */
+	int dirty;
+	/* Referenced since the clock hand last passed (CLOCK policy) */
+	int ref;
+	/* Being written back by cache_flush(), so not to be evicted */
+	int flushing;
+	/* Next entry in the same hash bucket */
+	int hnext;
+	/* Neighbours in recency order (LRU policy) */
+	int prev, next;
+};
+
+/* Cache instance description */
+struct cache {
+	/* Virtual disk behind the cache */
+	struct disk *disk;
+	enum cache_policy policy;
+	/* Number of entries */
+	size_t capacity;
+	/* Number of entries in use */
+	size_t used;
+	struct cache_entry *entries;
+	/* Block contents, one BLOCK_SIZE slot per entry */
+	uint8_t *data;
+	/* Hash table of entry chains, indexed by block number */
+	int *buckets;
+	size_t nbuckets;
+	/* Most and least recently used entries (LRU policy) */
+	int head, tail;
+	/* Clock hand (CLOCK policy) */
+	size_t hand;
+	/* Readaheads in flight, newest first, and their total number of blocks */
+	struct cache_fill *fills;
+	size_t fill_blocks;
+	struct cache_stats stats;
+	/* A cache_flush() is writing, and signalled once it is done */
+	int flushing;
+	pthread_cond_t flushed;
+	/* Protects everything above; never held during bulk transfers */
+	pthread_mutex_t lock;
+};
+
+/* Block written back by cache_flush() */
+struct cache_flushed {
+	size_t block;
+	int entry;
+	int failed;
+};
+
+/* Disk requests submitted by this thread and not completed yet */
+static __thread struct cache_req *pending;
+
+static void *entry_data(struct cache *c, int e)
+{
+	return c->data + (size_t)e * BLOCK_SIZE;
+}
+
+static size_t hash_block(struct cache *c, size_t block)
+{
+	return (block * 2654435761u) & (c->nbuckets - 1);
+}
+
+static int hash_lookup(struct cache *c, size_t block)
+{
+	int e;
+
+	for (e = c->buckets[hash_block(c, block)]; e != NIL;
+	     e = c->entries[e].hnext)
+		if (c->entries[e].block == block)
+			return e;
+
+	return NIL;
+}
+
+static void hash_insert(struct cache *c, int e)
+{
+	size_t b = hash_block(c, c->entries[e].block);
+
+	c->entries[e].hnext = c->buckets[b];
+	c->buckets[b] = e;
+}
+
+static void hash_remove(struct cache *c, int e)
+{
+	int *link = &c->buckets[hash_block(c, c->entries[e].block)];
+
+	while (*link != e)
+		link = &c->entries[*link].hnext;
+	*link = c->entries[e].hnext;
+}
+
+static void lru_unlink(struct cache *c, int e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	if (ent->prev != NIL)
+		c->entries[ent->prev].next = ent->next;
+	else
+		c->head = ent->next;
+	if (ent->next != NIL)
+		c->entries[ent->next].prev = ent->prev;
+	else
+		c->tail = ent->prev;
+}
+
+static void lru_push_front(struct cache *c, int e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	ent->prev = NIL;
+	ent->next = c->head;
+	if (c->head != NIL)
+		c->entries[c->head].prev = e;
+	c->head = e;
+	if (c->tail == NIL)
+		c->tail = e;
+}
+
+static void lru_push_back(struct cache *c, int e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	ent->next = NIL;
+	ent->prev = c->tail;
+	if (c->tail != NIL)
+		c->entries[c->tail].next = e;
+	c->tail = e;
+	if (c->head == NIL)
+		c->head = e;
+}
+
+/* Record an access to entry @e */
+static void touch(struct cache *c, int e)
+{
+	if (c->policy == CACHE_POLICY_LRU) {
+		if (c->head != e) {
+			lru_unlink(c, e);
+			lru_push_front(c, e);
+		}
+	} else {
+		c->entries[e].ref = 1;
+	}
+}
+
+static int write_back(struct cache *c, int e)
+{
+	if (block_write(c->disk, c->entries[e].block, entry_data(c, e)))
+		return -1;
+
+	c->entries[e].dirty = 0;
+	c->stats.writebacks++;
+	return 0;
+}
+
+/* Pick the entry to reuse for a new block, writing it back if needed */
+static int find_victim(struct cache *c)
+{
+	struct cache_entry *ent;
+	size_t n;
+	int e;
+
+	if (c->used < c->capacity)
+		return c->used++;
+
+	/* Blocks being flushed stay until their write is done */
+	for (;;) {
+		if (c->policy == CACHE_POLICY_LRU) {
+			for (e = c->tail; e != NIL && c->entries[e].flushing;
+			     e = c->entries[e].prev)
+				;
+		} else {
+			/* Two turns clear every reference bit */
+			for (e = NIL, n = 0; e == NIL && n < 2 * c->capacity;
+			     n++) {
+				ent = &c->entries[c->hand];
+				if (!ent->flushing && !ent->ref)
+					e = c->hand;
+				else if (!ent->flushing)
+					ent->ref = 0;
+				c->hand = (c->hand + 1) % c->capacity;
+			}
+		}
+		if (e != NIL)
+			break;
+		pthread_cond_wait(&c->flushed, &c->lock);
+	}
+
+	if (c->entries[e].dirty && write_back(c, e))
+		return NIL;
+
+	hash_remove(c, e);
+	if (c->policy == CACHE_POLICY_LRU)
+		lru_unlink(c, e);
+	c->stats.evictions++;
+
+	return e;
+}
+
+/*
+ * Bind a free or evicted entry to @block, filling it from disk if @fill is set.
+ * An entry that could not be filled is parked as the next eviction candidate.
+ */
+static int install(struct cache *c, size_t block, int fill)
+{
+	int e = find_victim(c);
+	int failed;
+
+	if (e == NIL)
+		return NIL;
+
+	failed = fill && block_read(c->disk, block, entry_data(c, e));
+
+	c->entries[e].block = failed ? SIZE_MAX : block;
+	c->entries[e].dirty = 0;
+	c->entries[e].ref = !failed;
+	hash_insert(c, e);
+	if (c->policy == CACHE_POLICY_LRU) {
+		if (failed)
+			lru_push_back(c, e);
+		else
+			lru_push_front(c, e);
+	}
+
+	return failed ? NIL : e;
+}
+
+/* Wait for readahead @f, unlinked by the caller, and install what it read */
+static void fill_settle(struct cache *c, struct cache_fill *f)
+{
+	size_t i;
+	int e;
+
+	c->fill_blocks -= f->req.count;
+	if (!block_wait_req(c->disk, &f->req)) {
+		for (i = 0; i < f->req.count; i++) {
+			if (hash_lookup(c, f->req.block + i) != NIL)
+				continue;
+			e = install(c, f->req.block + i, 0);
+			if (e == NIL)
+				break;
+			memcpy(entry_data(c, e), f->req.buf + i * BLOCK_SIZE,
+			       BLOCK_SIZE);
+			c->stats.readahead++;
+		}
+	}
+
+	free(f->req.buf);
+	free(f);
+}
+
+/*
+ * Settle the readaheads overlapping blocks [@block, @block + @count), or
+ * those that are already done if @count is 0
+ */
+static void fill_settle_range(struct cache *c, size_t block, size_t count)
+{
+	struct cache_fill **link = &c->fills, *f;
+
+	while ((f = *link)) {
+		if (count ? f->req.block < block + count &&
+			    block < f->req.block + f->req.count :
+			    __atomic_load_n(&f->req.done, __ATOMIC_ACQUIRE)) {
+			*link = f->next;
+			fill_settle(c, f);
+		} else {
+			link = &f->next;
+		}
+	}
+}
+
+/* Whether a readahead in flight covers @block */
+static int fill_covers(struct cache *c, size_t block)
+{
+	struct cache_fill *f;
+
+	for (f = c->fills; f; f = f->next)
+		if (f->req.block <= block && block < f->req.block + f->req.count)
+			return 1;
+
+	return 0;
+}
+
+/* Find the entry holding @block, once any readahead of it has landed */
+static int lookup(struct cache *c, size_t block)
+{
+	if (c->fills)
+		fill_settle_range(c, block, 1);
+
+	return hash_lookup(c, block);
+}
+
+struct cache *cache_create(struct disk *disk, size_t capacity,
+			   enum cache_policy policy)
+{
+	struct cache *c;
+	size_t i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->flushed, NULL);
+	c->disk = disk;
+	c->policy = policy;
+	c->capacity = capacity;
+	c->head = c->tail = NIL;
+
+	if (capacity) {
+		for (c->nbuckets = 1; c->nbuckets < 2 * capacity;
+		     c->nbuckets <<= 1)
+			;
+		c->entries = calloc(capacity, sizeof(*c->entries));
+		c->buckets = malloc(c->nbuckets * sizeof(int));
+		if (!c->entries || !c->buckets ||
+		    posix_memalign((void **)&c->data, BLOCK_SIZE,
+				   capacity * BLOCK_SIZE)) {
+			cache_error("cannot allocate %zu blocks", capacity);
+			free(c->entries);
+			free(c->buckets);
+			pthread_cond_destroy(&c->flushed);
+			pthread_mutex_destroy(&c->lock);
+			free(c);
+			return NULL;
+		}
+		for (i = 0; i < c->nbuckets; i++)
+			c->buckets[i] = NIL;
+	}
+
+	return c;
+}
+
+int cache_destroy(struct cache *c)
+{
+	int ret;
+
+	if (!c) {
+		cache_error("no cache set up");
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	fill_settle_range(c, 0, SIZE_MAX);
+	pthread_mutex_unlock(&c->lock);
+
+	ret = cache_flush(c);
+	if (cache_complete(c))
+		ret = -1;
+
+	free(c->entries);
+	free(c->buckets);
+	free(c->data);
+	pthread_cond_destroy(&c->flushed);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+
+	return ret;
+}
+
+int cache_read(struct cache *c, size_t block, void *buf)
+{
+	int e;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->capacity) {
+		c->stats.misses++;
+		pthread_mutex_unlock(&c->lock);
+		return block_read(c->disk, block, buf);
+	}
+
+	e = lookup(c, block);
+	if (e != NIL) {
+		c->stats.hits++;
+		touch(c, e);
+	} else {
+		c->stats.misses++;
+		e = install(c, block, 1);
+	}
+
+	if (e != NIL)
+		memcpy(buf, entry_data(c, e), BLOCK_SIZE);
+	pthread_mutex_unlock(&c->lock);
+
+	return e == NIL ? -1 : 0;
+}
+
+int cache_write(struct cache *c, size_t block, const void *buf)
+{
+	int e;
+
+	if (!c->capacity)
+		return block_write(c->disk, block, buf);
+
+	pthread_mutex_lock(&c->lock);
+	e = lookup(c, block);
+	if (e != NIL) {
+		c->stats.hits++;
+		touch(c, e);
+	} else {
+		/* The whole block is overwritten, no need to read it first */
+		c->stats.misses++;
+		e = install(c, block, 0);
+	}
+
+	if (e != NIL) {
+		memcpy(entry_data(c, e), buf, BLOCK_SIZE);
+		c->entries[e].dirty = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return e == NIL ? -1 : 0;
+}
+
+/* Hand blocks [@block, @block + @count) of @buf to the disk */
+static int submit(struct cache *c, int write, size_t block, size_t count,
+		  void *buf)
+{
+	size_t chunk = count;
+
+	/* Several smaller requests keep an asynchronous queue busy */
+	if (block_disk_backend(c->disk) == BLOCK_BACKEND_URING ||
+	    block_disk_backend(c->disk) == BLOCK_BACKEND_THREADS)
+		chunk = CACHE_IO_MAX_BLOCKS;
+
+	while (count) {
+		struct cache_req *creq = malloc(sizeof(*creq));
+		size_t n = count < chunk ? count : chunk;
+
+		if (!creq)
+			return -1;
+
+		creq->req.write = write;
+		creq->req.block = block;
+		creq->req.count = n;
+		creq->req.buf = buf;
+		creq->cache = c;
+		if (block_submit(c->disk, &creq->req, 1)) {
+			free(creq);
+			return -1;
+		}
+		creq->next = pending;
+		pending = creq;
+
+		block += n;
+		buf += n * BLOCK_SIZE;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int cache_submit_read(struct cache *c, size_t block, size_t count, void *buf)
+{
+	size_t i = 0, run;
+	int e;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->capacity) {
+		c->stats.misses += count;
+		pthread_mutex_unlock(&c->lock);
+		return submit(c, 0, block, count, buf);
+	}
+
+	while (i < count) {
+		e = lookup(c, block + i);
+		if (e != NIL) {
+			c->stats.hits++;
+			touch(c, e);
+			memcpy(buf + i * BLOCK_SIZE, entry_data(c, e), BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		/* Read the whole run of uncached blocks at once */
+		for (run = 1; i + run < count; run++)
+			if (lookup(c, block + i + run) != NIL)
+				break;
+		c->stats.misses += run;
+
+		/* Other threads can use the cache during the transfer */
+		pthread_mutex_unlock(&c->lock);
+		if (submit(c, 0, block + i, run, buf + i * BLOCK_SIZE))
+			return -1;
+		pthread_mutex_lock(&c->lock);
+		i += run;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+int cache_submit_write(struct cache *c, size_t block, size_t count,
+		       const void *buf)
+{
+	size_t i;
+	int e;
+
+	if (!c->capacity)
+		return submit(c, 1, block, count, (void *)buf);
+
+	/*
+	 * A readahead still in flight would bring back the old content, and an
+	 * eviction writing back a dirty copy could land after this write
+	 */
+	pthread_mutex_lock(&c->lock);
+	if (c->fills)
+		fill_settle_range(c, block, count);
+	for (i = 0; i < count; i++) {
+		e = hash_lookup(c, block + i);
+		if (e != NIL)
+			c->entries[e].dirty = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (submit(c, 1, block, count, (void *)buf))
+		return -1;
+
+	/* Keep cached copies coherent with what is now on disk */
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < count; i++) {
+		e = hash_lookup(c, block + i);
+		if (e == NIL)
+			continue;
+		memcpy(entry_data(c, e), buf + i * BLOCK_SIZE, BLOCK_SIZE);
+		/* A flush in progress may still write the older copy */
+		c->entries[e].dirty = c->entries[e].flushing;
+		touch(c, e);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+int cache_complete(struct cache *c)
+{
+	struct cache_req **link = &pending;
+	int ret = 0;
+
+	while (*link) {
+		struct cache_req *creq = *link;
+
+		/* Leave the requests issued on other caches to their callers */
+		if (creq->cache != c) {
+			link = &creq->next;
+			continue;
+		}
+
+		if (block_wait_req(c->disk, &creq->req))
+			ret = -1;
+		*link = creq->next;
+		free(creq);
+	}
+
+	return ret;
+}
+
+int cache_prefetch(struct cache *c, size_t block, size_t count)
+{
+	struct cache_fill *f;
+	size_t i = 0, run;
+
+	if (!c->capacity || !count)
+		return 0;
+
+	pthread_mutex_lock(&c->lock);
+	fill_settle_range(c, 0, 0);
+
+	while (i < count) {
+		if (hash_lookup(c, block + i) != NIL || fill_covers(c, block + i)) {
+			i++;
+			continue;
+		}
+		for (run = 1; i + run < count && run < CACHE_IO_MAX_BLOCKS; run++)
+			if (hash_lookup(c, block + i + run) != NIL ||
+			    fill_covers(c, block + i + run))
+				break;
+
+		/* Readahead must not push the working set out */
+		if (c->fill_blocks + run > c->capacity / 2)
+			break;
+
+		f = calloc(1, sizeof(*f));
+		if (!f || posix_memalign(&f->req.buf, BLOCK_SIZE,
+					 run * BLOCK_SIZE)) {
+			free(f);
+			break;
+		}
+		f->req.block = block + i;
+		f->req.count = run;
+		if (block_submit_async(c->disk, &f->req, 1)) {
+			free(f->req.buf);
+			free(f);
+			break;
+		}
+		f->next = c->fills;
+		c->fills = f;
+		c->fill_blocks += run;
+		i += run;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return i == count ? 0 : -1;
+}
+
+int cache_read_range(struct cache *c, size_t block, size_t count, void *buf)
+{
+	int ret = cache_submit_read(c, block, count, buf);
+
+	return cache_complete(c) || ret ? -1 : 0;
+}
+
+int cache_write_range(struct cache *c, size_t block, size_t count,
+		      const void *buf)
+{
+	int ret = cache_submit_write(c, block, count, buf);
+
+	return cache_complete(c) || ret ? -1 : 0;
+}
+
+void cache_discard(struct cache *c, size_t block, size_t count)
+{
+	size_t i;
+	int e;
+
+	if (!c->capacity)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->fills)
+		fill_settle_range(c, block, count);
+	for (i = 0; i < count; i++) {
+		e = hash_lookup(c, block + i);
+		if (e == NIL)
+			continue;
+		memset(entry_data(c, e), 0, BLOCK_SIZE);
+		c->entries[e].dirty = c->entries[e].flushing;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int cmp_flushed(const void *a, const void *b)
+{
+	size_t ba = ((const struct cache_flushed *)a)->block;
+	size_t bb = ((const struct cache_flushed *)b)->block;
+
+	return (ba > bb) - (ba < bb);
+}
+
+int cache_flush(struct cache *c)
+{
+	struct cache_flushed *dirty;
+	uint8_t *snap = NULL;
+	size_t i, j, k, n = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	/* One flush at a time, so that each waits for what was dirty before */
+	while (c->flushing)
+		pthread_cond_wait(&c->flushed, &c->lock);
+	if (!c->used) {
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+
+	dirty = malloc(c->used * sizeof(*dirty));
+	if (!dirty) {
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+
+	for (i = 0; i < c->used; i++) {
+		if (!c->entries[i].dirty)
+			continue;
+		dirty[n].block = c->entries[i].block;
+		dirty[n].entry = i;
+		dirty[n++].failed = 0;
+	}
+
+	if (n && posix_memalign((void **)&snap, BLOCK_SIZE, n * BLOCK_SIZE)) {
+		pthread_mutex_unlock(&c->lock);
+		free(dirty);
+		return -1;
+	}
+
+	/* Sequential order lets consecutive blocks go out in one write */
+	qsort(dirty, n, sizeof(*dirty), cmp_flushed);
+
+	/*
+	 * Snapshot the dirty blocks and write the copy with the lock released.
+	 * Entries modified meanwhile are dirty again once the write is done.
+	 */
+	for (i = 0; i < n; i++) {
+		memcpy(snap + i * BLOCK_SIZE, entry_data(c, dirty[i].entry),
+		       BLOCK_SIZE);
+		c->entries[dirty[i].entry].dirty = 0;
+		c->entries[dirty[i].entry].flushing = 1;
+	}
+	c->flushing = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n &&
+		     dirty[j].block == dirty[i].block + (j - i); j++)
+			;
+		if (!block_write_range(c->disk, dirty[i].block, j - i,
+				       snap + i * BLOCK_SIZE))
+			continue;
+		for (k = i; k < j; k++)
+			dirty[k].failed = 1;
+		ret = -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < n; i++) {
+		c->entries[dirty[i].entry].flushing = 0;
+		if (dirty[i].failed)
+			c->entries[dirty[i].entry].dirty = 1;
+		else
+			c->stats.writebacks++;
+	}
+	c->flushing = 0;
+	pthread_cond_broadcast(&c->flushed);
+	pthread_mutex_unlock(&c->lock);
+
+	free(snap);
+	free(dirty);
+	return ret;
+}
+
+void cache_get_stats(struct cache *c, struct cache_stats *stats)
+{
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+size_t cache_capacity(struct cache *c)
+{
+	return c->capacity;
+}
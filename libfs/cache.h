@@ -0,0 +1,216 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+/*
+ * Write-back block cache in front of a virtual disk. All functions can be
+ * called from several threads at once, except cache_create() and
+ * cache_destroy().
+ */
+
+/** Opaque block cache */
+struct cache;
+
+/** Block replacement policies */
+enum cache_policy {
+	/* Evict the least recently used block */
+	CACHE_POLICY_LRU,
+	/* Second-chance approximation of LRU */
+	CACHE_POLICY_CLOCK,
+};
+
+/** Cache activity counters */
+struct cache_stats {
+	/* Block lookups served from memory */
+	uint64_t hits;
+	/* Block lookups that had to go to disk */
+	uint64_t misses;
+	/* Blocks dropped to make room for others */
+	uint64_t evictions;
+	/* Dirty blocks written back to disk */
+	uint64_t writebacks;
+	/* Blocks brought in by cache_prefetch() */
+	uint64_t readahead;
+};
+
+/**
+ * cache_create - Set up a block cache
+ * @disk: Virtual disk to cache
+ * @capacity: Number of blocks the cache can hold
+ * @policy: Replacement policy
+ *
+ * Set up a write-back cache of @capacity blocks in front of virtual disk
+ * @disk. A @capacity of 0 disables caching: every access then goes straight to
+ * block_read() or block_write().
+ *
+ * Return: NULL if memory cannot be allocated. The cache otherwise.
+ */
+struct cache *cache_create(struct disk *disk, size_t capacity,
+			   enum cache_policy policy);
+
+/**
+ * cache_destroy - Tear down a block cache
+ * @c: Cache to release
+ *
+ * Write back every dirty block and release the cache memory.
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_destroy(struct cache *c);
+
+/**
+ * cache_read - Read a block through the cache
+ * @c: Cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block is not in the cache and cannot be read from disk. 0
+ * otherwise.
+ */
+int cache_read(struct cache *c, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @c: Cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty; it reaches the disk when it is evicted or
+ * when cache_flush() is called.
+ *
+ * Return: -1 if room cannot be made for the block. 0 otherwise.
+ */
+int cache_write(struct cache *c, size_t block, const void *buf);
+
+/**
+ * cache_read_range - Read consecutive blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Same as cache_submit_read() followed by cache_complete().
+ *
+ * Return: -1 if a run of blocks cannot be read from disk. 0 otherwise.
+ */
+int cache_read_range(struct cache *c, size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_range - Write consecutive blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as cache_submit_write() followed by cache_complete().
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_range(struct cache *c, size_t block, size_t count,
+		      const void *buf);
+
+/**
+ * cache_submit_read - Start reading consecutive blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Cached blocks are copied from memory right away, and every run of blocks
+ * that is not cached is submitted to the disk with block_submit() (split in
+ * pieces with an asynchronous backend, so that several are in flight). Blocks
+ * read from disk this way bypass the cache, so that bulk transfers don't evict
+ * the working set. @buf is only complete after cache_complete().
+ *
+ * Return: -1 if the disk requests cannot be submitted. 0 otherwise.
+ */
+int cache_submit_read(struct cache *c, size_t block, size_t count, void *buf);
+
+/**
+ * cache_submit_write - Start writing consecutive blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * The blocks are submitted to the disk with block_submit(), and cached copies
+ * of the blocks are updated and marked clean. @buf must not change until
+ * cache_complete().
+ *
+ * Return: -1 if the disk requests cannot be submitted. 0 otherwise.
+ */
+int cache_submit_write(struct cache *c, size_t block, size_t count,
+		       const void *buf);
+
+/**
+ * cache_prefetch - Start reading consecutive blocks into the cache
+ * @c: Cache
+ * @block: Index of the first block to read ahead
+ * @count: Number of blocks to read ahead
+ *
+ * Submit a read of every run of blocks that is neither cached nor already
+ * being read ahead, without waiting for it. The blocks are installed in the
+ * cache when they are next looked up, or when a later call finds their read
+ * done; a lookup of a block still in flight waits for it. The reads go
+ * through block_submit_async(), so they run in the background whatever the
+ * backend. At most half of the cache is in flight at once, so that readahead
+ * cannot push the working set out.
+ *
+ * Return: -1 if some of the blocks could not be submitted. 0 otherwise.
+ */
+int cache_prefetch(struct cache *c, size_t block, size_t count);
+
+/**
+ * cache_complete - Wait for submitted transfers
+ * @c: Cache
+ *
+ * Wait for every request issued on @c by cache_submit_read() and
+ * cache_submit_write() in the calling thread since its previous call.
+ *
+ * Return: -1 if one of the requests failed. 0 otherwise.
+ */
+int cache_complete(struct cache *c);
+
+/**
+ * cache_discard - Forget the content of consecutive blocks
+ * @c: Cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Cached copies of the blocks are zeroed and marked clean, dropping pending
+ * writes, to match blocks that the caller is about to zero or punch out on
+ * disk.
+ */
+void cache_discard(struct cache *c, size_t block, size_t count);
+
+/**
+ * cache_flush - Write back all dirty blocks
+ * @c: Cache
+ *
+ * Dirty blocks are written in ascending block order, each run of consecutive
+ * blocks with a single call to block_writev(), and stay cached (clean).
+ *
+ * Return: -1 if one of the blocks could not be written. 0 otherwise.
+ */
+int cache_flush(struct cache *c);
+
+/**
+ * cache_get_stats - Get cache activity counters
+ * @c: Cache
+ * @stats: Counters to fill
+ */
+void cache_get_stats(struct cache *c, struct cache_stats *stats);
+
+/**
+ * cache_capacity - Get cache size
+ * @c: Cache
+ *
+ * Return: Number of blocks the cache can hold (0 if caching is disabled).
+ */
+size_t cache_capacity(struct cache *c);
+
+#endif /* _CACHE_H */
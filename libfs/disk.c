@@ -1,17 +1,29 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "aio.h"
 #include "disk.h"
+#include "trace.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Maximum number of buffers per vectored call (the Linux limit) */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /* Disk instance description */
 struct disk {
@@ -19,126 +31,646 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Backend used to access the blocks */
+	enum block_backend backend;
+	/* Mapping of the whole image (mmap backend) */
+	char *map;
+	/* Engine keeping requests in flight (asynchronous backends) */
+	struct aio *aio;
+	/* Worker threads serving block_submit_async() (other backends, started
+	 * on first use) */
+	struct aio *workers;
+	/* Requests executed on submission and not reaped yet */
+	size_t sync_done;
+	/* A request reaped since the last block_wait() failed */
+	int failed;
+	/* Opened with O_DIRECT, bypassing the host page cache */
+	int direct;
+	/* Transfers issued so far, updated atomically */
+	struct block_stats stats;
+	/* Trace recording the transfers, if any */
+	struct trace *trace;
+	/* Serializes request submission and reaping */
+	pthread_mutex_t lock;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Backend and queue depth used by the next block_disk_open() */
+static enum block_backend next_backend = BLOCK_BACKEND_FD;
+static unsigned next_depth = BLOCK_QUEUE_DEPTH;
+static int next_direct;
 
-int block_disk_open(const char *diskname)
+/* Blocks staged at once for unaligned transfers on a direct disk (256 KiB) */
+#define BOUNCE_BLOCKS 64
+
+int block_disk_set_queue_depth(unsigned depth)
 {
-	int fd;
+	if (!depth) {
+		block_error("invalid queue depth");
+		return -1;
+	}
+
+	next_depth = depth;
+
+	return 0;
+}
+
+int block_disk_set_direct(int direct)
+{
+	next_direct = !!direct;
+
+	return 0;
+}
+
+int block_disk_set_backend(enum block_backend backend)
+{
+	if (backend < BLOCK_BACKEND_FD || backend > BLOCK_BACKEND_THREADS) {
+		block_error("invalid backend '%d'", backend);
+		return -1;
+	}
+
+	next_backend = backend;
+
+	return 0;
+}
+
+struct disk *block_disk_open(const char *diskname)
+{
+	struct disk *disk;
+	int fd, direct;
 	struct stat st;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
+		return NULL;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
-	}
+	/* The mapping would go through the page cache anyway */
+	direct = next_direct && next_backend != BLOCK_BACKEND_MMAP;
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	fd = open(diskname, O_RDWR | (direct ? O_DIRECT : 0), 0644);
+	if (fd < 0 && direct && errno == EINVAL) {
+		/* The host file system does not support O_DIRECT */
+		direct = 0;
+		fd = open(diskname, O_RDWR, 0644);
+	}
+	if (fd < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk = calloc(1, sizeof(*disk));
+	if (!disk) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
 
-	return 0;
+	if (next_backend == BLOCK_BACKEND_MMAP && st.st_size) {
+		disk->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (disk->map == MAP_FAILED) {
+			perror("mmap");
+			free(disk);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	if (next_backend == BLOCK_BACKEND_URING ||
+	    next_backend == BLOCK_BACKEND_THREADS) {
+		disk->aio = aio_create(fd, next_depth,
+				      next_backend == BLOCK_BACKEND_URING);
+		if (!disk->aio) {
+			free(disk);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	disk->fd = fd;
+	disk->bcount = st.st_size / BLOCK_SIZE;
+	disk->backend = next_backend;
+	disk->direct = direct;
+	pthread_mutex_init(&disk->lock, NULL);
+
+	return disk;
 }
 
-int block_disk_close(void)
+int block_disk_close(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	if (!disk) {
+		block_error("invalid disk");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk->aio)
+		aio_destroy(disk->aio);
+	if (disk->workers)
+		aio_destroy(disk->workers);
 
-	disk.fd = INVALID_FD;
+	if (disk->map)
+		munmap(disk->map, disk->bcount * BLOCK_SIZE);
+
+	close(disk->fd);
+	pthread_mutex_destroy(&disk->lock);
+	free(disk);
 
 	return 0;
 }
 
-int block_disk_count(void)
+int block_disk_count(struct disk *disk)
+{
+	return disk->bcount;
+}
+
+enum block_backend block_disk_backend(struct disk *disk)
+{
+	return disk->backend;
+}
+
+const char *block_disk_engine(struct disk *disk)
+{
+	if (disk->aio)
+		return aio_name(disk->aio);
+
+	return disk->map ? "mmap" : "fd";
+}
+
+int block_disk_direct(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	return disk->direct;
+}
+
+void block_disk_stats(struct disk *disk, struct block_stats *stats)
+{
+	stats->reads = __atomic_load_n(&disk->stats.reads, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&disk->stats.writes, __ATOMIC_RELAXED);
+	stats->read_bytes = __atomic_load_n(&disk->stats.read_bytes,
+					    __ATOMIC_RELAXED);
+	stats->write_bytes = __atomic_load_n(&disk->stats.write_bytes,
+					     __ATOMIC_RELAXED);
+}
+
+void block_disk_trace(struct disk *disk, struct trace *trace)
+{
+	disk->trace = trace;
+}
+
+/* Account for a transfer of @count blocks from @block */
+static void count_xfer(struct disk *disk, int write, size_t block,
+		       size_t count)
+{
+	if (disk->trace)
+		trace_block(disk->trace, write, block, count);
+#ifndef FS_NO_STATS
+	size_t bytes = count * BLOCK_SIZE;
+
+	if (write) {
+		__atomic_fetch_add(&disk->stats.writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&disk->stats.write_bytes, bytes,
+				   __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&disk->stats.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&disk->stats.read_bytes, bytes,
+				   __ATOMIC_RELAXED);
+	}
+#endif
+}
+
+int block_disk_sync(struct disk *disk)
+{
+	if (disk->map) {
+		if (msync(disk->map, disk->bcount * BLOCK_SIZE, MS_SYNC)) {
+			perror("msync");
+			return -1;
+		}
+	} else if (fdatasync(disk->fd)) {
+		perror("fdatasync");
 		return -1;
 	}
 
-	return disk.bcount;
+	return 0;
 }
 
-int block_write(size_t block, const void *buf)
+/* Check that blocks [@block, @block + @count) can be accessed */
+static int check_range(struct disk *disk, size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	if (block >= disk->bcount || count > disk->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk->bcount);
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return 0;
+}
+
+int block_discard(struct disk *disk, size_t block, size_t count)
+{
+	if (check_range(disk, block, count))
 		return -1;
-	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/* Also zeroes the pages of the mapping with the mmap backend */
+	if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      (off_t)block * BLOCK_SIZE, (off_t)count * BLOCK_SIZE)) {
+		if (errno != EOPNOTSUPP)
+			perror("fallocate");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return 0;
+}
+
+/*
+ * Transfer the @iovcnt buffers of @iov from or to the disk image at byte
+ * @offset. Short transfers are resumed until everything has been moved. @iov
+ * is consumed in the process.
+ */
+static int disk_xfer_raw(struct disk *disk, int write, off_t offset,
+		     struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+		if (write)
+			ret = pwritev(disk->fd, iov, n, offset);
+		else
+			ret = preadv(disk->fd, iov, n, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+
+		/* Skip over what was transferred */
+		offset += ret;
+		while (ret > 0) {
+			if ((size_t)ret >= iov->iov_len) {
+				ret -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			} else {
+				iov->iov_base = (char *)iov->iov_base + ret;
+				iov->iov_len -= ret;
+				ret = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Whether the buffers of @iov can be handed to the kernel with O_DIRECT */
+static int iov_aligned(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if ((uintptr_t)iov[i].iov_base % BLOCK_SIZE ||
+		    iov[i].iov_len % BLOCK_SIZE)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Copy @len bytes between @bounce and the buffers of @iov, to @bounce if
+ * @gather, from @bounce otherwise. @iov is consumed in the process.
+ */
+static void iov_copy(int gather, char *bounce, size_t len,
+		     struct iovec **iov, int *iovcnt)
+{
+	while (len > 0) {
+		size_t n = (*iov)->iov_len < len ? (*iov)->iov_len : len;
+
+		if (gather)
+			memcpy(bounce, (*iov)->iov_base, n);
+		else
+			memcpy((*iov)->iov_base, bounce, n);
+		bounce += n;
+		len -= n;
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+		if (!(*iov)->iov_len) {
+			(*iov)++;
+			(*iovcnt)--;
+		}
+	}
+}
+
+/*
+ * Same as disk_xfer_raw(), except that on a direct disk buffers that are not
+ * aligned on %BLOCK_SIZE are staged through an aligned bounce buffer, which
+ * O_DIRECT requires. The total length must then be a multiple of %BLOCK_SIZE.
+ */
+static int disk_xfer(struct disk *disk, int write, off_t offset,
+		     struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	char *bounce;
+	int i;
+
+	if (!disk->direct || iov_aligned(iov, iovcnt))
+		return disk_xfer_raw(disk, write, offset, iov, iovcnt);
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (posix_memalign((void **)&bounce, BLOCK_SIZE,
+			   len < BOUNCE_BLOCKS * BLOCK_SIZE ?
+			   len : BOUNCE_BLOCKS * BLOCK_SIZE)) {
+		block_error("cannot allocate bounce buffer");
 		return -1;
 	}
 
+	while (len > 0) {
+		size_t n = len < BOUNCE_BLOCKS * BLOCK_SIZE ?
+			len : BOUNCE_BLOCKS * BLOCK_SIZE;
+		struct iovec biov = { .iov_base = bounce, .iov_len = n };
+
+		if (write)
+			iov_copy(1, bounce, n, &iov, &iovcnt);
+		if (disk_xfer_raw(disk, write, offset, &biov, 1)) {
+			free(bounce);
+			return -1;
+		}
+		if (!write)
+			iov_copy(0, bounce, n, &iov, &iovcnt);
+		offset += n;
+		len -= n;
+	}
+
+	free(bounce);
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Scatter/gather helper shared by block_readv() and block_writev() */
+static int block_rwv(struct disk *disk, int write, size_t block,
+		     const struct iovec *iov, int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	struct iovec stack_iov[16], *copy = stack_iov;
+	size_t len = 0;
+	int i, ret;
+
+	if (iovcnt < 0 || (iovcnt && !iov)) {
+		block_error("invalid iovec");
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len % BLOCK_SIZE != 0) {
+		block_error("length '%zu' is not multiple of '%d'",
+			    len, BLOCK_SIZE);
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (check_range(disk, block, len / BLOCK_SIZE))
 		return -1;
+	count_xfer(disk, write, block, len / BLOCK_SIZE);
+
+	if (disk->map) {
+		char *p = disk->map + block * BLOCK_SIZE;
+
+		for (i = 0; i < iovcnt; p += iov[i].iov_len, i++) {
+			if (write)
+				memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, p, iov[i].iov_len);
+		}
+		return 0;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (iovcnt > (int)(sizeof(stack_iov) / sizeof(stack_iov[0]))) {
+		copy = malloc(iovcnt * sizeof(*copy));
+		if (!copy) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		copy[i] = iov[i];
+
+	ret = disk_xfer(disk, write, (off_t)block * BLOCK_SIZE, copy, iovcnt);
+
+	if (copy != stack_iov)
+		free(copy);
+
+	return ret;
+}
+
+int block_write(struct disk *disk, size_t block, const void *buf)
+{
+	return block_write_range(disk, block, 1, buf);
+}
+
+int block_read(struct disk *disk, size_t block, void *buf)
+{
+	return block_read_range(disk, block, 1, buf);
+}
+
+int block_write_range(struct disk *disk, size_t block, size_t count,
+		      const void *buf)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	if (check_range(disk, block, count))
 		return -1;
+	if (!count)
+		return 0;
+	count_xfer(disk, 1, block, count);
+
+	if (disk->map) {
+		memcpy(disk->map + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+		return 0;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/* A single positional write, the file offset is left untouched */
+	return disk_xfer(disk, 1, (off_t)block * BLOCK_SIZE, &iov, 1);
+}
+
+int block_read_range(struct disk *disk, size_t block, size_t count,
+		     void *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	if (check_range(disk, block, count))
 		return -1;
+	if (!count)
+		return 0;
+	count_xfer(disk, 0, block, count);
+
+	if (disk->map) {
+		memcpy(buf, disk->map + block * BLOCK_SIZE, count * BLOCK_SIZE);
+		return 0;
+	}
+
+	/* A single positional read, the file offset is left untouched */
+	return disk_xfer(disk, 0, (off_t)block * BLOCK_SIZE, &iov, 1);
+}
+
+int block_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		 int iovcnt)
+{
+	return block_rwv(disk, 1, block, iov, iovcnt);
+}
+
+int block_readv(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt)
+{
+	return block_rwv(disk, 0, block, iov, iovcnt);
+}
+
+/* Engine whose requests are in flight: the backend's, or the workers of
+ * block_submit_async() (a disk never has both) */
+static struct aio *disk_engine(struct disk *disk)
+{
+	return disk->aio ? disk->aio : disk->workers;
+}
+
+/* Queue @reqs on @aio, or execute them in the calling thread if @aio is NULL */
+static int submit_reqs(struct disk *disk, struct aio *aio,
+		       struct block_req *reqs, size_t nreqs)
+{
+	size_t i;
+
+	/* Reject the whole batch up front rather than half of it */
+	for (i = 0; i < nreqs; i++)
+		if (check_range(disk, reqs[i].block, reqs[i].count))
+			return -1;
+
+	for (i = 0; i < nreqs; i++) {
+		/* Unaligned buffers of a direct disk are staged synchronously */
+		if (aio && (!disk->direct ||
+			    (uintptr_t)reqs[i].buf % BLOCK_SIZE == 0)) {
+			count_xfer(disk, reqs[i].write, reqs[i].block,
+				   reqs[i].count);
+			pthread_mutex_lock(&disk->lock);
+			if (aio_submit(aio, &reqs[i])) {
+				aio_push(aio);
+				pthread_mutex_unlock(&disk->lock);
+				return -1;
+			}
+			/* Start the batch now, rather than at the next reap */
+			if (i == nreqs - 1)
+				aio_push(aio);
+			pthread_mutex_unlock(&disk->lock);
+			continue;
+		}
+
+		/* Transfers run in the calling thread, outside of the lock */
+		if (reqs[i].write)
+			reqs[i].result = block_write_range(disk, reqs[i].block,
+							   reqs[i].count,
+							   reqs[i].buf);
+		else
+			reqs[i].result = block_read_range(disk, reqs[i].block,
+							  reqs[i].count,
+							  reqs[i].buf);
+		__atomic_store_n(&reqs[i].done, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&disk->lock);
+		if (reqs[i].result)
+			disk->failed = 1;
+		disk->sync_done++;
+		pthread_mutex_unlock(&disk->lock);
 	}
 
 	return 0;
 }
 
+int block_submit(struct disk *disk, struct block_req *reqs, size_t nreqs)
+{
+	return submit_reqs(disk, disk->aio, reqs, nreqs);
+}
+
+int block_submit_async(struct disk *disk, struct block_req *reqs,
+		       size_t nreqs)
+{
+	struct aio *aio;
+
+	pthread_mutex_lock(&disk->lock);
+	if (!disk->aio && !disk->workers)
+		disk->workers = aio_create(disk->fd, BLOCK_QUEUE_DEPTH, 0);
+	aio = disk_engine(disk);
+	pthread_mutex_unlock(&disk->lock);
+	if (!aio)
+		return -1;
+
+	return submit_reqs(disk, aio, reqs, nreqs);
+}
+
+int block_reap(struct disk *disk, size_t min)
+{
+	struct aio *aio;
+	size_t reaped;
+
+	pthread_mutex_lock(&disk->lock);
+	aio = disk_engine(disk);
+	reaped = disk->sync_done;
+	disk->sync_done = 0;
+	if (aio)
+		reaped += aio_reap(aio, min > reaped ? min - reaped : 0,
+				   &disk->failed);
+	pthread_mutex_unlock(&disk->lock);
+
+	return reaped;
+}
+
+int block_wait(struct disk *disk)
+{
+	struct aio *aio;
+	int failed;
+
+	pthread_mutex_lock(&disk->lock);
+	aio = disk_engine(disk);
+	disk->sync_done = 0;
+	if (aio)
+		aio_reap(aio, aio_inflight(aio), &disk->failed);
+
+	failed = disk->failed;
+	disk->failed = 0;
+	pthread_mutex_unlock(&disk->lock);
+
+	return failed ? -1 : 0;
+}
+
+int block_wait_req(struct disk *disk, struct block_req *req)
+{
+	if (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&disk->lock);
+		while (!req->done)
+			aio_reap(disk_engine(disk), 1, &disk->failed);
+		pthread_mutex_unlock(&disk->lock);
+	}
+
+	return req->result ? -1 : 0;
+}
@@ -2,41 +2,204 @@
 #define _DISK_H
 
 #include <stddef.h>
+#include <sys/uio.h>
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Ways of accessing the blocks of a virtual disk file */
+enum block_backend {
+	/* System calls on a file descriptor */
+	BLOCK_BACKEND_FD,
+	/* Memory copies to and from a mapping of the whole file */
+	BLOCK_BACKEND_MMAP,
+	/* System calls, with batches of requests kept in flight by io_uring
+	 * (or by worker threads if io_uring is unavailable) */
+	BLOCK_BACKEND_URING,
+	/* System calls, with batches of requests kept in flight by worker
+	 * threads */
+	BLOCK_BACKEND_THREADS,
+};
+
+/** Default maximum number of asynchronous requests in flight */
+#define BLOCK_QUEUE_DEPTH 32
+
+/** Opaque open virtual disk */
+struct disk;
+
+/** Asynchronous block request */
+struct block_req {
+	/* Non-zero to write @buf to disk, zero to read from disk into @buf */
+	int write;
+	/* Index of the first block */
+	size_t block;
+	/* Number of consecutive blocks */
+	size_t count;
+	/* Data buffer (@count * %BLOCK_SIZE bytes) */
+	void *buf;
+	/* Outcome (-1 on failure, 0 on success), valid once reaped */
+	int result;
+	/* Set once the request has been reaped */
+	int done;
+};
+
+/**
+ * block_disk_set_backend - Select how the next virtual disk is accessed
+ * @backend: Backend to use
+ *
+ * Select the backend used by subsequent calls to block_disk_open(). With
+ * %BLOCK_BACKEND_MMAP, the whole virtual disk file is mapped in memory and
+ * blocks are read and written with memory copies instead of system calls. With
+ * %BLOCK_BACKEND_URING or %BLOCK_BACKEND_THREADS, requests submitted with
+ * block_submit() are kept in flight concurrently. All backends have the same
+ * block semantics. The default is %BLOCK_BACKEND_FD.
+ *
+ * Return: -1 if @backend is invalid. 0 otherwise.
+ */
+int block_disk_set_backend(enum block_backend backend);
+
+/**
+ * block_disk_set_queue_depth - Set how many requests can be in flight
+ * @depth: Maximum number of asynchronous requests in flight
+ *
+ * Set the queue depth used by subsequent calls to block_disk_open() with an
+ * asynchronous backend. The default is %BLOCK_QUEUE_DEPTH.
+ *
+ * Return: -1 if @depth is 0. 0 otherwise.
+ */
+int block_disk_set_queue_depth(unsigned depth);
+
+/**
+ * block_disk_set_direct - Bypass the host page cache on the next virtual disk
+ * @direct: Non-zero to open the virtual disk file with O_DIRECT
+ *
+ * Make subsequent calls to block_disk_open() open the virtual disk file with
+ * O_DIRECT, so that transfers go straight between the buffers and the storage
+ * device. Buffers aligned on %BLOCK_SIZE are used as they are; other buffers
+ * are staged through an internal aligned bounce buffer (synchronously, even
+ * with an asynchronous backend). O_DIRECT is not used with
+ * %BLOCK_BACKEND_MMAP, or if the host file system does not support it. It is
+ * off by default.
+ *
+ * Return: 0.
+ */
+int block_disk_set_direct(int direct);
+
+/**
+ * block_disk_engine - Get name of the engine serving block requests
+ * @disk: Virtual disk
+ *
+ * Return: "fd", "mmap", "io_uring" or "threads".
+ */
+const char *block_disk_engine(struct disk *disk);
+
+/**
+ * block_disk_backend - Get backend of a virtual disk
+ * @disk: Virtual disk
+ *
+ * Return: Backend used by @disk.
+ */
+enum block_backend block_disk_backend(struct disk *disk);
+
+/**
+ * block_disk_direct - Check whether a virtual disk bypasses the page cache
+ * @disk: Virtual disk
+ *
+ * Return: 1 if @disk was opened with O_DIRECT. 0 otherwise.
+ */
+int block_disk_direct(struct disk *disk);
+
+/** Transfers issued to a virtual disk */
+struct block_stats {
+	/* Read and write requests (a vectored call or a range counts as one) */
+	size_t reads;
+	size_t writes;
+	/* Bytes they moved */
+	size_t read_bytes;
+	size_t write_bytes;
+};
+
+/**
+ * block_disk_stats - Get transfer counters of a virtual disk
+ * @disk: Virtual disk
+ * @stats: Counters to fill
+ *
+ * Counters are cumulative since @disk was opened. They stay at 0 if libfs is
+ * built with %FS_NO_STATS defined.
+ */
+void block_disk_stats(struct disk *disk, struct block_stats *stats);
+
+struct trace;
+
+/**
+ * block_disk_trace - Record the transfers of a virtual disk
+ * @disk: Virtual disk
+ * @trace: Trace to record every read and write issued to @disk in, or NULL to
+ * stop recording
+ *
+ * @disk must be idle while the trace is changed.
+ */
+void block_disk_trace(struct disk *disk, struct trace *trace);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
  *
  * Open virtual disk file @diskname. A virtual disk file must be opened before
  * blocks can be read from it with block_read() or written to it with
- * block_write().
+ * block_write(). Several virtual disks can be open at the same time, each one
+ * with its own backend.
  *
- * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
- * or is already open. 0 otherwise.
+ * Return: NULL if @diskname is invalid, or if the virtual disk file cannot be
+ * opened or memory cannot be allocated. The virtual disk otherwise.
  */
-int block_disk_open(const char *diskname);
+struct disk *block_disk_open(const char *diskname);
 
 /**
  * block_disk_close - Close virtual disk file
- * @name: Name of the virtual disk file
+ * @disk: Virtual disk to close and release
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise.
+ */
+int block_disk_close(struct disk *disk);
+
+/**
+ * block_disk_sync - Flush virtual disk file
+ * @disk: Virtual disk
+ *
+ * Make sure every block written so far has reached the virtual disk file on
+ * the host (with msync() for %BLOCK_BACKEND_MMAP, with fdatasync() otherwise).
+ *
+ * Return: -1 if flushing failed. 0 otherwise.
+ */
+int block_disk_sync(struct disk *disk);
+
+/**
+ * block_discard - Release consecutive blocks
+ * @disk: Virtual disk
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch a hole in the virtual disk file over the blocks, so that they take no
+ * space on the host and read as zeroes. No request touching the blocks may be
+ * in flight.
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * Return: -1 if one of the blocks is out of bounds or if the host file system
+ * cannot punch holes. 0 otherwise.
  */
-int block_disk_close(void);
+int block_discard(struct disk *disk, size_t block, size_t count);
 
 /**
  * block_disk_count - Get disk's block count
+ * @disk: Virtual disk
  *
- * Return: -1 if there was no virtual disk file opened, otherwise the number of
- * blocks that the currently open disk contains.
+ * Return: Number of blocks that @disk contains.
  */
-int block_disk_count(void);
+int block_disk_count(struct disk *disk);
 
 /**
  * block_write - Write a block to disk
+ * @disk: Virtual disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
@@ -46,10 +209,11 @@ int block_disk_count(void);
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
  */
-int block_write(size_t block, const void *buf);
+int block_write(struct disk *disk, size_t block, const void *buf);
 
 /**
  * block_read - Read a block from disk
+ * @disk: Virtual disk
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
@@ -59,7 +223,146 @@ int block_write(size_t block, const void *buf);
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
-int block_read(size_t block, void *buf);
+int block_read(struct disk *disk, size_t block, void *buf);
+
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @disk: Virtual disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, with a single positional write.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(struct disk *disk, size_t block, size_t count,
+		      const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @disk: Virtual disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, with a single positional read.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(struct disk *disk, size_t block, size_t count,
+		     void *buf);
+
+/**
+ * block_writev - Gather buffers into consecutive blocks on disk
+ * @disk: Virtual disk
+ * @block: Index of the first block to write to
+ * @iov: Buffers to write
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write buffers @iov one after the other in the virtual disk, starting at block
+ * @block. The total length of the buffers must be a multiple of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if one of
+ * the blocks is out of bounds or inaccessible or if the writing operation
+ * fails. 0 otherwise.
+ */
+int block_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		 int iovcnt);
+
+/**
+ * block_readv - Scatter consecutive blocks from disk into buffers
+ * @disk: Virtual disk
+ * @block: Index of the first block to read from
+ * @iov: Buffers to be filled
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Fill buffers @iov one after the other with the content of the virtual disk,
+ * starting at block @block. The total length of the buffers must be a multiple
+ * of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if one of
+ * the blocks is out of bounds or inaccessible, or if the reading operation
+ * fails. 0 otherwise.
+ */
+int block_readv(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt);
+
+/**
+ * block_submit - Submit a batch of block requests
+ * @disk: Virtual disk
+ * @reqs: Array of requests
+ * @nreqs: Number of requests in @reqs
+ *
+ * Queue requests @reqs for execution. With an asynchronous backend, up to the
+ * queue depth of requests are in flight at once and they can complete in any
+ * order; submitting more waits for earlier ones to complete. Other backends
+ * execute each request before returning. Requests of a same batch must not
+ * overlap if one of them is a write, and @reqs must stay valid until the
+ * requests have been reaped with block_reap(), block_wait() or
+ * block_wait_req(). Several threads can submit and reap requests at once.
+ *
+ * Return: -1 if one of the requests is out of bounds (nothing is submitted
+ * then). 0 otherwise.
+ */
+int block_submit(struct disk *disk, struct block_req *reqs, size_t nreqs);
+
+/**
+ * block_submit_async - Submit a batch of requests to run in the background
+ * @disk: Virtual disk
+ * @reqs: Array of requests
+ * @nreqs: Number of requests in @reqs
+ *
+ * Same as block_submit(), except that the requests are never executed by the
+ * calling thread, whatever the backend: disks without an asynchronous backend
+ * start a pool of worker threads for them on first use. Meant for transfers
+ * that the caller does not wait for, like readahead.
+ *
+ * Return: -1 if one of the requests is out of bounds (nothing is submitted
+ * then), or if the worker threads cannot be started. 0 otherwise.
+ */
+int block_submit_async(struct disk *disk, struct block_req *reqs,
+		       size_t nreqs);
+
+/**
+ * block_reap - Reap completed block requests
+ * @disk: Virtual disk
+ * @min: Minimum number of requests to wait for
+ *
+ * Wait until at least @min submitted requests (capped to the number of requests
+ * in flight) have completed, and set their @result.
+ *
+ * Return: Number of requests that were reaped.
+ */
+int block_reap(struct disk *disk, size_t min);
+
+/**
+ * block_wait - Wait for all submitted block requests
+ * @disk: Virtual disk
+ *
+ * Reap every request in flight.
+ *
+ * Return: -1 if a request reaped since the previous call to block_wait()
+ * failed. 0 otherwise.
+ */
+int block_wait(struct disk *disk);
+
+/**
+ * block_wait_req - Wait for one request
+ * @disk: Virtual disk
+ * @req: Request submitted with block_submit()
+ *
+ * Reap requests until @req is done. Requests of other threads may be reaped
+ * along the way; their results are set for their owners to find. Unlike
+ * block_wait(), only the outcome of @req is reported.
+ *
+ * Return: -1 if @req failed. 0 otherwise.
+ */
+int block_wait_req(struct disk *disk, struct block_req *req);
 
 #endif /* _DISK_H */
 
@@ -0,0 +1,379 @@
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FATSCAN_X86
+#endif
+
+#include "fatscan.h"
+
+/* Entries of a chain checked one by one before handing over to the kernels,
+ * as most runs of fragmented FATs are shorter */
+#define CHAIN_PREFIX 8
+
+/* Kernels of one instruction set. Masks cover whole words of 64 entries, and
+ * runs are measured on entries [from, end) */
+struct kernels {
+	int isa;
+	size_t (*free_mask16)(const uint16_t *fat, size_t n, uint64_t *mask);
+	size_t (*free_mask32)(const uint32_t *fat, size_t n, uint64_t *mask);
+	size_t (*chain_run16)(const uint16_t *fat, size_t from, size_t end);
+	size_t (*chain_run32)(const uint32_t *fat, size_t from, size_t end);
+};
+
+/*
+ * Scalar kernels, which also finish the entries that the vector kernels leave
+ * over (from a multiple of 64 for masks)
+ */
+#define SCALAR_KERNELS(bits)						\
+static size_t free_mask##bits##_scalar(const uint##bits##_t *fat,	\
+				       size_t n, uint64_t *mask)	\
+{									\
+	return free_tail##bits(fat, 0, n, mask);			\
+}									\
+									\
+static size_t chain_run##bits##_scalar(const uint##bits##_t *fat,	\
+				       size_t from, size_t end)		\
+{									\
+	size_t i = from;						\
+									\
+	while (i < end && fat[i] == i + 1)				\
+		i++;							\
+	return i - from;						\
+}
+
+#define FREE_TAIL(bits)							\
+static size_t free_tail##bits(const uint##bits##_t *fat, size_t from,	\
+			      size_t n, uint64_t *mask)			\
+{									\
+	size_t count = 0;						\
+									\
+	for (size_t w = from / 64; w < (n + 63) / 64; w++)		\
+		mask[w] = 0;						\
+	for (size_t i = from; i < n; i++) {				\
+		if (!fat[i]) {						\
+			mask[i / 64] |= (uint64_t)1 << (i % 64);	\
+			count++;					\
+		}							\
+	}								\
+	return count;							\
+}
+
+FREE_TAIL(16)
+FREE_TAIL(32)
+SCALAR_KERNELS(16)
+SCALAR_KERNELS(32)
+
+static const struct kernels scalar_kernels = {
+	.isa = FATSCAN_SCALAR,
+	.free_mask16 = free_mask16_scalar,
+	.free_mask32 = free_mask32_scalar,
+	.chain_run16 = chain_run16_scalar,
+	.chain_run32 = chain_run32_scalar,
+};
+
+#ifdef FATSCAN_X86
+/*
+ * Compare vectors of entries with 0 (or with the entry numbers that follow
+ * them), then narrow the results to one byte per entry so that a movemask
+ * gives one bit per entry
+ */
+__attribute__((target("sse2")))
+static size_t free_mask16_sse2(const uint16_t *fat, size_t n, uint64_t *mask)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i, count = 0;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		uint64_t m = 0;
+
+		for (int j = 0; j < 64; j += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(fat + i + j));
+			__m128i b = _mm_loadu_si128((const __m128i *)(fat + i + j + 8));
+
+			a = _mm_cmpeq_epi16(a, zero);
+			b = _mm_cmpeq_epi16(b, zero);
+			m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << j;
+		}
+		mask[i / 64] = m;
+		count += __builtin_popcountll(m);
+	}
+
+	return count + free_tail16(fat, i, n, mask);
+}
+
+__attribute__((target("sse2")))
+static size_t free_mask32_sse2(const uint32_t *fat, size_t n, uint64_t *mask)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i, count = 0;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		uint64_t m = 0;
+
+		for (int j = 0; j < 64; j += 16) {
+			const __m128i *p = (const __m128i *)(fat + i + j);
+			__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128(p), zero);
+			__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128(p + 1), zero);
+			__m128i c = _mm_cmpeq_epi32(_mm_loadu_si128(p + 2), zero);
+			__m128i d = _mm_cmpeq_epi32(_mm_loadu_si128(p + 3), zero);
+
+			a = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+			m |= (uint64_t)(uint16_t)_mm_movemask_epi8(a) << j;
+		}
+		mask[i / 64] = m;
+		count += __builtin_popcountll(m);
+	}
+
+	return count + free_tail32(fat, i, n, mask);
+}
+
+__attribute__((target("sse2")))
+static size_t chain_run16_sse2(const uint16_t *fat, size_t from, size_t end)
+{
+	__m128i want = _mm_add_epi16(_mm_set1_epi16((short)(from + 1)),
+				     _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+	size_t i;
+
+	for (i = from; i + 8 <= end; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi16(v, want));
+
+		if (m != 0xFFFF)
+			return i - from + __builtin_ctz(~m) / 2;
+		want = _mm_add_epi16(want, _mm_set1_epi16(8));
+	}
+
+	return i - from + chain_run16_scalar(fat, i, end);
+}
+
+__attribute__((target("sse2")))
+static size_t chain_run32_sse2(const uint32_t *fat, size_t from, size_t end)
+{
+	__m128i want = _mm_add_epi32(_mm_set1_epi32((int)(from + 1)),
+				     _mm_setr_epi32(0, 1, 2, 3));
+	size_t i;
+
+	for (i = from; i + 4 <= end; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi32(v, want));
+
+		if (m != 0xFFFF)
+			return i - from + __builtin_ctz(~m) / 4;
+		want = _mm_add_epi32(want, _mm_set1_epi32(4));
+	}
+
+	return i - from + chain_run32_scalar(fat, i, end);
+}
+
+static const struct kernels sse2_kernels = {
+	.isa = FATSCAN_SSE2,
+	.free_mask16 = free_mask16_sse2,
+	.free_mask32 = free_mask32_sse2,
+	.chain_run16 = chain_run16_sse2,
+	.chain_run32 = chain_run32_sse2,
+};
+
+/* Packing works within 128-bit lanes, so the results are permuted back */
+__attribute__((target("avx2,popcnt")))
+static size_t free_mask16_avx2(const uint16_t *fat, size_t n, uint64_t *mask)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i, count = 0;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		uint64_t m = 0;
+
+		for (int j = 0; j < 64; j += 32) {
+			const __m256i *p = (const __m256i *)(fat + i + j);
+			__m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256(p), zero);
+			__m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256(p + 1), zero);
+
+			a = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+			m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(a) << j;
+		}
+		mask[i / 64] = m;
+		count += __builtin_popcountll(m);
+	}
+
+	return count + free_tail16(fat, i, n, mask);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t free_mask32_avx2(const uint32_t *fat, size_t n, uint64_t *mask)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i, count = 0;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		uint64_t m = 0;
+
+		for (int j = 0; j < 64; j += 32) {
+			const __m256i *p = (const __m256i *)(fat + i + j);
+			__m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256(p), zero);
+			__m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 1), zero);
+			__m256i c = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 2), zero);
+			__m256i d = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 3), zero);
+
+			a = _mm256_packs_epi16(_mm256_packs_epi32(a, b),
+					       _mm256_packs_epi32(c, d));
+			a = _mm256_permutevar8x32_epi32(a, order);
+			m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(a) << j;
+		}
+		mask[i / 64] = m;
+		count += __builtin_popcountll(m);
+	}
+
+	return count + free_tail32(fat, i, n, mask);
+}
+
+__attribute__((target("avx2")))
+static size_t chain_run16_avx2(const uint16_t *fat, size_t from, size_t end)
+{
+	__m256i want = _mm256_add_epi16(_mm256_set1_epi16((short)(from + 1)),
+					_mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8,
+							  9, 10, 11, 12, 13, 14, 15));
+	size_t i;
+
+	for (i = from; i + 16 <= end; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, want));
+
+		if (m != 0xFFFFFFFF)
+			return i - from + __builtin_ctz(~m) / 2;
+		want = _mm256_add_epi16(want, _mm256_set1_epi16(16));
+	}
+
+	return i - from + chain_run16_scalar(fat, i, end);
+}
+
+__attribute__((target("avx2")))
+static size_t chain_run32_avx2(const uint32_t *fat, size_t from, size_t end)
+{
+	__m256i want = _mm256_add_epi32(_mm256_set1_epi32((int)(from + 1)),
+					_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	size_t i;
+
+	for (i = from; i + 8 <= end; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, want));
+
+		if (m != 0xFFFFFFFF)
+			return i - from + __builtin_ctz(~m) / 4;
+		want = _mm256_add_epi32(want, _mm256_set1_epi32(8));
+	}
+
+	return i - from + chain_run32_scalar(fat, i, end);
+}
+
+static const struct kernels avx2_kernels = {
+	.isa = FATSCAN_AVX2,
+	.free_mask16 = free_mask16_avx2,
+	.free_mask32 = free_mask32_avx2,
+	.chain_run16 = chain_run16_avx2,
+	.chain_run32 = chain_run32_avx2,
+};
+#endif /* FATSCAN_X86 */
+
+/* Kernels in use, picked on first use */
+static const struct kernels *kernels;
+
+/* Kernels of instruction set @isa, NULL if the CPU does not support them */
+static const struct kernels *isa_kernels(int isa)
+{
+	switch (isa) {
+	case FATSCAN_SCALAR:
+		return &scalar_kernels;
+#ifdef FATSCAN_X86
+	case FATSCAN_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") ? &sse2_kernels : NULL;
+	case FATSCAN_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2")
+			&& __builtin_cpu_supports("popcnt") ? &avx2_kernels : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static const struct kernels *get_kernels(void)
+{
+	const struct kernels *k = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+
+	/* Threads racing here all pick the same kernels */
+	if (!k) {
+		for (int isa = FATSCAN_AVX2; !k; isa--)
+			k = isa_kernels(isa);
+		__atomic_store_n(&kernels, k, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+int fatscan_isa(void)
+{
+	return get_kernels()->isa;
+}
+
+int fatscan_set_isa(int isa)
+{
+	const struct kernels *k = isa_kernels(isa);
+
+	if (!k)
+		return -1;
+	__atomic_store_n(&kernels, k, __ATOMIC_RELEASE);
+	return 0;
+}
+
+const char *fatscan_isa_name(int isa)
+{
+	static const char *const names[] = {
+		[FATSCAN_SCALAR] = "scalar",
+		[FATSCAN_SSE2] = "sse2",
+		[FATSCAN_AVX2] = "avx2",
+	};
+
+	if (isa < 0 || isa >= (int)(sizeof(names) / sizeof(names[0])))
+		return NULL;
+	return names[isa];
+}
+
+size_t fatscan_free_mask(const void *fat, int width, size_t n,
+			 uint64_t *mask)
+{
+	const struct kernels *k = get_kernels();
+
+	if (width == 2)
+		return k->free_mask16(fat, n, mask);
+	return k->free_mask32(fat, n, mask);
+}
+
+size_t fatscan_chain_run(const void *fat, int width, size_t n, size_t entry,
+			 size_t max)
+{
+	size_t end, head, run;
+
+	if (width == 2 && n > UINT16_MAX) {
+		/* Entries from 65535 on cannot point to the entry after them,
+		 * and vector comparisons would wrap around */
+		n = UINT16_MAX;
+	}
+	if (entry >= n)
+		return 0;
+	end = max < n - entry ? entry + max : n;
+	head = end - entry < CHAIN_PREFIX ? end : entry + CHAIN_PREFIX;
+
+	if (width == 2) {
+		run = chain_run16_scalar(fat, entry, head);
+		if (entry + run == end || entry + run < head)
+			return run;
+		return run + get_kernels()->chain_run16(fat, head, end);
+	}
+
+	run = chain_run32_scalar(fat, entry, head);
+	if (entry + run == end || entry + run < head)
+		return run;
+	return run + get_kernels()->chain_run32(fat, head, end);
+}
@@ -0,0 +1,74 @@
+#ifndef _FATSCAN_H
+#define _FATSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scans of FAT entries, 16-bit (version 1 disks) or 32-bit (version 2 disks)
+ * wide, as stored in the FAT blocks. Each kernel has a scalar version, and SSE2
+ * and AVX2 versions on x86. The fastest one the CPU supports is picked on first
+ * use.
+ */
+
+/** Instruction sets of the kernels */
+enum fatscan_isa {
+	FATSCAN_SCALAR,
+	FATSCAN_SSE2,
+	FATSCAN_AVX2,
+};
+
+/**
+ * fatscan_isa - Get the instruction set of the kernels in use
+ * Return: An enum fatscan_isa.
+ */
+int fatscan_isa(void);
+
+/**
+ * fatscan_set_isa - Choose the instruction set of the kernels
+ * @isa: An enum fatscan_isa
+ *
+ * Meant for benchmarks and tests, which compare the kernels with each other.
+ *
+ * Return: -1 if the CPU does not support @isa. 0 otherwise.
+ */
+int fatscan_set_isa(int isa);
+
+/**
+ * fatscan_isa_name - Get the name of an instruction set
+ * @isa: An enum fatscan_isa
+ * Return: "scalar", "sse2", "avx2", or NULL if @isa is invalid.
+ */
+const char *fatscan_isa_name(int isa);
+
+/**
+ * fatscan_free_mask - Find the free entries of a FAT range
+ * @fat: First entry
+ * @width: Size of the entries in bytes, 2 or 4
+ * @n: Number of entries
+ * @mask: Set to one bit per entry, in ((@n + 63) / 64) words, set when the
+ * entry is 0. Bits past @n are cleared.
+ *
+ * Return: Number of free entries.
+ */
+size_t fatscan_free_mask(const void *fat, int width, size_t n,
+			 uint64_t *mask);
+
+/**
+ * fatscan_chain_run - Measure the contiguous part of a chain
+ * @fat: First entry of the FAT
+ * @width: Size of the entries in bytes, 2 or 4
+ * @n: Number of entries in @fat
+ * @entry: Entry to start from
+ * @max: Most entries to look at
+ *
+ * Count the entries from @entry on that point to the entry right after them,
+ * so that the chain goes through consecutive entries. Only entries before @n
+ * are looked at.
+ *
+ * Return: Number of such entries, at most @max.
+ */
+size_t fatscan_chain_run(const void *fat, int width, size_t n, size_t entry,
+			 size_t max);
+
+#endif /* _FATSCAN_H */
@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+/* Bits per bitmap word */
+#define WORD_BITS 64
+
+/* Free runs looked at by freemap_find_run() before settling for the longest */
+#define FIND_RUN_LIMIT 64
+
+struct freemap {
+	/* Number of blocks tracked */
+	size_t nblocks;
+	/* Number of free blocks */
+	size_t nfree;
+	/* One bit per block, set if the block is free */
+	uint64_t *bits;
+	size_t nwords;
+	/* One bit per word of @bits, set if the word has a free block */
+	uint64_t *summary;
+	size_t nsummary;
+};
+
+struct freemap *freemap_create(size_t nblocks)
+{
+	struct freemap *map = calloc(1, sizeof(*map));
+
+	if (!map)
+		return NULL;
+
+	map->nblocks = nblocks;
+	map->nwords = (nblocks + WORD_BITS - 1) / WORD_BITS;
+	map->nsummary = (map->nwords + WORD_BITS - 1) / WORD_BITS;
+	map->bits = calloc(map->nwords ? map->nwords : 1, sizeof(uint64_t));
+	map->summary = calloc(map->nsummary ? map->nsummary : 1,
+			      sizeof(uint64_t));
+	if (!map->bits || !map->summary) {
+		freemap_destroy(map);
+		return NULL;
+	}
+
+	return map;
+}
+
+void freemap_destroy(struct freemap *map)
+{
+	if (!map)
+		return;
+
+	free(map->bits);
+	free(map->summary);
+	free(map);
+}
+
+void freemap_set_free(struct freemap *map, size_t block)
+{
+	size_t w = block / WORD_BITS;
+	uint64_t bit = (uint64_t)1 << (block % WORD_BITS);
+
+	if (map->bits[w] & bit)
+		return;
+
+	map->bits[w] |= bit;
+	map->summary[w / WORD_BITS] |= (uint64_t)1 << (w % WORD_BITS);
+	map->nfree++;
+}
+
+void freemap_set_free_mask(struct freemap *map, size_t block,
+			   const uint64_t *mask, size_t n)
+{
+	size_t first = block / WORD_BITS;
+
+	for (size_t i = 0; i < (n + WORD_BITS - 1) / WORD_BITS; i++) {
+		size_t w = first + i;
+
+		if (!mask[i])
+			continue;
+		map->nfree += __builtin_popcountll(mask[i] & ~map->bits[w]);
+		map->bits[w] |= mask[i];
+		map->summary[w / WORD_BITS] |= (uint64_t)1 << (w % WORD_BITS);
+	}
+}
+
+void freemap_set_used(struct freemap *map, size_t block)
+{
+	size_t w = block / WORD_BITS;
+	uint64_t bit = (uint64_t)1 << (block % WORD_BITS);
+
+	if (!(map->bits[w] & bit))
+		return;
+
+	map->bits[w] &= ~bit;
+	if (!map->bits[w])
+		map->summary[w / WORD_BITS] &= ~((uint64_t)1 << (w % WORD_BITS));
+	map->nfree--;
+}
+
+int freemap_is_free(struct freemap *map, size_t block)
+{
+	return !!(map->bits[block / WORD_BITS] &
+		  ((uint64_t)1 << (block % WORD_BITS)));
+}
+
+/* First word at or after @w with a free block, or -1 */
+static long next_word(struct freemap *map, size_t w)
+{
+	size_t s = w / WORD_BITS;
+	uint64_t mask;
+
+	if (w >= map->nwords)
+		return -1;
+
+	/* Ignore the words before @w in the first summary word */
+	mask = map->summary[s] & (~(uint64_t)0 << (w % WORD_BITS));
+	while (!mask) {
+		if (++s >= map->nsummary)
+			return -1;
+		mask = map->summary[s];
+	}
+
+	return s * WORD_BITS + __builtin_ctzll(mask);
+}
+
+/* First free block in [@from, end of map), or -1 */
+static long find_from(struct freemap *map, size_t from)
+{
+	size_t w = from / WORD_BITS;
+	uint64_t mask;
+	long next;
+
+	if (from >= map->nblocks)
+		return -1;
+
+	/* Free blocks at or after @from in its own word */
+	mask = map->bits[w] & (~(uint64_t)0 << (from % WORD_BITS));
+	if (mask)
+		return w * WORD_BITS + __builtin_ctzll(mask);
+
+	next = next_word(map, w + 1);
+	if (next < 0)
+		return -1;
+
+	return next * WORD_BITS + __builtin_ctzll(map->bits[next]);
+}
+
+long freemap_find(struct freemap *map, size_t hint)
+{
+	long block;
+
+	if (!map->nfree)
+		return -1;
+
+	if (hint >= map->nblocks)
+		hint = 0;
+
+	block = find_from(map, hint);
+	if (block < 0)
+		block = find_from(map, 0);
+
+	return block;
+}
+
+/* Number of consecutive free blocks starting at free block @block */
+static size_t run_length(struct freemap *map, size_t block, size_t max)
+{
+	size_t len = 0;
+
+	while (len < max && block < map->nblocks) {
+		size_t bit = block % WORD_BITS;
+		uint64_t used = ~map->bits[block / WORD_BITS] >> bit;
+		size_t n = used ? (size_t)__builtin_ctzll(used) : WORD_BITS - bit;
+
+		len += n;
+		block += n;
+		/* Keep going only if the run reaches the next word */
+		if (!n || block % WORD_BITS)
+			break;
+	}
+
+	/* Bits past the last block are never set, so runs stop there */
+	return len < max ? len : max;
+}
+
+long freemap_find_run(struct freemap *map, size_t hint, size_t want,
+		      size_t *len)
+{
+	long best = -1, block;
+	size_t best_len = 0, scanned = 0, runs = 0, n;
+
+	if (!map->nfree || !want)
+		return -1;
+
+	if (hint >= map->nblocks)
+		hint = 0;
+
+	/* Walk the free runs, at most once around the index and no further
+	 * than a few of them: on fragmented free space, callers take the
+	 * longest nearby run and ask again from its end */
+	block = find_from(map, hint);
+	if (block < 0)
+		block = find_from(map, 0);
+	while (block >= 0 && scanned < map->nfree && runs++ < FIND_RUN_LIMIT) {
+		n = run_length(map, block, want);
+		if (n > best_len) {
+			best = block;
+			best_len = n;
+			if (n == want)
+				break;
+		}
+		scanned += n;
+		block = find_from(map, block + n);
+		if (block < 0)
+			block = find_from(map, 0);
+	}
+
+	*len = best_len;
+	return best;
+}
+
+size_t freemap_count(struct freemap *map)
+{
+	return map->nfree;
+}
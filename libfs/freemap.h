@@ -0,0 +1,105 @@
+#ifndef _FREEMAP_H
+#define _FREEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Free-space index over the data blocks: a bitmap with one bit per block (set
+ * when the block is free), plus a summary bitmap with one bit per bitmap word
+ * (set when the word has at least one free block). Finding a free block only
+ * looks at a handful of words, wherever it is.
+ */
+
+/** Opaque free-space index */
+struct freemap;
+
+/**
+ * freemap_create - Create a free-space index
+ * @nblocks: Number of blocks to track
+ *
+ * All blocks start out in use.
+ *
+ * Return: NULL if memory cannot be allocated. The index otherwise.
+ */
+struct freemap *freemap_create(size_t nblocks);
+
+/**
+ * freemap_destroy - Release a free-space index
+ * @map: Index to release
+ */
+void freemap_destroy(struct freemap *map);
+
+/**
+ * freemap_set_free - Mark a block free
+ * @map: Index
+ * @block: Block to mark
+ */
+void freemap_set_free(struct freemap *map, size_t block);
+
+/**
+ * freemap_set_free_mask - Mark the blocks of a bitmap free
+ * @map: Index
+ * @block: First block of the bitmap, a multiple of 64
+ * @mask: Bitmap, bit i of word i / 64 standing for block @block + i
+ * @n: Number of blocks covered by @mask
+ *
+ * Mark free the blocks whose bit is set in @mask, as found by
+ * fatscan_free_mask(). Bits past @n must be clear.
+ */
+void freemap_set_free_mask(struct freemap *map, size_t block,
+			   const uint64_t *mask, size_t n);
+
+/**
+ * freemap_set_used - Mark a block in use
+ * @map: Index
+ * @block: Block to mark
+ */
+void freemap_set_used(struct freemap *map, size_t block);
+
+/**
+ * freemap_is_free - Check whether a block is free
+ * @map: Index
+ * @block: Block to check
+ *
+ * Return: 1 if @block is free, 0 otherwise.
+ */
+int freemap_is_free(struct freemap *map, size_t block);
+
+/**
+ * freemap_find - Find a free block
+ * @map: Index
+ * @hint: Preferred block
+ *
+ * Find the first free block at or after @hint, wrapping around to the
+ * beginning of the index if there is none.
+ *
+ * Return: -1 if no block is free. Otherwise, the index of the free block.
+ */
+long freemap_find(struct freemap *map, size_t hint);
+
+/**
+ * freemap_find_run - Find a run of consecutive free blocks
+ * @map: Index
+ * @hint: Preferred first block
+ * @want: Number of consecutive free blocks wanted
+ * @len: Set to the length of the run found, capped to @want
+ *
+ * Look at the runs of free blocks starting from @hint (wrapping around to the
+ * beginning of the index) and return the first one that is at least @want
+ * blocks long. If none of the first 64 runs is, return the longest of them.
+ *
+ * Return: -1 if no block is free. Otherwise, the first block of the run.
+ */
+long freemap_find_run(struct freemap *map, size_t hint, size_t want,
+		      size_t *len);
+
+/**
+ * freemap_count - Get number of free blocks
+ * @map: Index
+ *
+ * Return: Number of blocks currently marked free.
+ */
+size_t freemap_count(struct freemap *map);
+
+#endif /* _FREEMAP_H */
@@ -1,15 +1,44 @@
+#define _GNU_SOURCE // For writer-preferring reader/writer locks
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "cache.h"
 #include "disk.h"
+#include "fatscan.h"
+#include "freemap.h"
 #include "fs.h"
+#include "journal.h"
+#include "trace.h"
 
-#define FAT_EOC 0xFFFF
+#define FAT_EOC -1 // End of a chain, or no block, whatever the width of FAT entries
+#define FAT16_EOC 0xFFFF // End-of-chain marker in the FAT of version 1 disks
+#define FAT32_EOC 0xFFFFFFFF // And in the FAT of version 2 disks
+#define DIR_BLOCK_ENTRIES 128 // Entries per directory block
+#define DIR_CACHE_BLOCKS 64 // Directory blocks kept in memory, at least FS_OPEN_MAX_COUNT of them held by open files
+#define DIR_RESERVE_BLOCKS 3 // Directory blocks an operation may bring in: the bucket of a name and the halves of a split
+#define DIR_MAX_DEPTH 14 // Filename hash bits used to pick buckets, so that the bucket table fits in 16 blocks
+#define DIR_TABLE_MAX_BLOCKS ((4 << DIR_MAX_DEPTH) / BLOCK_SIZE)
+#define DIR_HINTS 256 // Guesses of where directory blocks are in memory, by disk block
+#define FAT_SUMMARY_GROUPS 1000 // Groups of FAT blocks whose free data blocks the superblock counts
+#define JOURNAL_BATCH_OPS 64 // Metadata operations grouped in one journal commit at most
+#define JOURNAL_BATCH_MS 50 // Age of the oldest operation that forces a journal commit
+#define DISCARD_ZERO_BLOCKS 256 // Blocks zeroed per write when discarding
+#define CURSOR_NONE UINT64_MAX
+#define READAHEAD_MIN_BLOCKS 4 // Readahead window after the first sequential read of a descriptor
+#define READAHEAD_MAX_BLOCKS 64 // The window doubles with every sequential read up to this
+#define IMPORT_THREADS 4 // Files copied at once by fs_import() by default
+#define IMPORT_CHUNK (1 << 20) // Bytes copied per fs_write() by fs_import()
 
 typedef enum {
     READ,
@@ -19,6 +48,8 @@ typedef enum {
 typedef struct rootEntry* rootEntry_t;
 typedef struct superblock* superblock_t;
  
+// Version 1 disks only use the fields up to numJournalBlocks. Version 2 disks have 32-bit FAT entries and use the
+// 32-bit fields instead, leaving the 16-bit ones at 0 so that version 1 implementations refuse them
 struct __attribute__((__packed__)) superblock {
     char signature[8];
     uint16_t numBlocks;
@@ -26,451 +57,2855 @@ struct __attribute__((__packed__)) superblock {
     uint16_t data;
     uint16_t numDataBlocks;
     uint8_t numFATBlocks;
-    char padding[4079];
+    uint16_t journal; // First block of the metadata journal
+    uint16_t numJournalBlocks; // 0 if the disk has no journal
+    uint8_t version; // 0 for version 1
+    uint32_t numBlocks32;
+    uint32_t root32;
+    uint32_t data32;
+    uint32_t numDataBlocks32;
+    uint32_t numFATBlocks32;
+    uint32_t journal32;
+    uint32_t numJournalBlocks32;
+    uint32_t dirChain; // Data blocks of the directory buckets after the root block, newest first, 0 if there are none
+    uint32_t dirTable; // Data blocks of the bucket table, 0 if there are none
+    uint8_t dirDepth; // log2 of the number of entries in the bucket table
+    uint32_t dirBuckets; // Number of buckets after the root block
+    // Free space as of the last clean unmount, so that mounting does not have to read the FAT. Only valid while clean
+    // is set, which the first metadata change after mounting clears on disk
+    uint8_t clean;
+    uint32_t fatFree;
+    uint32_t dirFree; // Empty directory entries, UINT32_MAX if they were not counted
+    uint32_t fatSummary[FAT_SUMMARY_GROUPS]; // Free data blocks of each group of FAT blocks, as small as the groups fit
+    char padding[24];
 };
 
 struct __attribute__((__packed__)) rootEntry {
     char filename[16];
     uint32_t size;
     uint16_t firstBlock;
-    char padding[10];
+    uint16_t firstBlockHigh; // Upper half of firstBlock on version 2 disks
+    char padding[8];
 };
 
-struct __attribute__((__packed__)) fileDescriptor {
-    char* filename;
+// Directory block kept in memory
+struct dirBlock {
+    int block; // Disk block of the bucket held, -1 if none
+    int pins; // Open files with their entry in the block, which stays in memory until they are closed
+    int dirty; // Changed since it was last written back
+    uint64_t lastUse;
+    uint8_t tags[DIR_BLOCK_ENTRIES]; // Top byte of the hash of each filename, 0 for empty entries
+    struct rootEntry *entries; // Block-aligned, allocated on first use
+};
+
+// Logical-to-physical block map of a file, resolved lazily from its FAT chain
+struct blockMap {
+    uint32_t *blocks;
+    int numBlocks;
+    int capacity;
+    pthread_mutex_t lock; // Concurrent readers resolve the chain together
+};
+
+// State shared by all the descriptors of an open file
+struct openFile {
+    int refCount; // Number of descriptors on the file (0 if closed)
+    struct dirBlock *dirBlock; // Block and index of the directory entry of the file, moved by bucket splits
+    int dirSlot;
+    uint32_t size; // Cached size of the file, including the append buffer
+    int firstBlock; // First data block of the file, as in its directory entry
+    struct blockMap map;
+    uint8_t *appendBuffer; // Small appends not written to the last block yet, which end the file
+    int appendLength; // Bytes in appendBuffer
+    uint64_t cursor; // Last logical block accessed through the file and the data block holding it, packed so they change together
+    pthread_rwlock_t lock; // Shared by readers of the file, exclusive for writers
+};
+
+struct fileDescriptor {
+    struct openFile *file;
     int offset;
     int fd;
+    int raNext; // Offset where the next read has to start to be sequential
+    int raWindow; // Blocks kept in flight ahead of sequential reads, 0 after a random read
+    int raEnd; // Logical block where the readahead issued so far ends
+    pthread_mutex_t lock; // Serializes the users of the offset
 };
 
+// Run of data blocks freed by fs_delete() and not discarded yet
+struct freedRun {
+    int start;
+    int count;
+};
 
-superblock_t superblock;
-struct superblock sblock;
-struct rootEntry root[128];
-struct fileDescriptor fileDescriptors[FS_OPEN_MAX_COUNT];
-uint16_t *fat = NULL;
-int fatFree = 0;
-int rootFree = 0;
-int numOpen = 0;
-int isMounted = 0;
-
-superblock_t initSuperblock() {
-    memset(sblock.signature, 0, 8);
-    sblock.numBlocks = sblock.root = sblock.data = sblock.numDataBlocks = sblock.numFATBlocks = 0;
-    memset(sblock.padding, 0, 4079);
-    return &sblock;
-}
-
-// Find index of datablock corresponding to offset and find # of bytes to modify
-int find_dataBlock(int fd, int *bytesToModify, rwFlag rw)
-{ 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    	if(!strcmp(root[i].filename, fileDescriptors[fd].filename)) { // Find the associated root entry to get file size
-			int remainingBytes = root[i].size - fileDescriptors[fd].offset; // Bytes until end of file
-			if(rw == READ) {
-                if (*bytesToModify > remainingBytes)
-				    *bytesToModify = remainingBytes;
-            }
-            if (rw == WRITE && root[i].firstBlock == FAT_EOC && fatFree != 0) { // Empty file with no associated data blocks
-                for (int j = 0; j <  superblock->numDataBlocks; j++) {
-                    if (fat[j] == 0) {
-                        root[i].firstBlock = j;
-                        break;
-                    }
-                }
-            }
-			return superblock->data + root[i].firstBlock + (fileDescriptors[fd].offset / BLOCK_SIZE);
-        }
+// Everything about a mounted image; fs.h only knows it as fs_t
+struct fs {
+    struct disk *disk;
+    struct cache *cache;
+    struct superblock superblock;
+    int version; // FS_VERSION_1 or FS_VERSION_2
+    // Layout of the disk, from either version of the superblock
+    int numBlocks;
+    int numFATBlocks;
+    int rootBlock;
+    int journalStart;
+    int numJournalBlocks;
+    int dataStart;
+    int numDataBlocks;
+    // Root directory, hashed into buckets of one block each. Filenames go to the bucket whose data block is in the
+    // bucket table at the low dirDepth bits of their hash, 0 standing for the root block. Version 1 disks only have
+    // the root block
+    struct dirBlock dirBlocks[DIR_CACHE_BLOCKS];
+    uint64_t dirClock; // Last use of the directory blocks
+    int8_t dirHints[DIR_HINTS]; // Index in dirBlocks where each disk block modulo DIR_HINTS was last found
+    uint32_t *dirTable; // Block-aligned, at least a block
+    int dirDepth;
+    uint32_t tableBlocks[DIR_TABLE_MAX_BLOCKS]; // Data blocks of the bucket table on disk
+    uint8_t tableLoaded[DIR_TABLE_MAX_BLOCKS]; // Read on first use
+    uint8_t tableDirty[DIR_TABLE_MAX_BLOCKS];
+    int numTableBlocks;
+    int tableChained; // tableBlocks past the first one were found in the FAT, on first use
+    int numBuckets;
+    int dirFree; // Empty directory entries, -1 until they are counted
+    int dirGrowable; // The journal can hold every directory block of a transaction, so buckets can split
+    int superDirty; // Superblock changed since it was last written back
+    struct fileDescriptor fileDescriptors[FS_OPEN_MAX_COUNT];
+    struct openFile openFiles[FS_OPEN_MAX_COUNT];
+    void *fat; // FAT blocks as on disk, with 16-bit or 32-bit entries
+    int fatShift; // log2 of the number of entries per FAT block
+    uint8_t *fatDirty; // FAT blocks changed since they were last written back
+    uint8_t *fatLoaded; // FAT blocks read in, on first use unless the disk was not unmounted cleanly
+    uint32_t *groupFree; // Free data blocks of each group of 2^summaryShift FAT blocks
+    uint8_t *groupIndexed; // Groups whose free data blocks are in freeMap, on first allocation from them
+    int summaryShift;
+    int numGroups;
+    size_t *commitBlocks; // Room for a journal transaction of every metadata block that can be dirty at once
+    void **commitData;
+    struct journal *journal;
+    int pendingOps; // Metadata operations not committed to the journal yet
+    int bulkImports; // Imports in progress, which commit their operations at the end rather than in batches
+    struct timespec batchStart; // Time of the first of them
+    int discardMode;
+    struct freedRun *freedRuns; // Blocks waiting to be discarded
+    int numFreedRuns;
+    int freedRunsCapacity;
+    struct freemap *freeMap;
+    int nextFit;
+    int fatFree;
+    int numOpen;
+    struct fs_op_stats opStats[FS_OP_COUNT]; // Calls of the API, updated atomically
+    uint64_t allocations; // Free block searches, under allocLock
+    uint64_t allocScanned; // Blocks skipped past the starting point of the searches
+    uint64_t allocMaxScan;
+    struct trace *trace; // Calls and transfers being recorded, if any
+
+    // Locks are taken in this order: fsLock, descriptor, metaLock, file, block map, allocLock, fatLock
+    pthread_mutex_t fsLock; // Root directory, descriptors and open counts
+    pthread_rwlock_t metaLock; // Shared by operations changing metadata, exclusive for commits
+    pthread_mutex_t allocLock; // Free space, FAT, entries of open files and the journal batch
+    pthread_mutex_t fatLock; // Reading FAT blocks in, taken last
+};
+
+fs_t *defaultFs = NULL; // File system of fs_mount() and of the functions without an @fs
+size_t cacheBlocks = FS_CACHE_DEFAULT_BLOCKS;
+enum cache_policy cachePolicy = CACHE_POLICY_LRU;
+int discardMode = FS_DISCARD_ZERO; // Discard mode of the next mounts
+char *tracePath = NULL; // Trace file of the next mounts, instead of $FS_TRACE
+int diskBackend = FS_BACKEND_DEFAULT; // Backend of the next mounts, instead of $FS_BACKEND
+unsigned queueDepth = BLOCK_QUEUE_DEPTH;
+int tracedMounts = 0; // Traces started so far, to give each mount its own file
+__thread int blocksAllocated = 0; // Data blocks claimed by the calling thread, to tell whether the FAT changed
+
+#ifndef FS_NO_STATS
+// Count a call of @op on @fs that started at @start
+static void stats_record(fs_t *fs, int op, uint64_t start)
+{
+    struct fs_op_stats *stats;
+    uint64_t ns, max;
+
+    stats = &fs->opStats[op];
+    ns = trace_clock() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= FS_STATS_BUCKETS)
+        bucket = FS_STATS_BUCKETS - 1;
+
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+#else
+#define stats_record(fs, op, start) ((void)(start))
+#endif
+
+// Clock reading at the start of a call on @fs, if its end needs one
+static uint64_t call_start(fs_t *fs)
+{
+#ifdef FS_NO_STATS
+    if (!fs || !fs->trace)
+        return 0;
+#endif
+    return trace_clock();
+}
+
+// Count a call of @op on @fs that started at @start, and log it with its arguments if @fs is traced
+static void call_end(fs_t *fs, int op, uint64_t start, int fd, uint64_t arg0, uint64_t arg1, const char *name, int ret)
+{
+    if (!fs)
+        return;
+
+    stats_record(fs, op, start);
+    if (fs->trace)
+        trace_call(fs->trace, op, start, fd, arg0, arg1, name, ret);
+}
+
+// Hash of @filename (FNV-1a, mixed so that its low bits can pick buckets)
+uint32_t hash_filename(const char *filename)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < FS_FILENAME_LEN && filename[i]; i++)
+        hash = (hash ^ (unsigned char)filename[i]) * 16777619u;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    return hash ^ (hash >> 16);
+}
+
+// Tag of the entries of a directory block holding a filename of hash @hash, never 0
+uint8_t hash_tag(uint32_t hash)
+{
+    return hash >> 24 ? hash >> 24 : 1;
+}
+
+// Read FAT block @fatBlock in, unless it already is. Readers of chains may get there without any other lock
+int load_fatBlock(fs_t *fs, int fatBlock)
+{
+    int ret = 0;
+
+    if (__atomic_load_n(&fs->fatLoaded[fatBlock], __ATOMIC_ACQUIRE))
+        return 0;
+
+    pthread_mutex_lock(&fs->fatLock);
+    if (!fs->fatLoaded[fatBlock]) {
+        ret = cache_read(fs->cache, 1 + fatBlock, fs->fat + BLOCK_SIZE*fatBlock);
+        if (!ret)
+            __atomic_store_n(&fs->fatLoaded[fatBlock], 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+    return ret;
+}
+
+// FAT entry @index, FAT_EOC at the end of a chain (or if its FAT block cannot be read)
+int get_fatEntry(fs_t *fs, int index)
+{
+    if (load_fatBlock(fs, index >> fs->fatShift))
+        return FAT_EOC;
+
+    if (fs->version == FS_VERSION_1) {
+        uint16_t entry = ((uint16_t*)fs->fat)[index];
+        return entry == FAT16_EOC ? FAT_EOC : entry;
+    }
+
+    uint32_t entry = ((uint32_t*)fs->fat)[index];
+    return entry == FAT32_EOC ? FAT_EOC : (int)entry;
+}
+
+// Set FAT entry @index to @value, marking its FAT block dirty
+void set_fatEntry(fs_t *fs, int index, int value)
+{
+    if (load_fatBlock(fs, index >> fs->fatShift)) // Writing it back would lose the other entries
+        return;
+
+    if (fs->version == FS_VERSION_1)
+        ((uint16_t*)fs->fat)[index] = value == FAT_EOC ? FAT16_EOC : value;
+    else
+        ((uint32_t*)fs->fat)[index] = value == FAT_EOC ? FAT32_EOC : value;
+    fs->fatDirty[index >> fs->fatShift] = 1;
+}
+
+// First data block of root entry @e, FAT_EOC if the file is empty
+int get_firstBlock(fs_t *fs, struct rootEntry *e)
+{
+    if (fs->version == FS_VERSION_1)
+        return e->firstBlock == FAT16_EOC ? FAT_EOC : e->firstBlock;
+
+    uint32_t block = (uint32_t)e->firstBlockHigh << 16 | e->firstBlock;
+    return block == FAT32_EOC ? FAT_EOC : (int)block;
+}
+
+// Set the first data block of root entry @e (the caller marks its directory block dirty)
+void set_firstBlock(fs_t *fs, struct rootEntry *e, int block)
+{
+    uint32_t value = block != FAT_EOC ? (uint32_t)block : fs->version == FS_VERSION_1 ? FAT16_EOC : FAT32_EOC;
+
+    e->firstBlock = value;
+    if (fs->version != FS_VERSION_1)
+        e->firstBlockHigh = value >> 16;
+}
+
+// Summary group of the FAT entry of data block @dataBlock
+int fat_group(fs_t *fs, int dataBlock)
+{
+    return dataBlock >> fs->fatShift >> fs->summaryShift;
+}
+
+// Size of FAT entries in bytes
+int fat_width(fs_t *fs)
+{
+    return fs->version == FS_VERSION_1 ? 2 : 4;
+}
+
+// Add the free data blocks whose entries are in FAT block @fatBlock (read in) to the free-space index, and return how
+// many there are
+int index_fatBlock(fs_t *fs, int fatBlock)
+{
+    uint64_t mask[BLOCK_SIZE / 2 / 64]; // One bit per entry, for the narrower entries of version 1 disks
+    int first = fatBlock << fs->fatShift, end = (fatBlock + 1) << fs->fatShift;
+
+    if (end > fs->numDataBlocks)
+        end = fs->numDataBlocks;
+    if (first >= end)
+        return 0;
+
+    int count = fatscan_free_mask(fs->fat + (size_t)first * fat_width(fs), fat_width(fs), end - first, mask);
+    freemap_set_free_mask(fs->freeMap, first, mask, end - first);
+    return count;
+}
+
+// Add the free data blocks of summary group @group to the free-space index (allocLock held)
+int index_group(fs_t *fs, int group)
+{
+    int first = group << fs->summaryShift, last = (group + 1) << fs->summaryShift;
+
+    if (last > fs->numFATBlocks)
+        last = fs->numFATBlocks;
+    for (int b = first; b < last; b++) {
+        if (load_fatBlock(fs, b))
+            return -1;
     }
 
+    for (int b = first; b < last; b++)
+        index_fatBlock(fs, b);
+    fs->groupIndexed[group] = 1;
     return 0;
 }
 
-int fs_mount(const char *diskname)
+// Number of data blocks from @dataBlock on whose FAT entry points to the block right after them, at most @max: the
+// part of a chain that goes through consecutive blocks
+int chain_run(fs_t *fs, int dataBlock, int max)
 {
-    // Open the disk
-    if(block_disk_open(diskname)) {
-        return -1;
+    int run = 0;
+
+    // A FAT block at a time, as they are read in on first use. The last data block has no block after it
+    while (run < max) {
+        int entry = dataBlock + run, fatBlock = entry >> fs->fatShift;
+        int end = (fatBlock + 1) << fs->fatShift;
+        if (end > fs->numDataBlocks - 1)
+            end = fs->numDataBlocks - 1;
+        if (entry >= end || load_fatBlock(fs, fatBlock))
+            break;
+
+        int n = fatscan_chain_run(fs->fat, fat_width(fs), end, entry, max - run);
+        run += n;
+        if (entry + n < end)
+            break;
     }
+    return run;
+}
 
-    // Read the superblock, FAT blocks, and root block
-    superblock = initSuperblock();
-    block_read(0, (void*)superblock);
-    if (memcmp(superblock->signature, "ECS150FS", 8)) { // Check signature of file system
-       return -1;
+// Index the groups from the one of @hint on until they hold @count free data blocks, so that allocations find them
+// without reading the whole FAT (allocLock held)
+void index_freeBlocks(fs_t *fs, int hint, int count)
+{
+    int group = hint < fs->numDataBlocks ? fat_group(fs, hint) : 0;
+
+    for (int n = 0; n < fs->numGroups && count > 0; n++, group = (group + 1) % fs->numGroups) {
+        if (!fs->groupFree[group] || (!fs->groupIndexed[group] && index_group(fs, group)))
+            continue;
+        count -= fs->groupFree[group];
     }
+}
 
-    fat = (uint16_t*)malloc(superblock->numDataBlocks*sizeof(uint16_t));
-    for (int i = 1; i < superblock->root; i++) {
-        block_read(i, ((void*)fat) + BLOCK_SIZE*(i - 1));
+// Claim @count free data blocks, as contiguous as possible, and chain them after @prev (if any). Either all of them
+// are claimed, or none
+int allocate_dataBlocks(fs_t *fs, int prev, int count)
+{
+    int first = FAT_EOC, last = prev;
+
+    pthread_mutex_lock(&fs->allocLock);
+    if (count > fs->fatFree) { // There is not enough space left on the disk
+        pthread_mutex_unlock(&fs->allocLock);
+        return FAT_EOC;
     }
+    index_freeBlocks(fs, prev != FAT_EOC ? prev + 1 : fs->nextFit, count);
 
-    block_read(superblock->root, (void*)root);
+    while (count > 0) {
+        size_t len;
+        // Files grow next to their last block, new files after the last allocation
+        int hint = prev != FAT_EOC ? prev + 1 : fs->nextFit;
+        long start = freemap_find_run(fs->freeMap, hint, count, &len);
+        if (start < 0)
+            break;
+#ifndef FS_NO_STATS
+        long scanned = start >= hint ? start - hint : fs->numDataBlocks - hint + start;
+        fs->allocations++;
+        fs->allocScanned += scanned;
+        if (scanned > fs->allocMaxScan)
+            fs->allocMaxScan = scanned;
+#endif
 
-    // Count available entries in FAT and in root
-    for (int i = 0; i < superblock->numDataBlocks; i++) {
-        if(fat[i] == 0) {
-            fatFree++;
+        for (int i = start; i < start + len; i++) {
+            freemap_set_used(fs->freeMap, i);
+            fs->groupFree[fat_group(fs, i)]--;
+            set_fatEntry(fs, i, FAT_EOC);
+            if (prev != FAT_EOC)
+                set_fatEntry(fs, prev, i);
+            if (first == FAT_EOC)
+                first = i;
+            prev = i;
         }
+        fs->fatFree -= len;
+        count -= len;
+        fs->nextFit = start + len;
+        blocksAllocated += len;
     }
 
-    for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-        if(root[j].filename[0] == 0) {
-            rootFree++;
+    // The index ran out of free blocks (some of the FAT could not be read): give back the ones already claimed
+    if (count > 0) {
+        for (int i = first, next; i != FAT_EOC; i = next) {
+            next = get_fatEntry(fs, i);
+            set_fatEntry(fs, i, 0);
+            freemap_set_free(fs->freeMap, i);
+            fs->groupFree[fat_group(fs, i)]++;
+            fs->fatFree++;
         }
+        if (last != FAT_EOC)
+            set_fatEntry(fs, last, FAT_EOC);
+        first = FAT_EOC;
     }
+    pthread_mutex_unlock(&fs->allocLock);
 
-    // Initialize file descriptors
-    for (int k = 0; k < FS_OPEN_MAX_COUNT; k++) {
-        fileDescriptors[k].filename = (char*)malloc(FS_FILENAME_LEN);
-        fileDescriptors[k].fd = -1;
-        fileDescriptors[k].offset = -1;
-    }
-    
-    isMounted = 1;
-	return 0;
+    return first;
 }
 
-int fs_umount(void)
+// Claim a free data block, next to @prev if possible, and chain it after @prev (if any)
+int allocate_dataBlock(fs_t *fs, int prev)
 {
-    block_write(superblock->root, (void*)root);
-
-    // Free allocated memory
-    for (int k = 0; k < FS_OPEN_MAX_COUNT; k++) {
-        free(fileDescriptors[k].filename);
-    }
+    return allocate_dataBlocks(fs, prev, 1);
+}
 
-    free(fat);
-    
-    // Close the disk
-    if (block_disk_close()) {
-        return -1;
-    }
+// Follow the FAT chain past @dataBlock, extending it when writing
+int next_dataBlock(fs_t *fs, int dataBlock, rwFlag rw)
+{
+    int next = get_fatEntry(fs, dataBlock);
+    if (next != FAT_EOC)
+        return next;
 
-    isMounted = 0;
+    return rw == WRITE ? allocate_dataBlock(fs, dataBlock) : FAT_EOC;
+}
 
-	return 0;
+// Forget the block map of @file
+void reset_blockMap(struct openFile *file)
+{
+    free(file->map.blocks);
+    file->map.blocks = NULL;
+    file->map.numBlocks = file->map.capacity = 0;
 }
 
-int fs_info(void)
+// Give @file its first data block @first, in its directory entry too
+void set_fileFirstBlock(fs_t *fs, struct openFile *file, int first)
 {
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", superblock->numBlocks);
-    printf("fat_blk_count=%d\n", superblock->numFATBlocks);
-    printf("rdir_blk=%d\n", superblock->root);
-    printf("data_blk=%d\n", superblock->data);
-    printf("data_blk_count=%d\n", superblock->numDataBlocks);
-    printf("fat_free_ratio=%d/%d\n", fatFree, superblock->numDataBlocks);
-    printf("rdir_free_ratio=%d/%d\n", rootFree, FS_FILE_MAX_COUNT);
-	return 0;
+    pthread_mutex_lock(&fs->allocLock);
+    file->firstBlock = first;
+    set_firstBlock(fs, &file->dirBlock->entries[file->dirSlot], first);
+    file->dirBlock->dirty = 1;
+    pthread_mutex_unlock(&fs->allocLock);
 }
 
-int fs_create(const char *filename)
+// Body of map_dataBlock(), with the block map locked
+int resolve_dataBlock(fs_t *fs, struct openFile *file, int index, rwFlag rw)
 {
-    // Don't create if no more space on disk or @filename is invalid
-    if (!isMounted || rootFree == 0 || strlen(filename) > FS_FILENAME_LEN || filename[strlen(filename)] != '\0')
-        return -1;
+    struct blockMap *map = &file->map;
 
-    // Don't create file if a file with the same name already exists on the FS
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if(!strcmp(root[i].filename, filename))
-            return -1;
-    }
+    // Resolve the chain up to @index once; chains only ever grow at the end
+    while (map->numBlocks <= index) {
+        int next;
+        if (map->numBlocks == 0) {
+            if (file->firstBlock == FAT_EOC) { // Empty file with no associated data blocks
+                if (rw == READ)
+                    return FAT_EOC;
+                set_fileFirstBlock(fs, file, allocate_dataBlock(fs, FAT_EOC));
+            }
+            next = file->firstBlock;
+        } else {
+            next = next_dataBlock(fs, map->blocks[map->numBlocks - 1], rw);
+        }
+        if (next == FAT_EOC)
+            return FAT_EOC;
 
-    // Create empty file and add root entry
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if(root[i].filename[0] == 0) { // Find the first empty root entry
-            strcpy(root[i].filename, filename);
-            root[i].size = 0;
-            root[i].firstBlock = FAT_EOC;
-            block_write(superblock->root, (void*) root); // Write change to disk
-            return 0;
+        // Along with the blocks that follow it on the disk, as far as the chain does
+        int count = 1 + chain_run(fs, next, index - map->numBlocks);
+        if (map->numBlocks + count > map->capacity) {
+            int capacity = map->capacity ? map->capacity * 2 : 16;
+            while (capacity < map->numBlocks + count)
+                capacity *= 2;
+            uint32_t *blocks = realloc(map->blocks, capacity * sizeof(uint32_t));
+            if (!blocks)
+                return FAT_EOC;
+            map->blocks = blocks;
+            map->capacity = capacity;
         }
+        for (int i = 0; i < count; i++)
+            map->blocks[map->numBlocks++] = next + i;
     }
- 
-    // Function should not reach here if file successfully created
-	return -1; 
+
+    return map->blocks[index];
 }
 
-int fs_delete(const char *filename)
+// Find the data block holding logical block @index of @file, extending the chain when writing
+int map_dataBlock(fs_t *fs, struct openFile *file, int index, rwFlag rw)
 {
-    void* bounceBuffer = NULL;
+    pthread_mutex_lock(&file->map.lock);
+    int block = resolve_dataBlock(fs, file, index, rw);
+    pthread_mutex_unlock(&file->map.lock);
+    return block;
+}
 
-    // Check if @filename is valid
-    if (!isMounted || strlen(filename) > FS_FILENAME_LEN || filename[strlen(filename)] != '\0')
-        return -1;
+// Find the data block of @file holding @offset and clamp the # of bytes to modify
+int find_dataBlock(fs_t *fs, struct openFile *file, size_t offset, size_t *bytesToModify, rwFlag rw)
+{
+    int index = offset / BLOCK_SIZE;
+    uint64_t cursor = __atomic_load_n(&file->cursor, __ATOMIC_RELAXED);
 
-    // Don't delete the file if it is open
-    for (int k = 0; k < FS_OPEN_MAX_COUNT; k++) {
-        if(fileDescriptors[k].filename && !strcmp(fileDescriptors[k].filename, filename))
-            return -1;
+    if (rw == READ) {
+        size_t remainingBytes = file->size - offset; // Bytes until end of file
+        if (*bytesToModify > remainingBytes)
+            *bytesToModify = remainingBytes;
     }
 
-    bounceBuffer = malloc(BLOCK_SIZE); 
-
-   // Reset the associated fat entries, data blocks, and root entry
-   for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if(!strcmp(root[i].filename, filename)) {
-            int clearIndex = root[i].firstBlock;
-            while(clearIndex != FAT_EOC) {
-                block_read(superblock->data + clearIndex, bounceBuffer);
-                memset(bounceBuffer, 0, BLOCK_SIZE);
-                block_write(superblock->data + clearIndex, bounceBuffer);
-                int next = fat[clearIndex];
-                fat[clearIndex] = 0;
-                fatFree++;
-                clearIndex = next;
-            }
-            free(bounceBuffer);
-            root[i].filename[0] = 0;
-            root[i].size = 0;
-            root[i].firstBlock = FAT_EOC;
-            block_write(superblock->root, (void*) root);
-            rootFree++;
-            return 0;
+    // Sequential access picks up where the previous call left off
+    if (cursor != CURSOR_NONE) {
+        int cursorIndex = cursor >> 32, cursorBlock = (uint32_t)cursor;
+        if (index == cursorIndex)
+            return cursorBlock;
+        if (index == cursorIndex + 1) {
+            int next = get_fatEntry(fs, cursorBlock);
+            if (next != FAT_EOC)
+                return next;
         }
     }
 
-    // Function should not reach here if deletion successful
-	return -1;
+    return map_dataBlock(fs, file, index, rw);
 }
 
-int fs_ls(void)
+// Remember @lastBlock as the last block accessed in @file, which ends right before @endOffset
+void update_cursor(struct openFile *file, size_t endOffset, int lastBlock)
 {
-    if(!isMounted)
-        return -1;
-
-    printf("FS Ls:\n");
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if(root[i].filename[0] != 0) {
-            printf("file: %s, size: %d, data_blk: %d\n", root[i].filename, root[i].size, root[i].firstBlock);
-        }
-    } 
-	return 0;
+    uint64_t index = (endOffset - 1) / BLOCK_SIZE;
+    __atomic_store_n(&file->cursor, index << 32 | (uint32_t)lastBlock, __ATOMIC_RELAXED);
 }
 
-int fs_open(const char *filename)
+// Extend a run of whole blocks from @dataBlock while the chain stays contiguous
+int find_run(fs_t *fs, int dataBlock, size_t maxBlocks, int moreBytes, int *next, rwFlag rw)
 {
-    int fileExists = 0;
+    // The contiguous part of the chain in one scan, then entry by entry for where it ends
+    int run = 1 + chain_run(fs, dataBlock, maxBlocks > INT_MAX ? INT_MAX - 1 : (int)maxBlocks - 1);
 
-    // Don't open if disk cannot open any more files or @filename is invalid
-    if (!isMounted || numOpen == FS_OPEN_MAX_COUNT || strlen(filename) > FS_FILENAME_LEN || filename[strlen(filename)] != '\0') 
-       return -1;
- 
-    // Check if the file exists on the disk 
-    for(int i = 0; i <= FS_FILE_MAX_COUNT; i++) {
-        if(!strcmp(root[i].filename, filename)){ // File found
-            fileExists = 1;
+    *next = FAT_EOC;
+    while (run < maxBlocks || moreBytes) {
+        *next = next_dataBlock(fs, dataBlock + run - 1, rw);
+        if (run == maxBlocks || *next != dataBlock + run)
             break;
-        }
+        run++;
+        *next = FAT_EOC;
     }
 
-    if(fileExists == 0)
-        return -1;
+    return run;
+}
 
-    // Open the file and assign a file descriptor entry
-    for(int k = 0; k < FS_OPEN_MAX_COUNT; k++){
-        if (fileDescriptors[k].fd == -1) {
-            strcpy(fileDescriptors[k].filename, filename);
-            fileDescriptors[k].fd = k; // Given file descriptor is simply the index in fileDescriptors
-            fileDescriptors[k].offset = 0;
-            numOpen++;
-            return fileDescriptors[k].fd;
+// Queue the @count freed data blocks from @dataBlock on for discarding, merging them with the previous run if possible
+void queue_discard(fs_t *fs, int dataBlock, int count)
+{
+    if (fs->discardMode == FS_DISCARD_NONE)
+        return;
+
+    if (fs->numFreedRuns > 0) {
+        struct freedRun *last = &fs->freedRuns[fs->numFreedRuns - 1];
+        if (last->start + last->count == dataBlock) {
+            last->count += count;
+            return;
         }
     }
 
-    // Function should not reach here if file successfully opened
-	return -1;
+    if (fs->numFreedRuns == fs->freedRunsCapacity) {
+        int capacity = fs->freedRunsCapacity ? fs->freedRunsCapacity * 2 : 64;
+        struct freedRun *runs = realloc(fs->freedRuns, capacity * sizeof(struct freedRun));
+        if (!runs) // Leave the blocks as they are
+            return;
+        fs->freedRuns = runs;
+        fs->freedRunsCapacity = capacity;
+    }
+    fs->freedRuns[fs->numFreedRuns].start = dataBlock;
+    fs->freedRuns[fs->numFreedRuns++].count = count;
 }
 
-int fs_close(int fd)
+// Free the @count data blocks from @dataBlock on (allocLock held)
+void free_dataBlocks(fs_t *fs, int dataBlock, int count)
 {
-    // Check if @fd is valid and file with @fd is open
-    if (!isMounted || fd  >= FS_OPEN_MAX_COUNT || fd < 0 || fileDescriptors[fd].fd != fd) {
-        return -1;
+    int width = fat_width(fs);
+
+    for (int i = dataBlock, n; i < dataBlock + count; i += n) {
+        int fatBlock = i >> fs->fatShift;
+        n = ((fatBlock + 1) << fs->fatShift) - i;
+        if (n > dataBlock + count - i)
+            n = dataBlock + count - i;
+        if (load_fatBlock(fs, fatBlock)) // Writing it back would lose the other entries
+            continue;
+        memset(fs->fat + (size_t)i * width, 0, (size_t)n * width);
+        fs->fatDirty[fatBlock] = 1;
+    }
+    for (int i = dataBlock; i < dataBlock + count; i++) {
+        freemap_set_free(fs->freeMap, i);
+        fs->groupFree[fat_group(fs, i)]++;
+    }
+    queue_discard(fs, dataBlock, count);
+    fs->fatFree += count;
+}
+
+// Overwrite data blocks [@start, @start + @count) with zeroes, many blocks per write
+int zero_dataBlocks(fs_t *fs, int start, int count)
+{
+    static const uint8_t zeroBlock[BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE))); // Shared by all the mounted file systems, never written
+    struct iovec iov[DISCARD_ZERO_BLOCKS];
+
+    for (int i = 0; i < DISCARD_ZERO_BLOCKS; i++) {
+        iov[i].iov_base = (void*)zeroBlock;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    while (count > 0) {
+        int n = count < DISCARD_ZERO_BLOCKS ? count : DISCARD_ZERO_BLOCKS;
+        if (block_writev(fs->disk, fs->dataStart + start, iov, n))
+            return -1;
+        start += n;
+        count -= n;
     }
 
-    // Reset associated fileDescriptors entry
-    memset(fileDescriptors[fd].filename, 0, FS_FILENAME_LEN);
-    fileDescriptors[fd].fd = -1;
-    fileDescriptors[fd].offset = -1;
     return 0;
 }
 
-int fs_stat(int fd)
+// Discard the queued blocks that are still free, once their deletion has been written back
+int discard_freedBlocks(fs_t *fs)
 {
-    // Check if @fd valid and file with @fd is open
-    if (!isMounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fileDescriptors[fd].fd != fd) {
-        return -1;
-    }
+    int ret = 0;
+
+    for (int r = 0; r < fs->numFreedRuns; r++) {
+        int end = fs->freedRuns[r].start + fs->freedRuns[r].count;
+        for (int start = fs->freedRuns[r].start; start < end; ) {
+            int count = 0;
+            // Blocks reallocated since they were freed now belong to another file
+            while (start + count < end && freemap_is_free(fs->freeMap, start + count))
+                count++;
+            if (count == 0) {
+                start++;
+                continue;
+            }
 
-    // Find associated root entry to get file size
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (!strcmp(root[i].filename, fileDescriptors[fd].filename)) {
-            return root[i].size;
+            // Punching holes depends on the host file system, zeroing always works
+            cache_discard(fs->cache, fs->dataStart + start, count);
+            if ((fs->discardMode != FS_DISCARD_PUNCH || block_discard(fs->disk, fs->dataStart + start, count)) && zero_dataBlocks(fs, start, count))
+                ret = -1;
+            start += count;
         }
     }
+    fs->numFreedRuns = 0;
 
-    // Function should not reach here if file size successfully found
-	return -1;
+    return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+// Whether any metadata block is dirty
+int metadata_dirty(fs_t *fs)
 {
-    // Check if @fd and @offset valid and file with @fd is open
-    if (!isMounted || fd  >= FS_OPEN_MAX_COUNT || fd < 0 || offset < 0 || offset > fs_stat(fd) || fileDescriptors[fd].fd != fd) {
-        return -1;
-    }
+    if (fs->superDirty || memchr(fs->fatDirty, 1, fs->numFATBlocks) || memchr(fs->tableDirty, 1, fs->numTableBlocks))
+        return 1;
 
-    fileDescriptors[fd].offset = offset;
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++) {
+        if (fs->dirBlocks[i].dirty)
+            return 1;
+    }
     return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+// Write the dirty FAT blocks, directory blocks, bucket table blocks and superblock through the cache
+int write_metadata(fs_t *fs)
 {
-    int* bytesToWrite = (int *)malloc(sizeof(count));
-    int writeBlock, blockBytes, blockOffset, bytesWritten = 0;
-    void* bounceBuffer = malloc(BLOCK_SIZE);
-    if (!isMounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fileDescriptors[fd].fd != fd) {
+    int ret = 0;
+
+    // Without a journal, the disk has to be marked unclean before any of the metadata changes reach it
+    if (!fs->journal && fs->superblock.clean && metadata_dirty(fs)) {
+        fs->superblock.clean = 0;
+        if (cache_write(fs->cache, 0, (void*)&fs->superblock) || cache_flush(fs->cache) || block_disk_sync(fs->disk))
             return -1;
     }
 
-    *bytesToWrite = count;
-    writeBlock = find_dataBlock(fd, bytesToWrite, WRITE);
-    blockOffset = fileDescriptors[fd].offset - (fileDescriptors[fd].offset/BLOCK_SIZE)*BLOCK_SIZE;
+    for (int i = 1; i <= fs->numFATBlocks; i++) {
+        if (!fs->fatDirty[i - 1])
+            continue;
+        if (cache_write(fs->cache, i, ((void*)fs->fat) + BLOCK_SIZE*(i - 1)))
+            ret = -1;
+        else
+            fs->fatDirty[i - 1] = 0;
+    }
+
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++) {
+        struct dirBlock *blk = &fs->dirBlocks[i];
+        if (!blk->dirty)
+            continue;
+        if (cache_write(fs->cache, blk->block, blk->entries))
+            ret = -1;
+        else // Looked at without metaLock when looking for blocks to replace
+            __atomic_store_n(&blk->dirty, 0, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < fs->numTableBlocks; i++) {
+        if (!fs->tableDirty[i])
+            continue;
+        if (cache_write(fs->cache, fs->dataStart + fs->tableBlocks[i], (void*)fs->dirTable + BLOCK_SIZE*i))
+            ret = -1;
+        else
+            fs->tableDirty[i] = 0;
+    }
+
+    if (fs->superDirty) {
+        if (cache_write(fs->cache, 0, (void*)&fs->superblock))
+            ret = -1;
+        else
+            fs->superDirty = 0;
+    }
+
+    return ret;
+}
+
+// Body of commit_metadata(), with metaLock held exclusively
+int commit_batch(fs_t *fs)
+{
+    size_t *blocks = fs->commitBlocks, count = 0;
+    void **data = fs->commitData;
 
-    // Stop if no more space on disk to write
-    if (writeBlock == FAT_EOC)
-        return bytesWritten;
+    if (!fs->journal)
+        return write_metadata(fs) || discard_freedBlocks(fs) ? -1 : 0;
 
-    if (blockOffset != 0) { // Offset is in middle of a block
-        block_read(writeBlock, bounceBuffer);
-        blockBytes = (fileDescriptors[fd].offset/BLOCK_SIZE + 1)*BLOCK_SIZE - fileDescriptors[fd].offset; // Bytes that can be written in first block
-        if (*bytesToWrite < blockBytes) { // Only need to write to this one block
-            memcpy(bounceBuffer + blockOffset, buf, *bytesToWrite); 
-            bytesWritten += *bytesToWrite; 
-            *bytesToWrite -= *bytesToWrite; // bytesToWrite = 0
-            block_write(writeBlock, bounceBuffer);
+    for (int i = 1; i <= fs->numFATBlocks; i++) {
+        if (fs->fatDirty[i - 1]) {
+            blocks[count] = i;
+            data[count++] = ((void*)fs->fat) + BLOCK_SIZE*(i - 1);
+        }
+    }
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++) {
+        if (fs->dirBlocks[i].dirty) {
+            blocks[count] = fs->dirBlocks[i].block;
+            data[count++] = fs->dirBlocks[i].entries;
         }
-        else { // Write to the end of the block
+    }
+    for (int i = 0; i < fs->numTableBlocks; i++) {
+        if (fs->tableDirty[i]) {
+            blocks[count] = fs->dataStart + fs->tableBlocks[i];
+            data[count++] = (void*)fs->dirTable + BLOCK_SIZE*i;
+        }
+    }
+    if (count > 0 && fs->superblock.clean) { // The first transaction since mounting marks the disk unclean
+        fs->superblock.clean = 0;
+        fs->superDirty = 1;
+    }
+    if (fs->superDirty) {
+        blocks[count] = 0;
+        data[count++] = (void*)&fs->superblock;
+    }
+
+    pthread_mutex_lock(&fs->allocLock);
+    fs->pendingOps = 0;
+    pthread_mutex_unlock(&fs->allocLock);
+    if (count == 0) // Every deletion is already committed
+        return discard_freedBlocks(fs);
+
+    // Write the data blocks first, so that the flush of the commit also covers them
+    if (cache_flush(fs->cache) || journal_commit(fs->journal, blocks, data, count))
+        return -1;
+
+    return write_metadata(fs) || discard_freedBlocks(fs) ? -1 : 0;
+}
+
+// Commit the dirty metadata to the journal, then write it back through the cache
+int commit_metadata(fs_t *fs)
+{
+    // Wait for the operations in progress, so that the metadata is consistent
+    pthread_rwlock_wrlock(&fs->metaLock);
+    int ret = commit_batch(fs);
+    pthread_rwlock_unlock(&fs->metaLock);
+    return ret;
+}
+
+// Count a completed metadata operation, committing the batch once it is big or old enough (metaLock must not be held)
+void end_operation(fs_t *fs)
+{
+    struct timespec now;
+
+    if (!fs->journal)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&fs->allocLock);
+    if (fs->pendingOps++ == 0)
+        fs->batchStart = now;
+
+    long elapsedMs = (now.tv_sec - fs->batchStart.tv_sec) * 1000 + (now.tv_nsec - fs->batchStart.tv_nsec) / 1000000;
+    int full = !fs->bulkImports && (fs->pendingOps >= JOURNAL_BATCH_OPS || elapsedMs >= JOURNAL_BATCH_MS);
+    pthread_mutex_unlock(&fs->allocLock);
+
+    if (full)
+        commit_metadata(fs);
+}
+
+// Block-sized buffer for partial blocks, aligned so that it can go to an O_DIRECT disk without staging
+static void *alloc_bounceBuffer(void)
+{
+    void *bounceBuffer;
+
+    if (posix_memalign(&bounceBuffer, BLOCK_SIZE, BLOCK_SIZE))
+        return NULL;
+    return bounceBuffer;
+}
+
+// Body of write_file(), with @file locked for writing and no append buffer pending; sets @grew if the file grew
+int write_blocks(fs_t *fs, struct openFile *file, void *buf, size_t count, size_t offset, int *grew)
+{
+    size_t bytesToWrite = count, bytesWritten = 0, headBytes;
+    int writeBlock, blockOffset, lastBlock = FAT_EOC, failed = 0;
+    void* bounceBuffer = NULL; // Only needed for partial head and tail blocks
+
+    writeBlock = find_dataBlock(fs, file, offset, &bytesToWrite, WRITE);
+    blockOffset = offset % BLOCK_SIZE;
+    if (blockOffset != 0 && !(bounceBuffer = alloc_bounceBuffer()))
+        writeBlock = FAT_EOC;
+
+    if (writeBlock != FAT_EOC && blockOffset != 0) { // Offset is in middle of a block
+        size_t blockBytes = BLOCK_SIZE - blockOffset; // Bytes that can be written in first block
+        if (bytesToWrite < blockBytes)
+            blockBytes = bytesToWrite;
+        // Merging the new bytes into stale contents would corrupt the rest of the block
+        if (cache_read(fs->cache, fs->dataStart + writeBlock, bounceBuffer)) {
+            failed = 1;
+        } else {
             memcpy(bounceBuffer + blockOffset, buf, blockBytes);
+            failed = cache_write(fs->cache, fs->dataStart + writeBlock, bounceBuffer) != 0;
+        }
+        if (failed) {
+            writeBlock = FAT_EOC;
+        } else {
             bytesWritten += blockBytes;
-            *bytesToWrite -= blockBytes;
-            buf += blockBytes;
-            block_write(writeBlock, bounceBuffer);
-            writeBlock++;
-            memset(bounceBuffer, 0 , BLOCK_SIZE); // Clear the bounce buffer for possible later use
-        }
-    }
-
-    // Write to whole blocks until no longer possible
-    while (*bytesToWrite >= BLOCK_SIZE) {
-        block_read(writeBlock, bounceBuffer);
-        memcpy(bounceBuffer, buf, BLOCK_SIZE);
-        *bytesToWrite -= BLOCK_SIZE;
-        bytesWritten += BLOCK_SIZE;
-        buf += BLOCK_SIZE;
-        block_write(writeBlock, bounceBuffer);
-        memset(bounceBuffer, 0, BLOCK_SIZE);
-        // Allocate more data blocks while needed
-        if (fat[writeBlock - superblock->data] == FAT_EOC && bytesToWrite > 0) {
-            if (fatFree == 0) // There is no more space on the disk to write to
-                return bytesWritten;
-            else { // Find the first free fat block and add it to the file's chainmap
-                for (int i = 0; i < superblock->numDataBlocks; i++) {
-                    if(fat[i] == 0) {
-                        fat[writeBlock - superblock->data] = i;
-                        fat[i] = FAT_EOC;
-                        fatFree--;
-                        break; 
-                    }
-                }
-            }
+            bytesToWrite -= blockBytes;
+            lastBlock = writeBlock;
+            if (bytesToWrite > 0)
+                writeBlock = next_dataBlock(fs, writeBlock, WRITE);
         }
-        writeBlock++;
     }
 
-    // Write any remaining bytes to last block
-    if (*bytesToWrite > 0) {
-        block_read(writeBlock, bounceBuffer);
-        memcpy(bounceBuffer, buf, *bytesToWrite);
-        bytesWritten += *bytesToWrite;
-        *bytesToWrite -= *bytesToWrite;
-        block_write(writeBlock, bounceBuffer);
-    }   
-
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    	if(!strcmp(root[i].filename, fileDescriptors[fd].filename) && fileDescriptors[fd].offset + bytesWritten > root[i].size) {
-            root[i].size = fileDescriptors[fd].offset + bytesWritten;
+    // Write whole blocks, submitting every physically contiguous run before waiting on any
+    headBytes = bytesWritten;
+    while (writeBlock != FAT_EOC && bytesToWrite >= BLOCK_SIZE) {
+        int next;
+        int run = find_run(fs, writeBlock, bytesToWrite / BLOCK_SIZE, bytesToWrite % BLOCK_SIZE != 0, &next, WRITE);
+        if (cache_submit_write(fs->cache, fs->dataStart + writeBlock, run, buf + bytesWritten)) {
+            failed = 1;
             break;
         }
-    }           
-	
+        bytesWritten += run * BLOCK_SIZE;
+        bytesToWrite -= run * BLOCK_SIZE;
+        lastBlock = writeBlock + run - 1;
+        writeBlock = next;
+    }
+    if (cache_complete(fs->cache) || failed) { // Don't report blocks that may not have made it to disk
+        bytesWritten = headBytes;
+        writeBlock = lastBlock = FAT_EOC;
+    }
+
+    // Write any remaining bytes to last block, which only has to be read if it holds data past them
+    if (writeBlock != FAT_EOC && bytesToWrite > 0 && bytesToWrite < BLOCK_SIZE
+        && (bounceBuffer || (bounceBuffer = alloc_bounceBuffer()))) {
+        if (offset + bytesWritten < file->size)
+            failed = cache_read(fs->cache, fs->dataStart + writeBlock, bounceBuffer) != 0;
+        else // Appending, the rest of the block is past the end of the file
+            memset(bounceBuffer + bytesToWrite, 0, BLOCK_SIZE - bytesToWrite);
+        memcpy(bounceBuffer, buf + bytesWritten, bytesToWrite);
+        if (!failed && !cache_write(fs->cache, fs->dataStart + writeBlock, bounceBuffer)) {
+            bytesWritten += bytesToWrite;
+            bytesToWrite = 0;
+            lastBlock = writeBlock;
+        }
+    }
+
+    if (offset + bytesWritten > file->size) {
+        file->size = offset + bytesWritten;
+        pthread_mutex_lock(&fs->allocLock);
+        file->dirBlock->entries[file->dirSlot].size = file->size;
+        file->dirBlock->dirty = 1;
+        pthread_mutex_unlock(&fs->allocLock);
+        *grew = 1;
+    }
+
     free(bounceBuffer);
-    free(bytesToWrite);
 
-    fileDescriptors[fd].offset += bytesWritten;
-    buf -= bytesWritten;
+    if (lastBlock != FAT_EOC)
+        update_cursor(file, offset + bytesWritten, lastBlock);
 
-	return bytesWritten;
+    return bytesWritten;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+// Write the append buffer of @file, locked for writing, to its last block
+int flush_appendBuffer(fs_t *fs, struct openFile *file, int *grew)
 {
-    int* bytesToRead = (int *)malloc(sizeof(count));
-    int readBlock, blockBytes, blockOffset, bytesRead = 0;
-    void* bounceBuffer = NULL;
-    if (!isMounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fileDescriptors[fd].fd != fd) {
-            return -1;
+    int length = file->appendLength;
+
+    if (length == 0)
+        return 0;
+
+    file->appendLength = 0;
+    file->size -= length;
+    return write_blocks(fs, file, file->appendBuffer, length, file->size, grew) == length ? 0 : -1;
+}
+
+// Flush the append buffer of @file, taking the locks that writing it needs
+int sync_appendBuffer(fs_t *fs, struct openFile *file)
+{
+    int allocatedBefore = blocksAllocated, grew = 0, ret;
+
+    pthread_rwlock_rdlock(&fs->metaLock);
+    pthread_rwlock_wrlock(&file->lock);
+    ret = flush_appendBuffer(fs, file, &grew);
+    pthread_rwlock_unlock(&file->lock);
+    pthread_rwlock_unlock(&fs->metaLock);
+    if (grew || blocksAllocated != allocatedBefore)
+        end_operation(fs);
+
+    return ret;
+}
+
+// Flush the append buffers of every open file
+int sync_appendBuffers(fs_t *fs)
+{
+    int ret = 0;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        pthread_mutex_lock(&fs->fsLock);
+        int open = fs->openFiles[i].refCount > 0;
+        pthread_mutex_unlock(&fs->fsLock);
+        if (open && sync_appendBuffer(fs, &fs->openFiles[i]))
+            ret = -1;
     }
 
-    *bytesToRead = count;
-    readBlock = find_dataBlock(fd, bytesToRead, READ);
-    blockOffset = fileDescriptors[fd].offset - (fileDescriptors[fd].offset/BLOCK_SIZE)*BLOCK_SIZE;
- 
-    if (blockOffset != 0) { // Offset is in middle of a block
-        bounceBuffer = malloc(BLOCK_SIZE);
-        block_read(readBlock, bounceBuffer);
-        blockBytes = (fileDescriptors[fd].offset/BLOCK_SIZE + 1)*BLOCK_SIZE - fileDescriptors[fd].offset; // Bytes to read from first block
-        if (*bytesToRead < blockBytes) { // Only need to read from this one block
-            memcpy(buf, bounceBuffer + blockOffset, *bytesToRead);
-            *bytesToRead -= *bytesToRead; // bytesToRead = 0
-            bytesRead += *bytesToRead;
-        }
-        else { // Read to the end of the block
-            memcpy(buf, bounceBuffer + blockOffset, blockBytes);
-            readBlock++;
-            bytesRead += blockBytes;
-            *bytesToRead -= blockBytes;
-            buf += blockBytes;
-            memset(bounceBuffer, 0 , BLOCK_SIZE); // Clear the bounce buffer for possible later use
-        }
+    return ret;
+}
+
+// Slot for a directory block about to be brought in, taken from the least recently used block that is neither dirty
+// nor held by an open file (fsLock held). NULL if there is none
+struct dirBlock *evict_dirBlock(fs_t *fs)
+{
+    struct dirBlock *victim = NULL;
+
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++) {
+        struct dirBlock *blk = &fs->dirBlocks[i];
+        if (!blk->pins && !__atomic_load_n(&blk->dirty, __ATOMIC_RELAXED) && (!victim || blk->lastUse < victim->lastUse))
+            victim = blk;
     }
+    if (!victim)
+        return NULL;
 
-    // Read whole blocks until no longer possible
-    while (*bytesToRead >= BLOCK_SIZE) {
-        block_read(readBlock, buf);
-        *bytesToRead -= BLOCK_SIZE;
-        bytesRead += BLOCK_SIZE;
-        buf += BLOCK_SIZE;
-        readBlock++;
+    if (!victim->entries && posix_memalign((void**)&victim->entries, BLOCK_SIZE, BLOCK_SIZE)) {
+        victim->entries = NULL;
+        return NULL;
     }
+    victim->block = -1;
+    victim->lastUse = ++fs->dirClock;
+    return victim;
+}
 
-    // Read any remaining bytes
-    if (*bytesToRead > 0) {
-        if (!bounceBuffer)
-            bounceBuffer = malloc(BLOCK_SIZE);
-        block_read(readBlock, bounceBuffer);
-        memcpy(buf, bounceBuffer, *bytesToRead);
-        bytesRead += *bytesToRead;
-        *bytesToRead -= *bytesToRead;
-    }   
+// Directory block of disk block @block if it is in memory, NULL otherwise (fsLock held)
+struct dirBlock *find_dirBlock(fs_t *fs, int block)
+{
+    int8_t *hint = &fs->dirHints[block % DIR_HINTS];
 
-    if (bounceBuffer)
-        free(bounceBuffer);
-  
-    free(bytesToRead);
-    fileDescriptors[fd].offset += bytesRead;
-    buf -= bytesRead; 
-	return bytesRead;
+    if (fs->dirBlocks[*hint].block == block)
+        return &fs->dirBlocks[*hint];
+
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++) {
+        if (fs->dirBlocks[i].block == block) {
+            *hint = i;
+            return &fs->dirBlocks[i];
+        }
+    }
+    return NULL;
 }
 
+// Bring directory block @blk in as disk block @block, with the entries the caller put in it (fsLock held)
+void place_dirBlock(fs_t *fs, struct dirBlock *blk, int block)
+{
+    blk->block = block;
+    fs->dirHints[block % DIR_HINTS] = blk - fs->dirBlocks;
+}
+
+// Directory block of the bucket at disk block @block, read in if it is not in memory (fsLock held). NULL if it cannot
+// be read
+struct dirBlock *get_dirBlock(fs_t *fs, int block)
+{
+    struct dirBlock *blk = find_dirBlock(fs, block);
+
+    if (blk) {
+        blk->lastUse = ++fs->dirClock;
+        return blk;
+    }
+
+    if (!(blk = evict_dirBlock(fs)) || cache_read(fs->cache, block, blk->entries))
+        return NULL;
+    for (int i = 0; i < DIR_BLOCK_ENTRIES; i++)
+        blk->tags[i] = blk->entries[i].filename[0] ? hash_tag(hash_filename(blk->entries[i].filename)) : 0;
+    place_dirBlock(fs, blk, block);
+    return blk;
+}
+
+// Copy the entries of the bucket at disk block @block to @entries, without keeping the block in memory (fsLock held)
+int read_bucket(fs_t *fs, int block, struct rootEntry *entries)
+{
+    struct dirBlock *blk = find_dirBlock(fs, block);
+
+    if (blk) {
+        pthread_mutex_lock(&fs->allocLock); // Writers update the entries of open files
+        memcpy(entries, blk->entries, BLOCK_SIZE);
+        pthread_mutex_unlock(&fs->allocLock);
+        return 0;
+    }
+
+    // Blocks that are not in memory are clean
+    return cache_read(fs->cache, block, entries);
+}
+
+// Bucket after the one at disk block @block in the chain of the directory, 0 past the last one. The root block comes
+// first
+int next_bucket(fs_t *fs, int block)
+{
+    int next;
+
+    if (block == fs->rootBlock)
+        next = fs->version != FS_VERSION_1 && fs->superblock.dirChain ? (int)fs->superblock.dirChain : FAT_EOC;
+    else
+        next = get_fatEntry(fs, block - fs->dataStart);
+    return next > 0 && next < fs->numDataBlocks ? fs->dataStart + next : 0;
+}
+
+// Make sure that bucket table block @i is in memory (fsLock held)
+int load_tableBlock(fs_t *fs, int i)
+{
+    if (fs->tableLoaded[i])
+        return 0;
+
+    // The superblock has the first block, the FAT chains the others
+    if (i > 0 && !fs->tableChained) {
+        for (int j = 1; j < fs->numTableBlocks; j++) {
+            int block = get_fatEntry(fs, fs->tableBlocks[j - 1]);
+            if (block <= 0 || block >= fs->numDataBlocks)
+                return -1;
+            fs->tableBlocks[j] = block;
+        }
+        fs->tableChained = 1;
+    }
+    if (cache_read(fs->cache, fs->dataStart + fs->tableBlocks[i], (void*)fs->dirTable + BLOCK_SIZE*i))
+        return -1;
+    fs->tableLoaded[i] = 1;
+    return 0;
+}
+
+// Disk block of the bucket of filenames of hash @hash, 0 if the bucket table cannot be read (fsLock held)
+int hash_bucket(fs_t *fs, uint32_t hash)
+{
+    uint32_t i = hash & ((1u << fs->dirDepth) - 1);
+
+    if (load_tableBlock(fs, i * sizeof(uint32_t) / BLOCK_SIZE))
+        return 0;
+    if (fs->dirTable[i] >= (uint32_t)fs->numDataBlocks)
+        return 0;
+    return fs->dirTable[i] ? fs->dataStart + (int)fs->dirTable[i] : fs->rootBlock;
+}
+
+// Make sure that an operation can bring in the directory blocks it needs, writing back the dirty ones if they fill
+// the memory (fsLock held, metaLock not held)
+int reserve_dirBlocks(fs_t *fs)
+{
+    int available = 0;
+
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++) {
+        if (!fs->dirBlocks[i].pins && !__atomic_load_n(&fs->dirBlocks[i].dirty, __ATOMIC_RELAXED) && ++available == DIR_RESERVE_BLOCKS)
+            return 0;
+    }
+
+    return commit_metadata(fs);
+}
+
+// Find the entry of @filename, of hash @hash: return its directory block and set @slot to its index, or to -1 if
+// there is no such file (fsLock held). NULL if the block cannot be read
+struct dirBlock *find_dirEntry(fs_t *fs, const char *filename, uint32_t hash, int *slot)
+{
+    int block = hash_bucket(fs, hash);
+    struct dirBlock *blk = block ? get_dirBlock(fs, block) : NULL;
+    uint8_t tag = hash_tag(hash);
+
+    *slot = -1;
+    if (!blk)
+        return NULL;
+
+    // Only the entries with the same tag can hold the name
+    for (uint8_t *p = blk->tags; (p = memchr(p, tag, blk->tags + DIR_BLOCK_ENTRIES - p)); p++) {
+        if (!strncmp(blk->entries[p - blk->tags].filename, filename, FS_FILENAME_LEN)) {
+            *slot = p - blk->tags;
+            break;
+        }
+    }
+    return blk;
+}
+
+// Open file of entry @slot of @blk, NULL if the file is closed (fsLock held)
+struct openFile *find_openFile(fs_t *fs, struct dirBlock *blk, int slot)
+{
+    if (!blk->pins)
+        return NULL;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        struct openFile *file = &fs->openFiles[i];
+        if (file->refCount > 0 && file->dirBlock == blk && file->dirSlot == slot)
+            return file;
+    }
+    return NULL;
+}
+
+// Double the bucket table, extending its chain of data blocks as needed (fsLock and metaLock held)
+int grow_dirTable(fs_t *fs)
+{
+    size_t size = (size_t)sizeof(uint32_t) << fs->dirDepth;
+    int numBlocks = (2*size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int allocated = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (int i = 0; i < allocated; i++) {
+        if (load_tableBlock(fs, i))
+            return -1;
+    }
+    while (fs->numTableBlocks < numBlocks) {
+        int prev = fs->numTableBlocks ? (int)fs->tableBlocks[fs->numTableBlocks - 1] : FAT_EOC;
+        int block = allocate_dataBlock(fs, prev);
+        if (block == FAT_EOC)
+            return -1;
+        if (prev == FAT_EOC) {
+            fs->superblock.dirTable = block;
+            fs->superDirty = 1;
+        }
+        fs->tableBlocks[fs->numTableBlocks++] = block;
+    }
+
+    if (numBlocks > allocated) {
+        uint32_t *table;
+        if (posix_memalign((void**)&table, BLOCK_SIZE, (size_t)numBlocks*BLOCK_SIZE))
+            return -1;
+        memcpy(table, fs->dirTable, size);
+        free(fs->dirTable);
+        fs->dirTable = table;
+    }
+
+    // Both halves point to the same buckets until they split
+    memcpy((void*)fs->dirTable + size, fs->dirTable, size);
+    for (int i = size / BLOCK_SIZE; i < numBlocks; i++)
+        fs->tableLoaded[i] = fs->tableDirty[i] = 1;
+    fs->superblock.dirDepth = ++fs->dirDepth;
+    fs->superDirty = 1;
+    return 0;
+}
+
+// Number of low hash bits shared by the filenames of the bucket at data block @bucket (0 for the root block), which
+// appears 2^(dirDepth - bits) times in the bucket table (fsLock held). -1 if the table cannot be read or is corrupt
+int bucket_depth(fs_t *fs, uint32_t bucket)
+{
+    int numBlocks = ((sizeof(uint32_t) << fs->dirDepth) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t count = 0;
+
+    for (int i = 0; i < numBlocks; i++) {
+        if (load_tableBlock(fs, i))
+            return -1;
+    }
+    for (uint32_t i = 0; i < 1u << fs->dirDepth; i++)
+        count += fs->dirTable[i] == bucket;
+    if (!count || (count & (count - 1)))
+        return -1;
+    return fs->dirDepth - __builtin_ctz(count);
+}
+
+// Split the full bucket of @blk, moving the filenames whose next hash bit is set to a new bucket at the head of the
+// chain of directory blocks. @hash is the hash of a filename of the bucket (fsLock and metaLock held)
+int split_bucket(fs_t *fs, struct dirBlock *blk, uint32_t hash)
+{
+    uint32_t bucket = blk->block == fs->rootBlock ? 0 : blk->block - fs->dataStart;
+    int depth = fs->dirGrowable ? bucket_depth(fs, bucket) : -1;
+    struct dirBlock *sibling;
+
+    if (depth < 0 || depth == DIR_MAX_DEPTH || (depth == fs->dirDepth && grow_dirTable(fs)))
+        return -1;
+
+    blk->pins++; // Not a candidate for the slot of the new bucket
+    sibling = evict_dirBlock(fs);
+    blk->pins--;
+    int block = sibling ? allocate_dataBlock(fs, FAT_EOC) : FAT_EOC;
+    if (block == FAT_EOC)
+        return -1;
+    pthread_mutex_lock(&fs->allocLock);
+    set_fatEntry(fs, block, fs->superblock.dirChain ? (int)fs->superblock.dirChain : FAT_EOC);
+    pthread_mutex_unlock(&fs->allocLock);
+    fs->numBuckets++;
+    fs->superblock.dirChain = block;
+    fs->superblock.dirBuckets = fs->numBuckets - 1;
+    fs->superDirty = 1;
+    if (fs->dirFree >= 0)
+        fs->dirFree += DIR_BLOCK_ENTRIES;
+    memset(sibling->entries, 0, BLOCK_SIZE);
+    memset(sibling->tags, 0, sizeof(sibling->tags));
+    place_dirBlock(fs, sibling, fs->dataStart + block);
+
+    // Writers update the entries of open files, which may move
+    pthread_mutex_lock(&fs->allocLock);
+    for (int i = 0, j = 0; i < DIR_BLOCK_ENTRIES; i++) {
+        if (!blk->tags[i] || !(hash_filename(blk->entries[i].filename) >> depth & 1))
+            continue;
+        struct openFile *file = find_openFile(fs, blk, i);
+        if (file) {
+            file->dirBlock = sibling;
+            file->dirSlot = j;
+            blk->pins--;
+            sibling->pins++;
+        }
+        sibling->entries[j] = blk->entries[i];
+        sibling->tags[j++] = blk->tags[i];
+        memset(&blk->entries[i], 0, sizeof(struct rootEntry));
+        blk->tags[i] = 0;
+    }
+    blk->dirty = sibling->dirty = 1;
+    pthread_mutex_unlock(&fs->allocLock);
+
+    // Half of the table entries of the bucket, those with the next bit set, now go to the new one
+    for (uint32_t i = (hash & ((1u << depth) - 1)) | 1u << depth; i < 1u << fs->dirDepth; i += 2u << depth) {
+        fs->dirTable[i] = block;
+        fs->tableDirty[i * sizeof(uint32_t) / BLOCK_SIZE] = 1;
+    }
+    return 0;
+}
+
+// Add an entry for @filename, of hash @hash, splitting its bucket while it is full (fsLock and metaLock held)
+int add_dirEntry(fs_t *fs, const char *filename, uint32_t hash)
+{
+    for (;;) {
+        int block = hash_bucket(fs, hash);
+        struct dirBlock *blk = block ? get_dirBlock(fs, block) : NULL;
+        if (!blk)
+            return -1;
+
+        uint8_t *empty = memchr(blk->tags, 0, DIR_BLOCK_ENTRIES);
+        if (empty) {
+            struct rootEntry *e = &blk->entries[empty - blk->tags];
+            pthread_mutex_lock(&fs->allocLock);
+            memset(e, 0, sizeof(struct rootEntry));
+            strcpy(e->filename, filename);
+            set_firstBlock(fs, e, FAT_EOC);
+            *empty = hash_tag(hash);
+            blk->dirty = 1;
+            pthread_mutex_unlock(&fs->allocLock);
+            if (fs->dirFree >= 0)
+                fs->dirFree--;
+            return 0;
+        }
+
+        if (split_bucket(fs, blk, hash))
+            return -1;
+    }
+}
+
+// log2 of the number of FAT blocks per group of the free space summary of a disk with @fatBlocks FAT blocks
+int summary_shift(size_t fatBlocks)
+{
+    int shift = 0;
+
+    while (((fatBlocks - 1) >> shift) + 1 > FAT_SUMMARY_GROUPS)
+        shift++;
+    return shift;
+}
+
+// Most metadata blocks a journal transaction can hold: the FAT and the root block on version 1 disks, and the FAT,
+// the superblock, the bucket table and the directory blocks kept in memory on version 2 disks
+size_t metadata_blocks(int version, size_t fatBlocks)
+{
+    return version == FS_VERSION_1 ? fatBlocks + 1 : fatBlocks + 1 + DIR_TABLE_MAX_BLOCKS + DIR_CACHE_BLOCKS;
+}
+
+// Size of the journal of a disk with @metaBlocks metadata blocks, @journalBlocks unless it is FS_JOURNAL_AUTO
+static size_t journal_size(size_t journalBlocks, size_t metaBlocks)
+{
+    size_t minBlocks = journal_min_blocks(metaBlocks);
+
+    if (journalBlocks != FS_JOURNAL_AUTO)
+        return journalBlocks;
+    return minBlocks > FS_JOURNAL_DEFAULT_BLOCKS ? minBlocks : FS_JOURNAL_DEFAULT_BLOCKS;
+}
+
+int fs_format_version(const char *diskname, size_t data_blocks, size_t journal_blocks, int version)
+{
+    struct superblock sb;
+    struct disk *disk;
+    void *block;
+    size_t fatBlocks, journalBlocks, numBlocks;
+    int fd, ret = 0;
+
+    if (data_blocks == 0 || (version && version != FS_VERSION_1 && version != FS_VERSION_2))
+        return -1;
+
+    // Superblock, FAT, root directory, journal, then data blocks. Version 1 is kept for the disks it can describe
+    if (version != FS_VERSION_2) {
+        fatBlocks = (data_blocks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        journalBlocks = journal_size(journal_blocks, metadata_blocks(FS_VERSION_1, fatBlocks));
+        numBlocks = 2 + fatBlocks + journalBlocks + data_blocks;
+        if (data_blocks < FAT16_EOC && journalBlocks <= 0xFFFF && numBlocks <= 0xFFFF)
+            version = FS_VERSION_1;
+        else if (version == FS_VERSION_1)
+            return -1;
+    }
+    if (version != FS_VERSION_1) {
+        version = FS_VERSION_2;
+        fatBlocks = (data_blocks * 4 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        journalBlocks = journal_size(journal_blocks, metadata_blocks(FS_VERSION_2, fatBlocks));
+        numBlocks = 2 + fatBlocks + journalBlocks + data_blocks;
+        if (numBlocks > INT_MAX)
+            return -1;
+    }
+    if (journalBlocks && journalBlocks < journal_min_blocks(fatBlocks + 1)) // Too small for a transaction of the whole FAT and root
+        return -1;
+
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.signature, "ECS150FS", 8);
+    if (version == FS_VERSION_1) {
+        sb.numFATBlocks = fatBlocks;
+        sb.root = 1 + fatBlocks;
+        sb.journal = journalBlocks ? sb.root + 1 : 0;
+        sb.numJournalBlocks = journalBlocks;
+        sb.data = sb.root + 1 + journalBlocks;
+        sb.numDataBlocks = data_blocks;
+        sb.numBlocks = numBlocks;
+    } else {
+        sb.version = FS_VERSION_2;
+        sb.numFATBlocks32 = fatBlocks;
+        sb.root32 = 1 + fatBlocks;
+        sb.journal32 = journalBlocks ? sb.root32 + 1 : 0;
+        sb.numJournalBlocks32 = journalBlocks;
+        sb.data32 = sb.root32 + 1 + journalBlocks;
+        sb.numDataBlocks32 = data_blocks;
+        sb.numBlocks32 = numBlocks;
+
+        // Everything but the reserved FAT entry is free, as if the disk had been unmounted cleanly
+        int shift = summary_shift(fatBlocks) + 10;
+        for (size_t i = 0; i < data_blocks; i += (size_t)1 << shift)
+            sb.fatSummary[i >> shift] = data_blocks - i < (size_t)1 << shift ? data_blocks - i : (size_t)1 << shift;
+        sb.fatSummary[0]--;
+        sb.fatFree = data_blocks - 1;
+        sb.dirFree = DIR_BLOCK_ENTRIES;
+        sb.clean = 1;
+    }
+
+    fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, (off_t)numBlocks * BLOCK_SIZE)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    block = calloc(1, BLOCK_SIZE);
+    if (!block || !(disk = block_disk_open(diskname))) {
+        free(block);
+        return -1;
+    }
+
+    // Blocks are already zeroed, except the superblock, the reserved FAT entry and the journal header
+    if (version == FS_VERSION_1)
+        ((uint16_t*)block)[0] = FAT16_EOC;
+    else
+        ((uint32_t*)block)[0] = FAT32_EOC;
+    if (block_write(disk, 0, &sb) || block_write(disk, 1, block)
+        || (journalBlocks && journal_format(disk, 2 + fatBlocks, journalBlocks)))
+        ret = -1;
+    if (block_disk_sync(disk) || block_disk_close(disk))
+        ret = -1;
+
+    free(block);
+    return ret;
+}
+
+int fs_format(const char *diskname, size_t data_blocks, size_t journal_blocks)
+{
+    return fs_format_version(diskname, data_blocks, journal_blocks, 0);
+}
+
+// Take the layout of the disk from either version of its superblock, and check that it holds together
+int decode_superblock(fs_t *fs)
+{
+    struct superblock *sb = &fs->superblock;
+
+    if (sb->version == 0) {
+        fs->version = FS_VERSION_1;
+        fs->numBlocks = sb->numBlocks;
+        fs->numFATBlocks = sb->numFATBlocks;
+        fs->rootBlock = sb->root;
+        fs->journalStart = sb->journal;
+        fs->numJournalBlocks = sb->numJournalBlocks;
+        fs->dataStart = sb->data;
+        fs->numDataBlocks = sb->numDataBlocks;
+        fs->fatShift = 11;
+    } else if (sb->version == FS_VERSION_2) {
+        if (sb->numBlocks32 > INT_MAX)
+            return -1;
+        fs->version = FS_VERSION_2;
+        fs->numBlocks = sb->numBlocks32;
+        fs->numFATBlocks = sb->numFATBlocks32;
+        fs->rootBlock = sb->root32;
+        fs->journalStart = sb->journal32;
+        fs->numJournalBlocks = sb->numJournalBlocks32;
+        fs->dataStart = sb->data32;
+        fs->numDataBlocks = sb->numDataBlocks32;
+        fs->fatShift = 10;
+    } else {
+        return -1;
+    }
+
+    // Every data block needs a FAT entry, and everything has to be on the disk
+    if (fs->rootBlock != 1 + fs->numFATBlocks || ((size_t)fs->numFATBlocks << fs->fatShift) < (size_t)fs->numDataBlocks
+        || fs->dataStart <= fs->rootBlock || (size_t)fs->dataStart + fs->numDataBlocks > (size_t)block_disk_count(fs->disk))
+        return -1;
+
+    return 0;
+}
+
+// Set up the root directory from the superblock, leaving the bucket table and the buckets to be read on first use
+// (at mount time)
+int load_directory(fs_t *fs)
+{
+    struct superblock *sb = &fs->superblock;
+    int depth = fs->version == FS_VERSION_1 ? 0 : sb->dirDepth;
+    int numBlocks = ((sizeof(uint32_t) << depth) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (depth > DIR_MAX_DEPTH || posix_memalign((void**)&fs->dirTable, BLOCK_SIZE, (size_t)numBlocks*BLOCK_SIZE)) {
+        fs->dirTable = NULL;
+        return -1;
+    }
+
+    // The buckets after the root block are only found through the table, or through their chain when listing them
+    fs->numBuckets = 1;
+    if (fs->version != FS_VERSION_1) {
+        if (sb->dirBuckets >= (uint32_t)fs->numDataBlocks || !sb->dirChain != !sb->dirBuckets
+            || sb->dirChain >= (uint32_t)fs->numDataBlocks || sb->dirTable >= (uint32_t)fs->numDataBlocks || !sb->dirTable != !depth)
+            return -1;
+        fs->numBuckets += sb->dirBuckets;
+    }
+
+    fs->dirDepth = depth;
+    if (depth == 0) {
+        fs->dirTable[0] = 0;
+        fs->tableLoaded[0] = 1;
+        fs->tableChained = 1;
+    } else {
+        fs->tableBlocks[0] = sb->dirTable;
+        fs->numTableBlocks = numBlocks;
+        fs->tableChained = numBlocks == 1;
+    }
+
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++)
+        fs->dirBlocks[i].block = -1;
+    fs->dirFree = -1;
+
+    // Splits dirty blocks that the journal must be able to hold at once
+    fs->dirGrowable = fs->version != FS_VERSION_1
+        && (!fs->numJournalBlocks || fs->numJournalBlocks >= journal_min_blocks(metadata_blocks(fs->version, fs->numFATBlocks)));
+    return 0;
+}
+
+// Free the memory of the root directory
+void free_directory(fs_t *fs)
+{
+    for (int i = 0; i < DIR_CACHE_BLOCKS; i++)
+        free(fs->dirBlocks[i].entries);
+    free(fs->dirTable);
+}
+
+// Take the free space from the superblock if the disk was unmounted cleanly, or count it in the whole FAT otherwise
+// (at mount time)
+int load_freeSpace(fs_t *fs)
+{
+    struct superblock *sb = &fs->superblock;
+
+    if (fs->version != FS_VERSION_1 && sb->clean && sb->fatFree < (uint32_t)fs->numDataBlocks) {
+        uint64_t total = 0;
+        for (int g = 0; g < fs->numGroups; g++)
+            total += fs->groupFree[g] = sb->fatSummary[g];
+        if (total == sb->fatFree) {
+            fs->fatFree = sb->fatFree;
+            if (sb->dirFree <= (uint64_t)fs->numBuckets * DIR_BLOCK_ENTRIES)
+                fs->dirFree = sb->dirFree;
+            return 0;
+        }
+        memset(fs->groupFree, 0, fs->numGroups * sizeof(uint32_t));
+    }
+
+    // Version 1 disks have no counts, and stay readable by implementations that would not keep them up to date
+    sb->clean = 0;
+    if (cache_read_range(fs->cache, 1, fs->numFATBlocks, fs->fat))
+        return -1;
+    memset(fs->fatLoaded, 1, fs->numFATBlocks);
+    memset(fs->groupIndexed, 1, fs->numGroups);
+    for (int b = 0; b < fs->numFATBlocks; b++) {
+        int count = index_fatBlock(fs, b);
+        fs->fatFree += count;
+        fs->groupFree[b >> fs->summaryShift] += count;
+    }
+    return 0;
+}
+
+// Record the free space in the superblock for the next mount, once everything else is on the disk (at unmount time)
+int mark_clean(fs_t *fs)
+{
+    struct superblock *sb = &fs->superblock;
+
+    sb->clean = 1;
+    sb->fatFree = fs->fatFree;
+    sb->dirFree = fs->dirFree >= 0 ? (uint32_t)fs->dirFree : UINT32_MAX;
+    memset(sb->fatSummary, 0, sizeof(sb->fatSummary));
+    memcpy(sb->fatSummary, fs->groupFree, fs->numGroups * sizeof(uint32_t));
+
+    // Checkpointing the journal already wrote everything back
+    if (!fs->journal && (cache_flush(fs->cache) || block_disk_sync(fs->disk)))
+        return -1;
+    return cache_write(fs->cache, 0, (void*)sb);
+}
+
+// Record the calls on @fs and its transfers in the trace file of the next mounts, if any
+static void start_trace(fs_t *fs)
+{
+    const char *path = tracePath ? tracePath : getenv("FS_TRACE");
+    char name[PATH_MAX];
+
+    if (!path || !*path)
+        return;
+
+    // Images mounted after the first one get numbered trace files
+    int n = __atomic_fetch_add(&tracedMounts, 1, __ATOMIC_RELAXED);
+    if (n)
+        snprintf(name, sizeof(name), "%s.%d", path, n);
+    else
+        snprintf(name, sizeof(name), "%s", path);
+
+    struct trace_header header = {
+        .data_blocks = fs->numDataBlocks,
+        .journal_blocks = fs->numJournalBlocks,
+        .version = fs->version,
+        .cache_blocks = cacheBlocks,
+        .cache_policy = cachePolicy == CACHE_POLICY_LRU ? FS_CACHE_LRU : FS_CACHE_CLOCK,
+        .direct = block_disk_direct(fs->disk),
+    };
+    struct rootEntry entries[DIR_BLOCK_ENTRIES];
+    if (!(fs->trace = trace_open(name, &header)))
+        return;
+
+    // A replay has to start from the same files
+    for (int b = fs->rootBlock, n = 0; b && n < fs->numBuckets; b = next_bucket(fs, b), n++) {
+        if (read_bucket(fs, b, entries))
+            continue;
+        for (int i = 0; i < DIR_BLOCK_ENTRIES; i++) {
+            if (entries[i].filename[0])
+                trace_file(fs->trace, entries[i].filename, entries[i].size);
+        }
+    }
+    block_disk_trace(fs->disk, fs->trace);
+}
+
+// Select the backend of the next disk opened: the one of fs_backend_config(), or the one named by $FS_BACKEND
+static int select_backend(void)
+{
+    static const char *const names[] = { "fd", "mmap", "io_uring", "threads" };
+    static const enum block_backend backends[] = { BLOCK_BACKEND_FD, BLOCK_BACKEND_MMAP, BLOCK_BACKEND_URING,
+                                                   BLOCK_BACKEND_THREADS };
+    const char *name = getenv("FS_BACKEND");
+    int backend = diskBackend;
+
+    if (backend == FS_BACKEND_DEFAULT) {
+        backend = FS_BACKEND_FD;
+        if (name && *name) {
+            for (backend = 0; backend < 4 && strcmp(name, names[backend]); backend++)
+                ;
+            if (backend == 4)
+                return -1;
+        }
+    }
+
+    if (block_disk_set_queue_depth(queueDepth))
+        return -1;
+    return block_disk_set_backend(backends[backend]);
+}
+
+fs_t *fs_mount_ex(const char *diskname)
+{
+    fs_t *fs = calloc(1, sizeof(fs_t));
+    int replayed = 0;
+    if (!fs)
+        return NULL;
+
+    // Open the disk
+    if (select_backend() || !(fs->disk = block_disk_open(diskname))) {
+        free(fs);
+        return NULL;
+    }
+
+    if (!(fs->cache = cache_create(fs->disk, cacheBlocks, cachePolicy))) {
+        block_disk_close(fs->disk);
+        free(fs);
+        return NULL;
+    }
+
+    // Read the superblock
+    if (cache_read(fs->cache, 0, (void*)&fs->superblock) || memcmp(fs->superblock.signature, "ECS150FS", 8) // Check signature of file system
+        || decode_superblock(fs)) {
+        cache_destroy(fs->cache);
+        block_disk_close(fs->disk);
+        free(fs);
+        return NULL;
+    }
+
+    // Bring the metadata up to date with the journal, if the disk has one
+    if (fs->numJournalBlocks) {
+        if (fs->journalStart <= fs->rootBlock || fs->journalStart + fs->numJournalBlocks > fs->dataStart
+            || fs->numJournalBlocks < journal_min_blocks(fs->numFATBlocks + 1)
+            || !(fs->journal = journal_open(fs->disk, fs->cache, fs->journalStart, fs->numJournalBlocks))
+            || ((replayed = journal_replay(fs->journal)) > 0 && cache_read(fs->cache, 0, (void*)&fs->superblock)) || replayed < 0) {
+            journal_close(fs->journal);
+            cache_destroy(fs->cache);
+            block_disk_close(fs->disk);
+            free(fs);
+            return NULL;
+        }
+    }
+
+    // The FAT is read in whole blocks, so size it by blocks rather than entries. It is aligned so that
+    // journal commits can hand it to an O_DIRECT disk as is
+    if (posix_memalign(&fs->fat, BLOCK_SIZE, (size_t)fs->numFATBlocks*BLOCK_SIZE))
+        fs->fat = NULL;
+    fs->fatDirty = calloc(fs->numFATBlocks, 1);
+    fs->fatLoaded = calloc(fs->numFATBlocks, 1);
+    fs->summaryShift = summary_shift(fs->numFATBlocks);
+    fs->numGroups = ((fs->numFATBlocks - 1) >> fs->summaryShift) + 1;
+    fs->groupFree = calloc(fs->numGroups, sizeof(uint32_t));
+    fs->groupIndexed = calloc(fs->numGroups, 1);
+    fs->commitBlocks = malloc(metadata_blocks(fs->version, fs->numFATBlocks) * sizeof(size_t));
+    fs->commitData = malloc(metadata_blocks(fs->version, fs->numFATBlocks) * sizeof(void*));
+    fs->freeMap = freemap_create(fs->numDataBlocks);
+    if (!fs->fat || !fs->fatDirty || !fs->fatLoaded || !fs->groupFree || !fs->groupIndexed || !fs->commitBlocks
+        || !fs->commitData || !fs->freeMap || load_directory(fs) || load_freeSpace(fs)) {
+        free_directory(fs);
+        free(fs->fat);
+        free(fs->fatDirty);
+        free(fs->fatLoaded);
+        free(fs->groupFree);
+        free(fs->groupIndexed);
+        free(fs->commitBlocks);
+        free(fs->commitData);
+        freemap_destroy(fs->freeMap);
+        journal_close(fs->journal);
+        cache_destroy(fs->cache);
+        block_disk_close(fs->disk);
+        free(fs);
+        return NULL;
+    }
+    fs->discardMode = discardMode;
+
+    // Initialize file descriptors, open files and their locks
+    for (int k = 0; k < FS_OPEN_MAX_COUNT; k++) {
+        fs->fileDescriptors[k].fd = -1;
+        fs->fileDescriptors[k].offset = -1;
+        pthread_mutex_init(&fs->fileDescriptors[k].lock, NULL);
+    }
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        pthread_rwlock_init(&fs->openFiles[i].lock, NULL);
+        pthread_mutex_init(&fs->openFiles[i].map.lock, NULL);
+    }
+    pthread_mutex_init(&fs->fsLock, NULL);
+    pthread_mutex_init(&fs->allocLock, NULL);
+    pthread_mutex_init(&fs->fatLock, NULL);
+
+    // Commits would starve behind a steady stream of operations otherwise
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs->metaLock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    start_trace(fs);
+    return fs;
+}
+
+int fs_mount(const char *diskname)
+{
+    if (defaultFs)
+        return -1;
+
+    defaultFs = fs_mount_ex(diskname);
+    return defaultFs ? 0 : -1;
+}
+
+int fs_umount_ex(fs_t *fs)
+{
+    int ret = 0;
+
+    if (!fs)
+        return -1;
+
+    sync_appendBuffers(fs);
+    int written = !commit_metadata(fs);
+
+    // Leave an empty journal behind, so that the next mount has nothing to replay
+    if (fs->journal) {
+        written = !journal_checkpoint(fs->journal) && written;
+        journal_close(fs->journal);
+    }
+
+    // Version 2 disks that changed can be mounted without reading their FAT next time
+    if (written && fs->version != FS_VERSION_1 && !fs->superblock.clean && mark_clean(fs))
+        ret = -1;
+
+    // Free allocated memory and locks
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        reset_blockMap(&fs->openFiles[i]);
+        free(fs->openFiles[i].appendBuffer);
+        pthread_rwlock_destroy(&fs->openFiles[i].lock);
+        pthread_mutex_destroy(&fs->openFiles[i].map.lock);
+    }
+    for (int k = 0; k < FS_OPEN_MAX_COUNT; k++)
+        pthread_mutex_destroy(&fs->fileDescriptors[k].lock);
+    pthread_rwlock_destroy(&fs->metaLock);
+    pthread_mutex_destroy(&fs->allocLock);
+    pthread_mutex_destroy(&fs->fatLock);
+    pthread_mutex_destroy(&fs->fsLock);
+
+    free_directory(fs);
+    free(fs->fat);
+    free(fs->fatDirty);
+    free(fs->fatLoaded);
+    free(fs->groupFree);
+    free(fs->groupIndexed);
+    free(fs->commitBlocks);
+    free(fs->commitData);
+    freemap_destroy(fs->freeMap);
+    free(fs->freedRuns);
+
+    // Write back everything that is still cached, then close the disk
+    if (cache_destroy(fs->cache) || block_disk_sync(fs->disk))
+        ret = -1;
+    if (fs->trace) {
+        block_disk_trace(fs->disk, NULL);
+        trace_close(fs->trace);
+    }
+    if (block_disk_close(fs->disk))
+        ret = -1;
+
+    free(fs);
+	return ret;
+}
+
+int fs_umount(void)
+{
+    int ret = fs_umount_ex(defaultFs);
+
+    defaultFs = NULL;
+    return ret;
+}
+
+static int do_sync(fs_t *fs)
+{
+    if (!fs)
+        return -1;
+
+    if (sync_appendBuffers(fs) || commit_metadata(fs) || cache_flush(fs->cache) || block_disk_sync(fs->disk))
+        return -1;
+
+    return 0;
+}
+
+int fs_cache_config(size_t blocks, int policy)
+{
+    if (defaultFs || (policy != FS_CACHE_LRU && policy != FS_CACHE_CLOCK))
+        return -1;
+
+    cacheBlocks = blocks;
+    cachePolicy = policy == FS_CACHE_LRU ? CACHE_POLICY_LRU : CACHE_POLICY_CLOCK;
+    return 0;
+}
+
+int fs_discard_config_ex(fs_t *fs, int mode)
+{
+    if (!fs || (mode != FS_DISCARD_NONE && mode != FS_DISCARD_ZERO && mode != FS_DISCARD_PUNCH))
+        return -1;
+
+    // Blocks already queued are released the new way too
+    pthread_mutex_lock(&fs->allocLock);
+    fs->discardMode = mode;
+    pthread_mutex_unlock(&fs->allocLock);
+    return 0;
+}
+
+int fs_discard_config(int mode)
+{
+    if (mode != FS_DISCARD_NONE && mode != FS_DISCARD_ZERO && mode != FS_DISCARD_PUNCH)
+        return -1;
+
+    discardMode = mode;
+    return defaultFs ? fs_discard_config_ex(defaultFs, mode) : 0;
+}
+
+int fs_direct_config(int enable)
+{
+    return block_disk_set_direct(enable);
+}
+
+int fs_backend_config(int backend, unsigned queue_depth)
+{
+    if (backend < FS_BACKEND_DEFAULT || backend > FS_BACKEND_THREADS)
+        return -1;
+
+    diskBackend = backend;
+    queueDepth = queue_depth ? queue_depth : BLOCK_QUEUE_DEPTH;
+    return 0;
+}
+
+int fs_trace_config(const char *path)
+{
+    char *copy = NULL;
+
+    if (path && !(copy = strdup(path)))
+        return -1;
+
+    free(tracePath);
+    tracePath = copy;
+    return 0;
+}
+
+int fs_cache_stats_ex(fs_t *fs, struct fs_cache_stats *stats)
+{
+    struct cache_stats cstats;
+
+    if (!fs || !stats)
+        return -1;
+
+    cache_get_stats(fs->cache, &cstats);
+    stats->capacity = cache_capacity(fs->cache);
+    stats->hits = cstats.hits;
+    stats->misses = cstats.misses;
+    stats->evictions = cstats.evictions;
+    stats->writebacks = cstats.writebacks;
+    stats->readahead = cstats.readahead;
+    return 0;
+}
+
+const char *fs_op_name(int op)
+{
+    static const char *const names[FS_OP_COUNT] = {
+        [FS_OP_CREATE] = "fs_create",
+        [FS_OP_DELETE] = "fs_delete",
+        [FS_OP_OPEN] = "fs_open",
+        [FS_OP_CLOSE] = "fs_close",
+        [FS_OP_STAT] = "fs_stat",
+        [FS_OP_LSEEK] = "fs_lseek",
+        [FS_OP_READ] = "fs_read",
+        [FS_OP_WRITE] = "fs_write",
+        [FS_OP_PREAD] = "fs_pread",
+        [FS_OP_PWRITE] = "fs_pwrite",
+        [FS_OP_FALLOCATE] = "fs_fallocate",
+        [FS_OP_SYNC] = "fs_sync",
+    };
+
+    return op >= 0 && op < FS_OP_COUNT ? names[op] : NULL;
+}
+
+int fs_stats_ex(fs_t *fs, struct fs_stats *stats)
+{
+    struct block_stats bstats;
+
+    if (!fs || !stats)
+        return -1;
+
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        struct fs_op_stats *src = &fs->opStats[op], *dst = &stats->ops[op];
+        dst->calls = __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+        dst->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+        dst->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+        for (int b = 0; b < FS_STATS_BUCKETS; b++)
+            dst->histogram[b] = __atomic_load_n(&src->histogram[b], __ATOMIC_RELAXED);
+    }
+
+    block_disk_stats(fs->disk, &bstats);
+    stats->disk_reads = bstats.reads;
+    stats->disk_writes = bstats.writes;
+    stats->disk_read_bytes = bstats.read_bytes;
+    stats->disk_write_bytes = bstats.write_bytes;
+
+    pthread_mutex_lock(&fs->allocLock);
+    stats->allocations = fs->allocations;
+    stats->alloc_scanned = fs->allocScanned;
+    stats->alloc_max_scan = fs->allocMaxScan;
+    pthread_mutex_unlock(&fs->allocLock);
+
+    return fs_cache_stats_ex(fs, &stats->cache);
+}
+
+// Latency under which @percent % of the calls counted in @stats completed, rounded up to a power of two (in us)
+static double latency_percentile(const struct fs_op_stats *stats, int percent)
+{
+    uint64_t seen = 0, bound = stats->max_ns;
+
+    for (int b = 0; b < FS_STATS_BUCKETS - 1; b++) {
+        seen += stats->histogram[b];
+        if (seen * 100 >= stats->calls * percent) {
+            bound = (uint64_t)2 << b;
+            break;
+        }
+    }
+    return (double)(bound < stats->max_ns ? bound : stats->max_ns) / 1000;
+}
+
+int fs_print_stats_ex(fs_t *fs)
+{
+    struct fs_stats stats;
+
+    if (fs_stats_ex(fs, &stats))
+        return -1;
+
+    printf("FS Stats:\n");
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        struct fs_op_stats *o = &stats.ops[op];
+        if (!o->calls)
+            continue;
+        printf("%s: calls=%llu avg_us=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n", fs_op_name(op),
+               (unsigned long long)o->calls, (double)o->total_ns / o->calls / 1000,
+               latency_percentile(o, 50), latency_percentile(o, 99), (double)o->max_ns / 1000);
+    }
+    printf("disk_reads=%llu\n", (unsigned long long)stats.disk_reads);
+    printf("disk_read_bytes=%llu\n", (unsigned long long)stats.disk_read_bytes);
+    printf("disk_writes=%llu\n", (unsigned long long)stats.disk_writes);
+    printf("disk_write_bytes=%llu\n", (unsigned long long)stats.disk_write_bytes);
+    printf("alloc_searches=%llu\n", (unsigned long long)stats.allocations);
+    printf("alloc_avg_scan=%.1f\n", stats.allocations ? (double)stats.alloc_scanned / stats.allocations : 0);
+    printf("alloc_max_scan=%llu\n", (unsigned long long)stats.alloc_max_scan);
+    printf("cache_blk_count=%zu\n", stats.cache.capacity);
+    printf("cache_hit_ratio=%llu/%llu\n", (unsigned long long)stats.cache.hits,
+           (unsigned long long)(stats.cache.hits + stats.cache.misses));
+    printf("cache_evictions=%llu\n", (unsigned long long)stats.cache.evictions);
+    printf("cache_writebacks=%llu\n", (unsigned long long)stats.cache.writebacks);
+    printf("cache_readahead=%llu\n", (unsigned long long)stats.cache.readahead);
+    return 0;
+}
+
+int fs_info_ex(fs_t *fs)
+{
+    if (!fs)
+        return -1;
+
+    // Empty entries are counted block by block, without keeping the directory in memory, unless a clean unmount
+    // recorded them
+    struct rootEntry entries[DIR_BLOCK_ENTRIES];
+    pthread_mutex_lock(&fs->fsLock);
+    int dirFree = fs->dirFree, n = 0, complete = 1;
+    if (dirFree < 0) {
+        dirFree = 0;
+        for (int b = fs->rootBlock; b && n < fs->numBuckets; b = next_bucket(fs, b), n++) {
+            if (read_bucket(fs, b, entries)) {
+                complete = 0;
+                continue;
+            }
+            for (int i = 0; i < DIR_BLOCK_ENTRIES; i++)
+                dirFree += entries[i].filename[0] == 0;
+        }
+        if (complete && n == fs->numBuckets)
+            fs->dirFree = dirFree;
+    }
+
+    pthread_mutex_lock(&fs->allocLock);
+    printf("FS Info:\n");
+    printf("total_blk_count=%d\n", fs->numBlocks);
+    printf("fat_blk_count=%d\n", fs->numFATBlocks);
+    printf("rdir_blk=%d\n", fs->rootBlock);
+    printf("data_blk=%d\n", fs->dataStart);
+    printf("data_blk_count=%d\n", fs->numDataBlocks);
+    printf("fat_free_ratio=%d/%d\n", fs->fatFree, fs->numDataBlocks);
+    printf("rdir_free_ratio=%d/%d\n", dirFree, fs->numBuckets * DIR_BLOCK_ENTRIES);
+    if (fs->version != FS_VERSION_1)
+        printf("format_version=%d\n", fs->version);
+    if (fs->journal) {
+        printf("journal_blk=%d\n", fs->journalStart);
+        printf("journal_blk_count=%d\n", fs->numJournalBlocks);
+    }
+    pthread_mutex_unlock(&fs->allocLock);
+    pthread_mutex_unlock(&fs->fsLock);
+	return 0;
+}
+
+static int do_create(fs_t *fs, const char *filename)
+{
+    struct dirBlock *blk;
+    uint32_t hash;
+    int slot, ret;
+
+    // Don't create if @filename is invalid
+    if (!fs || filename[0] == 0 || strlen(filename) >= FS_FILENAME_LEN || filename[strlen(filename)] != '\0')
+        return -1;
+
+    // Don't create if a file with the same name already exists on the FS
+    hash = hash_filename(filename);
+    pthread_mutex_lock(&fs->fsLock);
+    if (reserve_dirBlocks(fs) || !(blk = find_dirEntry(fs, filename, hash, &slot)) || slot >= 0) {
+        pthread_mutex_unlock(&fs->fsLock);
+        return -1;
+    }
+
+    // Create empty file in an empty entry of its bucket, which splits if it is full
+    pthread_rwlock_rdlock(&fs->metaLock);
+    ret = add_dirEntry(fs, filename, hash);
+    pthread_rwlock_unlock(&fs->metaLock);
+    pthread_mutex_unlock(&fs->fsLock);
+
+    end_operation(fs);
+	return ret;
+}
+
+static int do_delete(fs_t *fs, const char *filename)
+{
+    struct dirBlock *blk;
+    int slot;
+
+    // Check if @filename is valid
+    if (!fs || strlen(filename) > FS_FILENAME_LEN || filename[strlen(filename)] != '\0')
+        return -1;
+
+    // Don't delete the file if it does not exist or is open
+    pthread_mutex_lock(&fs->fsLock);
+    if (reserve_dirBlocks(fs) || !(blk = find_dirEntry(fs, filename, hash_filename(filename), &slot)) || slot < 0
+        || find_openFile(fs, blk, slot)) {
+        pthread_mutex_unlock(&fs->fsLock);
+        return -1;
+    }
+
+    // Reset the associated fat entries and root entry, leaving the data blocks to discard_freedBlocks()
+    pthread_rwlock_rdlock(&fs->metaLock);
+    pthread_mutex_lock(&fs->allocLock);
+    struct rootEntry *e = &blk->entries[slot];
+    int clearIndex = get_firstBlock(fs, e);
+    while(clearIndex != FAT_EOC) {
+        // The contiguous parts of the chain are freed at once
+        int count = 1 + chain_run(fs, clearIndex, INT_MAX);
+        int next = get_fatEntry(fs, clearIndex + count - 1);
+        free_dataBlocks(fs, clearIndex, count);
+        clearIndex = next;
+    }
+    e->filename[0] = 0;
+    e->size = 0;
+    set_firstBlock(fs, e, FAT_EOC);
+    blk->tags[slot] = 0;
+    blk->dirty = 1;
+    pthread_mutex_unlock(&fs->allocLock);
+    if (fs->dirFree >= 0)
+        fs->dirFree++;
+    pthread_rwlock_unlock(&fs->metaLock);
+    pthread_mutex_unlock(&fs->fsLock);
+
+    end_operation(fs);
+	return 0;
+}
+
+int fs_ls_ex(fs_t *fs)
+{
+    struct rootEntry entries[DIR_BLOCK_ENTRIES];
+
+    if(!fs)
+        return -1;
+
+    // One directory block at a time, so that large directories are not brought into memory
+    pthread_mutex_lock(&fs->fsLock);
+    printf("FS Ls:\n");
+    for (int b = fs->rootBlock, n = 0; b && n < fs->numBuckets; b = next_bucket(fs, b), n++) {
+        if (read_bucket(fs, b, entries))
+            continue;
+        for(int i = 0; i < DIR_BLOCK_ENTRIES; i++) {
+            if(entries[i].filename[0] != 0) {
+                int first = get_firstBlock(fs, &entries[i]);
+                printf("file: %s, size: %d, data_blk: %u\n", entries[i].filename, entries[i].size,
+                       first != FAT_EOC ? (uint32_t)first : fs->version == FS_VERSION_1 ? FAT16_EOC : FAT32_EOC);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->fsLock);
+	return 0;
+}
+
+static int do_open(fs_t *fs, const char *filename)
+{
+    struct dirBlock *blk = NULL;
+    int slot, fd = -1;
+
+    // Don't open if @filename is invalid
+    if (!fs || strlen(filename) > FS_FILENAME_LEN || filename[strlen(filename)] != '\0') 
+       return -1;
+ 
+    // Check if disk can open any more files and the file exists on the disk
+    pthread_mutex_lock(&fs->fsLock);
+    if (fs->numOpen == FS_OPEN_MAX_COUNT || reserve_dirBlocks(fs)
+        || !(blk = find_dirEntry(fs, filename, hash_filename(filename), &slot)) || slot < 0) {
+        pthread_mutex_unlock(&fs->fsLock);
+        return -1;
+    }
+
+    // Descriptors on the same file share its open-file object, which holds its directory block in memory
+    struct openFile *file = find_openFile(fs, blk, slot);
+    for (int i = 0; !file && i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->openFiles[i].refCount == 0) {
+            file = &fs->openFiles[i];
+            file->dirBlock = blk;
+            file->dirSlot = slot;
+            file->size = blk->entries[slot].size;
+            file->firstBlock = get_firstBlock(fs, &blk->entries[slot]);
+            file->cursor = CURSOR_NONE;
+            blk->pins++;
+        }
+    }
+
+    // Open the file and assign a file descriptor entry
+    for(int k = 0; k < FS_OPEN_MAX_COUNT; k++){
+        if (fs->fileDescriptors[k].fd == -1) {
+            file->refCount++;
+            fs->fileDescriptors[k].file = file;
+            fs->fileDescriptors[k].fd = k; // Given file descriptor is simply the index in fileDescriptors
+            fs->fileDescriptors[k].offset = 0;
+            fs->fileDescriptors[k].raNext = fs->fileDescriptors[k].raWindow = fs->fileDescriptors[k].raEnd = 0;
+            fs->numOpen++;
+            fd = k;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->fsLock);
+
+	return fd;
+}
+
+static int do_close(fs_t *fs, int fd)
+{
+    // Check if @fd is valid and file with @fd is open
+    if (!fs || fd  >= FS_OPEN_MAX_COUNT || fd < 0)
+        return -1;
+
+    // Buffered appends reach the blocks while the file is still open, since reopening starts from the root entry
+    if (fs->fileDescriptors[fd].fd == fd)
+        sync_appendBuffer(fs, fs->fileDescriptors[fd].file);
+
+    pthread_mutex_lock(&fs->fsLock);
+    if (fs->fileDescriptors[fd].fd != fd) {
+        pthread_mutex_unlock(&fs->fsLock);
+        return -1;
+    }
+
+    // The last descriptor on the file releases its directory block and block map
+    struct openFile *file = fs->fileDescriptors[fd].file;
+    if (--file->refCount == 0) {
+        file->dirBlock->pins--;
+        file->dirBlock = NULL;
+        reset_blockMap(file);
+    }
+
+    // Reset associated fileDescriptors entry
+    fs->fileDescriptors[fd].file = NULL;
+    fs->fileDescriptors[fd].fd = -1;
+    fs->fileDescriptors[fd].offset = -1;
+    fs->numOpen--;
+    pthread_mutex_unlock(&fs->fsLock);
+    return 0;
+}
+
+static int do_stat(fs_t *fs, int fd)
+{
+    int size;
+
+    // Check if @fd valid and file with @fd is open
+    if (!fs || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fileDescriptors[fd].fd != fd) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs->fileDescriptors[fd].file->lock);
+    size = fs->fileDescriptors[fd].file->size;
+    pthread_rwlock_unlock(&fs->fileDescriptors[fd].file->lock);
+    return size;
+}
+
+static int do_lseek(fs_t *fs, int fd, size_t offset)
+{
+    // Check if @fd and @offset valid and file with @fd is open
+    if (!fs || fd  >= FS_OPEN_MAX_COUNT || fd < 0 || offset < 0 || offset > do_stat(fs, fd) || fs->fileDescriptors[fd].fd != fd) {
+        return -1;
+    }
+
+    // Files never shrink, so @offset stays in bounds
+    pthread_mutex_lock(&fs->fileDescriptors[fd].lock);
+    fs->fileDescriptors[fd].offset = offset;
+    pthread_mutex_unlock(&fs->fileDescriptors[fd].lock);
+    return 0;
+}
+
+static int do_fallocate(fs_t *fs, int fd, size_t offset, size_t len)
+{
+    int lastBlock = FAT_EOC, first, ret = 0;
+    size_t numBlocks = 0, neededBlocks;
+    struct openFile *file;
+
+    if (!fs || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fileDescriptors[fd].fd != fd || len == 0
+        || len > FS_FILE_MAX_SIZE || offset > FS_FILE_MAX_SIZE - len) // Sizes and offsets are ints
+        return -1;
+
+    file = fs->fileDescriptors[fd].file;
+    pthread_rwlock_rdlock(&fs->metaLock);
+    pthread_rwlock_wrlock(&file->lock);
+
+    // Find the end of the file's chain
+    map_dataBlock(fs, file, INT_MAX, READ);
+    numBlocks = file->map.numBlocks;
+    if (numBlocks > 0)
+        lastBlock = file->map.blocks[numBlocks - 1];
+
+    neededBlocks = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (neededBlocks > numBlocks) {
+        // Link all the new blocks at once, or none if they don't fit
+        first = allocate_dataBlocks(fs, lastBlock, neededBlocks - numBlocks);
+        if (first == FAT_EOC) {
+            ret = -1;
+        } else if (file->firstBlock == FAT_EOC) {
+            set_fileFirstBlock(fs, file, first);
+        }
+    }
+
+    pthread_rwlock_unlock(&file->lock);
+    pthread_rwlock_unlock(&fs->metaLock);
+    if (neededBlocks > numBlocks && ret == 0)
+        end_operation(fs);
+
+    return ret;
+}
+
+// Write @count bytes of @buf at @offset in @file, which must not be past its end
+int write_file(fs_t *fs, struct openFile *file, void *buf, size_t count, size_t offset)
+{
+    int allocatedBefore = blocksAllocated, grew = 0, bytesWritten, tail;
+
+    pthread_rwlock_rdlock(&fs->metaLock);
+    pthread_rwlock_wrlock(&file->lock);
+    if (count > FS_FILE_MAX_SIZE - offset) // Stop where the size of the file would overflow an int
+        count = FS_FILE_MAX_SIZE - offset;
+    if (offset > file->size || count == 0) {
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_unlock(&fs->metaLock);
+        return offset > file->size ? -1 : 0;
+    }
+
+    // Appends that stay inside the last block of the file are gathered, and only written once they fill it (or when
+    // something else needs the file's blocks to be up to date), so that small records cost a copy rather than a write
+    tail = file->size % BLOCK_SIZE;
+    if (offset == file->size && tail != 0 && tail + count < BLOCK_SIZE
+        && (file->appendBuffer || (file->appendBuffer = alloc_bounceBuffer()))) {
+        memcpy(file->appendBuffer + file->appendLength, buf, count);
+        file->appendLength += count;
+        file->size += count;
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_unlock(&fs->metaLock);
+        return count;
+    }
+
+    if (flush_appendBuffer(fs, file, &grew))
+        bytesWritten = -1;
+    else
+        bytesWritten = write_blocks(fs, file, buf, count, offset, &grew);
+
+    pthread_rwlock_unlock(&file->lock);
+    pthread_rwlock_unlock(&fs->metaLock);
+    if (grew || blocksAllocated != allocatedBefore)
+        end_operation(fs);
+
+    return bytesWritten;
+}
+
+// Read up to @count bytes at @offset in @file into @buf
+int read_file(fs_t *fs, struct openFile *file, void *buf, size_t count, size_t offset)
+{
+    size_t bytesToRead = count, bytesRead = 0, headBytes;
+    int readBlock, blockOffset, lastBlock = FAT_EOC, failed = 0;
+    void* bounceBuffer = NULL;
+
+    pthread_rwlock_rdlock(&file->lock);
+    while (file->appendLength) { // Write pending appends first, so that the blocks hold them
+        pthread_rwlock_unlock(&file->lock);
+        sync_appendBuffer(fs, file);
+        pthread_rwlock_rdlock(&file->lock);
+    }
+    if (offset >= file->size || count == 0) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    readBlock = find_dataBlock(fs, file, offset, &bytesToRead, READ);
+    blockOffset = offset % BLOCK_SIZE;
+    if (blockOffset != 0 && !(bounceBuffer = alloc_bounceBuffer()))
+        readBlock = FAT_EOC;
+ 
+    if (readBlock != FAT_EOC && blockOffset != 0) { // Offset is in middle of a block
+        size_t blockBytes = BLOCK_SIZE - blockOffset; // Bytes to read from first block
+        if (bytesToRead < blockBytes)
+            blockBytes = bytesToRead;
+        if (cache_read(fs->cache, fs->dataStart + readBlock, bounceBuffer)) {
+            readBlock = FAT_EOC;
+        } else {
+            memcpy(buf, bounceBuffer + blockOffset, blockBytes);
+            bytesRead += blockBytes;
+            bytesToRead -= blockBytes;
+            lastBlock = readBlock;
+            if (bytesToRead > 0)
+                readBlock = next_dataBlock(fs, readBlock, READ);
+        }
+    }
+
+    // Read whole blocks, submitting every physically contiguous run before waiting on any
+    headBytes = bytesRead;
+    while (readBlock != FAT_EOC && bytesToRead >= BLOCK_SIZE) {
+        int next;
+        int run = find_run(fs, readBlock, bytesToRead / BLOCK_SIZE, bytesToRead % BLOCK_SIZE != 0, &next, READ);
+        if (cache_submit_read(fs->cache, fs->dataStart + readBlock, run, buf + bytesRead)) {
+            failed = 1;
+            break;
+        }
+        bytesRead += run * BLOCK_SIZE;
+        bytesToRead -= run * BLOCK_SIZE;
+        lastBlock = readBlock + run - 1;
+        readBlock = next;
+    }
+    if (cache_complete(fs->cache) || failed) { // Don't hand out blocks that may not have been read
+        bytesRead = headBytes;
+        readBlock = lastBlock = FAT_EOC;
+    }
+
+    // Read any remaining bytes
+    if (readBlock != FAT_EOC && bytesToRead > 0 && bytesToRead < BLOCK_SIZE
+        && (bounceBuffer || (bounceBuffer = alloc_bounceBuffer()))) {
+        if (!cache_read(fs->cache, fs->dataStart + readBlock, bounceBuffer)) {
+            memcpy(buf + bytesRead, bounceBuffer, bytesToRead);
+            bytesRead += bytesToRead;
+            bytesToRead = 0;
+            lastBlock = readBlock;
+        }
+    }   
+
+    if (bounceBuffer)
+        free(bounceBuffer);
+  
+    if (lastBlock != FAT_EOC)
+        update_cursor(file, offset + bytesRead, lastBlock);
+    pthread_rwlock_unlock(&file->lock);
+    return bytesRead;
+}
+
+static int do_write(fs_t *fs, int fd, void *buf, size_t count)
+{
+    int bytesWritten;
+
+    if (!fs || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fileDescriptors[fd].fd != fd) {
+            return -1;
+    }
+
+    pthread_mutex_lock(&fs->fileDescriptors[fd].lock);
+    bytesWritten = write_file(fs, fs->fileDescriptors[fd].file, buf, count, fs->fileDescriptors[fd].offset);
+    if (bytesWritten > 0)
+        fs->fileDescriptors[fd].offset += bytesWritten;
+    pthread_mutex_unlock(&fs->fileDescriptors[fd].lock);
+
+    return bytesWritten;
+}
+
+// Track whether the reads of @desc are sequential after one covering [@start, @end), and if so read the next blocks
+// of the file ahead into the cache, the window doubling with each sequential read
+void read_ahead(fs_t *fs, struct fileDescriptor *desc, size_t start, size_t end)
+{
+    struct openFile *file = desc->file;
+    int next = end / BLOCK_SIZE, first, last, runStart = FAT_EOC, runLength = 0;
+
+    if (start != desc->raNext) { // Random access, start over
+        desc->raNext = end;
+        desc->raWindow = desc->raEnd = 0;
+        return;
+    }
+    desc->raNext = end;
+    desc->raWindow = desc->raWindow ? desc->raWindow * 2 : READAHEAD_MIN_BLOCKS;
+    if (desc->raWindow > READAHEAD_MAX_BLOCKS)
+        desc->raWindow = READAHEAD_MAX_BLOCKS;
+
+    // Top the window up once half of it has been consumed, rather than a few blocks at every read
+    if (desc->raEnd - next >= desc->raWindow / 2 || !cache_capacity(fs->cache))
+        return;
+
+    pthread_rwlock_rdlock(&file->lock);
+    first = desc->raEnd > next ? desc->raEnd : next;
+    last = next + desc->raWindow;
+    if (file->size == 0 || last > (file->size - 1) / BLOCK_SIZE + 1)
+        last = file->size ? (file->size - 1) / BLOCK_SIZE + 1 : 0;
+
+    // Follow the FAT chain, prefetching each physically contiguous run at once
+    for (int index = first; index < last; index++) {
+        int block = map_dataBlock(fs, file, index, READ);
+        if (block == FAT_EOC) {
+            last = index;
+            break;
+        }
+        if (runLength && block == runStart + runLength) {
+            runLength++;
+            continue;
+        }
+        if (runLength)
+            cache_prefetch(fs->cache, fs->dataStart + runStart, runLength);
+        runStart = block;
+        runLength = 1;
+    }
+    if (runLength)
+        cache_prefetch(fs->cache, fs->dataStart + runStart, runLength);
+    pthread_rwlock_unlock(&file->lock);
+
+    if (last > desc->raEnd)
+        desc->raEnd = last;
+}
+
+static int do_read(fs_t *fs, int fd, void *buf, size_t count)
+{
+    int bytesRead;
+
+    if (!fs || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fileDescriptors[fd].fd != fd) {
+            return -1;
+    }
+
+    pthread_mutex_lock(&fs->fileDescriptors[fd].lock);
+    bytesRead = read_file(fs, fs->fileDescriptors[fd].file, buf, count, fs->fileDescriptors[fd].offset);
+    if (bytesRead > 0)
+        read_ahead(fs, &fs->fileDescriptors[fd], fs->fileDescriptors[fd].offset, fs->fileDescriptors[fd].offset + bytesRead);
+    fs->fileDescriptors[fd].offset += bytesRead;
+    pthread_mutex_unlock(&fs->fileDescriptors[fd].lock);
+
+    return bytesRead;
+}
+
+static int do_pwrite(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+    if (!fs || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fileDescriptors[fd].fd != fd) {
+            return -1;
+    }
+
+    return write_file(fs, fs->fileDescriptors[fd].file, buf, count, offset);
+}
+
+static int do_pread(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+    if (!fs || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fileDescriptors[fd].fd != fd) {
+            return -1;
+    }
+
+    return read_file(fs, fs->fileDescriptors[fd].file, buf, count, offset);
+}
+
+// Public entry points, timed for fs_stats() and logged in traces
+int fs_create_ex(fs_t *fs, const char *filename)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_create(fs, filename);
+
+    call_end(fs, FS_OP_CREATE, start, -1, 0, 0, filename, ret);
+    return ret;
+}
+
+int fs_delete_ex(fs_t *fs, const char *filename)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_delete(fs, filename);
+
+    call_end(fs, FS_OP_DELETE, start, -1, 0, 0, filename, ret);
+    return ret;
+}
+
+int fs_open_ex(fs_t *fs, const char *filename)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_open(fs, filename);
+
+    call_end(fs, FS_OP_OPEN, start, -1, 0, 0, filename, ret);
+    return ret;
+}
+
+int fs_close_ex(fs_t *fs, int fd)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_close(fs, fd);
+
+    call_end(fs, FS_OP_CLOSE, start, fd, 0, 0, NULL, ret);
+    return ret;
+}
+
+int fs_stat_ex(fs_t *fs, int fd)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_stat(fs, fd);
+
+    call_end(fs, FS_OP_STAT, start, fd, 0, 0, NULL, ret);
+    return ret;
+}
+
+int fs_lseek_ex(fs_t *fs, int fd, size_t offset)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_lseek(fs, fd, offset);
+
+    call_end(fs, FS_OP_LSEEK, start, fd, offset, 0, NULL, ret);
+    return ret;
+}
+
+int fs_fallocate_ex(fs_t *fs, int fd, size_t offset, size_t len)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_fallocate(fs, fd, offset, len);
+
+    call_end(fs, FS_OP_FALLOCATE, start, fd, offset, len, NULL, ret);
+    return ret;
+}
+
+int fs_write_ex(fs_t *fs, int fd, void *buf, size_t count)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_write(fs, fd, buf, count);
+
+    call_end(fs, FS_OP_WRITE, start, fd, 0, count, NULL, ret);
+    return ret;
+}
+
+int fs_read_ex(fs_t *fs, int fd, void *buf, size_t count)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_read(fs, fd, buf, count);
+
+    call_end(fs, FS_OP_READ, start, fd, 0, count, NULL, ret);
+    return ret;
+}
+
+int fs_pwrite_ex(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_pwrite(fs, fd, buf, count, offset);
+
+    call_end(fs, FS_OP_PWRITE, start, fd, offset, count, NULL, ret);
+    return ret;
+}
+
+int fs_pread_ex(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_pread(fs, fd, buf, count, offset);
+
+    call_end(fs, FS_OP_PREAD, start, fd, offset, count, NULL, ret);
+    return ret;
+}
+
+int fs_sync_ex(fs_t *fs)
+{
+    uint64_t start = call_start(fs);
+    int ret = do_sync(fs);
+
+    call_end(fs, FS_OP_SYNC, start, -1, 0, 0, NULL, ret);
+    return ret;
+}
+
+// Shared state of the threads of fs_import_ex()
+struct import {
+    fs_t *fs;
+    const char *const *paths;
+    size_t count;
+    size_t next; // Next file to claim
+    fs_import_cb callback;
+    void *arg;
+    struct fs_import_progress progress;
+    struct timespec start;
+    pthread_mutex_t lock; // Serializes the updates of @progress and the callbacks
+};
+
+// Time since the import started, in nanoseconds
+uint64_t import_elapsed(struct import *im)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - im->start.tv_sec) * 1000000000 + now.tv_nsec - im->start.tv_nsec;
+}
+
+// Copy host file @path, of @size bytes, into file @name (an existing file is left alone); 0 if all of it is copied
+int import_file(struct import *im, const char *path, const char *name, size_t size)
+{
+    fs_t *fs = im->fs;
+    struct stat st;
+    void *data = NULL;
+    size_t done = 0;
+    int hostFd, fd;
+
+    hostFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (hostFd < 0)
+        return -1;
+    if (fstat(hostFd, &st) || (size_t)st.st_size != size) { // Changed since it was listed
+        close(hostFd);
+        return -1;
+    }
+
+    // Have the host file read in while its copy is created and reserved, then while it is written
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, hostFd, 0);
+        if (data == MAP_FAILED) {
+            close(hostFd);
+            return -1;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        madvise(data, size, MADV_WILLNEED);
+    }
+
+    if (fs_create_ex(fs, name)) {
+        if (data)
+            munmap(data, size);
+        close(hostFd);
+        return -1;
+    }
+
+    // The whole file is reserved at once, so that it is contiguous and never left half copied for want of space
+    fd = fs_open_ex(fs, name);
+    if (fd >= 0 && (size == 0 || !fs_fallocate_ex(fs, fd, 0, size))) {
+        while (done < size) {
+            size_t n = size - done < IMPORT_CHUNK ? size - done : IMPORT_CHUNK;
+            if (fs_write_ex(fs, fd, data + done, n) != (int)n)
+                break;
+            done += n;
+            pthread_mutex_lock(&im->lock);
+            im->progress.bytes_done += n;
+            pthread_mutex_unlock(&im->lock);
+        }
+    }
+    if (fd >= 0)
+        fs_close_ex(fs, fd);
+    if (fd < 0 || done < size) { // Partial copies are not left behind
+        fs_delete_ex(fs, name);
+        pthread_mutex_lock(&im->lock);
+        im->progress.bytes_done -= done;
+        pthread_mutex_unlock(&im->lock);
+    }
+
+    if (data)
+        munmap(data, size);
+    close(hostFd);
+    return fd >= 0 && done == size ? 0 : -1;
+}
+
+// Body of the threads of fs_import_ex(): claim files until there are none left
+void *import_thread(void *arg)
+{
+    struct import *im = arg;
+    struct stat st;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&im->next, 1, __ATOMIC_RELAXED);
+        if (i >= im->count)
+            break;
+
+        const char *path = im->paths[i], *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        size_t size = 0;
+        int ret = -1;
+        if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+            size = st.st_size;
+            if (strlen(name) < FS_FILENAME_LEN && size <= FS_FILE_MAX_SIZE) // Larger files cannot be written
+                ret = import_file(im, path, name, size);
+        }
+
+        pthread_mutex_lock(&im->lock);
+        if (ret) {
+            im->progress.files_failed++;
+            im->progress.bytes_total -= size;
+        } else {
+            im->progress.files_done++;
+        }
+        im->progress.elapsed_ns = import_elapsed(im);
+        if (im->callback)
+            im->callback(&im->progress, im->arg);
+        pthread_mutex_unlock(&im->lock);
+    }
+    return NULL;
+}
+
+int fs_import_ex(fs_t *fs, const char *const *paths, size_t count, int threads, fs_import_cb callback, void *arg)
+{
+    struct import im = {
+        .fs = fs,
+        .paths = paths,
+        .count = count,
+        .callback = callback,
+        .arg = arg,
+        .progress.files_total = count,
+    };
+    pthread_t tids[FS_OPEN_MAX_COUNT];
+    struct stat st;
+    int started = 0, ret;
+
+    if (!fs || (count > 0 && !paths))
+        return -1;
+    if (threads <= 0)
+        threads = IMPORT_THREADS;
+    if (threads > FS_OPEN_MAX_COUNT) // Each thread has one file open at a time
+        threads = FS_OPEN_MAX_COUNT;
+    if ((size_t)threads > count)
+        threads = count ? count : 1;
+
+    // Sizes are known up front, for the progress reports
+    for (size_t i = 0; i < count; i++) {
+        if (!stat(paths[i], &st) && S_ISREG(st.st_mode))
+            im.progress.bytes_total += st.st_size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &im.start);
+    pthread_mutex_init(&im.lock, NULL);
+
+    // The metadata of every file goes into one journal transaction at the end, rather than one every few files
+    pthread_mutex_lock(&fs->allocLock);
+    fs->bulkImports++;
+    pthread_mutex_unlock(&fs->allocLock);
+
+    // The calling thread copies files too
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&tids[started], NULL, import_thread, &im))
+            break;
+        started++;
+    }
+    import_thread(&im);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_lock(&fs->allocLock);
+    fs->bulkImports--;
+    pthread_mutex_unlock(&fs->allocLock);
+    ret = commit_metadata(fs) ? -1 : (int)im.progress.files_done;
+
+    pthread_mutex_destroy(&im.lock);
+    return ret;
+}
+
+// The historical API works on the file system mounted by fs_mount()
+int fs_sync(void)
+{
+    return fs_sync_ex(defaultFs);
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats)
+{
+    return fs_cache_stats_ex(defaultFs, stats);
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+    return fs_stats_ex(defaultFs, stats);
+}
+
+int fs_print_stats(void)
+{
+    return fs_print_stats_ex(defaultFs);
+}
+
+int fs_info(void)
+{
+    return fs_info_ex(defaultFs);
+}
+
+int fs_create(const char *filename)
+{
+    return fs_create_ex(defaultFs, filename);
+}
+
+int fs_delete(const char *filename)
+{
+    return fs_delete_ex(defaultFs, filename);
+}
+
+int fs_ls(void)
+{
+    return fs_ls_ex(defaultFs);
+}
+
+int fs_open(const char *filename)
+{
+    return fs_open_ex(defaultFs, filename);
+}
+
+int fs_close(int fd)
+{
+    return fs_close_ex(defaultFs, fd);
+}
+
+int fs_stat(int fd)
+{
+    return fs_stat_ex(defaultFs, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+    return fs_lseek_ex(defaultFs, fd, offset);
+}
+
+int fs_fallocate(int fd, size_t offset, size_t len)
+{
+    return fs_fallocate_ex(defaultFs, fd, offset, len);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    return fs_write_ex(defaultFs, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    return fs_read_ex(defaultFs, fd, buf, count);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+    return fs_pwrite_ex(defaultFs, fd, buf, count, offset);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    return fs_pread_ex(defaultFs, fd, buf, count, offset);
+}
+
+int fs_import(const char *const *paths, size_t count, int threads, fs_import_cb callback, void *arg)
+{
+    return fs_import_ex(defaultFs, paths, count, threads, callback, arg);
+}
@@ -1,17 +1,181 @@
 #ifndef _FS_H
 #define _FS_H
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in the root directory of version 1 disks */
 #define FS_FILE_MAX_COUNT 128
 
+/** Largest file size (in bytes), as returned by fs_stat() */
+#define FS_FILE_MAX_SIZE INT_MAX
+
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Default size of the block cache (in blocks) */
+#define FS_CACHE_DEFAULT_BLOCKS 256
+
+/** Default size of the metadata journal created by fs_format() (in blocks) */
+#define FS_JOURNAL_DEFAULT_BLOCKS 64
+
+/** Journal size asking fs_format() for the default, grown to fit the FAT */
+#define FS_JOURNAL_AUTO ((size_t)-1)
+
+/** On-disk format versions */
+#define FS_VERSION_1	1	/* 16-bit FAT entries, up to 65535 blocks (256 MiB) */
+#define FS_VERSION_2	2	/* 32-bit FAT entries */
+
+/** Block cache replacement policies */
+#define FS_CACHE_LRU	0
+#define FS_CACHE_CLOCK	1
+
+/** What happens to the data blocks of deleted files */
+#define FS_DISCARD_NONE		0	/* Left as they are */
+#define FS_DISCARD_ZERO		1	/* Overwritten with zeroes (default) */
+#define FS_DISCARD_PUNCH	2	/* Punched out of the virtual disk file */
+
+/** Ways of accessing the virtual disk file */
+#define FS_BACKEND_DEFAULT	-1	/* Named by $FS_BACKEND, fd if unset */
+#define FS_BACKEND_FD		0	/* System calls on a file descriptor */
+#define FS_BACKEND_MMAP		1	/* Copies to and from a mapping of the file */
+#define FS_BACKEND_URING	2	/* Batches of requests kept in flight by io_uring */
+#define FS_BACKEND_THREADS	3	/* Batches of requests kept in flight by threads */
+
+/** Mounted file system, for the fs_*_ex() functions */
+typedef struct fs fs_t;
+
+/** Block cache activity counters */
+struct fs_cache_stats {
+	/* Number of blocks the cache can hold */
+	size_t capacity;
+	/* Block accesses served from memory */
+	uint64_t hits;
+	/* Block accesses that went to disk */
+	uint64_t misses;
+	/* Blocks dropped to make room for others */
+	uint64_t evictions;
+	/* Dirty blocks written back to disk */
+	uint64_t writebacks;
+	/* Blocks read ahead of sequential fs_read() calls */
+	uint64_t readahead;
+};
+
+/** Calls timed by fs_stats() */
+enum fs_op {
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_PREAD,
+	FS_OP_PWRITE,
+	FS_OP_FALLOCATE,
+	FS_OP_SYNC,
+	FS_OP_COUNT,
+};
+
+/** Latency buckets: bucket i counts calls that took [2^i, 2^(i+1)) ns */
+#define FS_STATS_BUCKETS 32
+
+/** Counters of one call of the API */
+struct fs_op_stats {
+	/* Number of calls */
+	uint64_t calls;
+	/* Total and longest time spent in the calls, in nanoseconds */
+	uint64_t total_ns;
+	uint64_t max_ns;
+	/* Distribution of the latencies (the last bucket takes the outliers) */
+	uint64_t histogram[FS_STATS_BUCKETS];
+};
+
+/** File system activity counters */
+struct fs_stats {
+	/* Calls of the API, indexed by enum fs_op */
+	struct fs_op_stats ops[FS_OP_COUNT];
+	/* Transfers issued to the virtual disk, and the bytes they moved */
+	uint64_t disk_reads;
+	uint64_t disk_writes;
+	uint64_t disk_read_bytes;
+	uint64_t disk_write_bytes;
+	/* Searches of the FAT for free blocks, and how far past the starting
+	 * point they had to look (in blocks) */
+	uint64_t allocations;
+	uint64_t alloc_scanned;
+	uint64_t alloc_max_scan;
+	/* Block cache */
+	struct fs_cache_stats cache;
+};
+
+/** Progress of fs_import() */
+struct fs_import_progress {
+	/* Host files given, and the bytes of those that are regular files */
+	size_t files_total;
+	uint64_t bytes_total;
+	/* Files copied so far, and bytes copied so far */
+	size_t files_done;
+	uint64_t bytes_done;
+	/* Files that could not be copied (their bytes no longer count in
+	 * @bytes_total) */
+	size_t files_failed;
+	/* Time since the import started, in nanoseconds */
+	uint64_t elapsed_ns;
+};
+
+/** Function called by fs_import() after each file */
+typedef void (*fs_import_cb)(const struct fs_import_progress *progress,
+			     void *arg);
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks
+ * @journal_blocks: Number of blocks of the metadata journal (0 for none, or
+ * %FS_JOURNAL_AUTO)
+ *
+ * Create virtual disk file @diskname, replacing any existing file, and write an
+ * empty file system in it. The journal sits between the root directory and the
+ * data blocks, and must be large enough to hold a copy of the whole FAT and
+ * root directory plus a header and a descriptor block per 1018 blocks.
+ * %FS_JOURNAL_AUTO picks %FS_JOURNAL_DEFAULT_BLOCKS, or that minimum if it is
+ * larger. The disk uses version 1 of the format if it fits in 65535 blocks,
+ * version 2 otherwise. A version 1 disk without a journal is laid out exactly
+ * like the ones created by the reference formatter.
+ *
+ * Return: -1 if the number of blocks is invalid or if the virtual disk file
+ * cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, size_t journal_blocks);
+
+/**
+ * fs_format_version - Create a file system with a given on-disk format
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks
+ * @journal_blocks: Number of blocks of the metadata journal (0 for none, or
+ * %FS_JOURNAL_AUTO)
+ * @version: %FS_VERSION_1, %FS_VERSION_2, or 0 to let fs_format() choose
+ *
+ * Same as fs_format(), with the version of the format chosen by the caller.
+ * Version 2 has 32-bit FAT entries and block numbers, for disks of up to 2^31
+ * blocks (8 TiB), at the cost of twice as many FAT blocks. Its root directory
+ * is a hash table that grows a block at a time, with no limit on the number of
+ * files but the disk space, as long as the journal is at least as large as
+ * %FS_JOURNAL_AUTO makes it (or there is no journal). With a smaller journal,
+ * it holds %FS_FILE_MAX_COUNT files. fs_mount() tells the versions apart.
+ *
+ * Return: -1 if the number of blocks is invalid or too large for @version, or
+ * if the virtual disk file cannot be created. 0 otherwise.
+ */
+int fs_format_version(const char *diskname, size_t data_blocks,
+		      size_t journal_blocks, int version);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,8 +184,31 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * If the file system has a metadata journal, the changes committed to it
+ * before the file system was last unmounted (or before a crash) are applied
+ * first. Metadata changes are then committed in batches: when a batch holds
+ * enough operations or has been open long enough, and at fs_sync() or
+ * fs_umount() time.
+ *
+ * Version 2 disks that were last unmounted cleanly are mounted without reading
+ * their FAT: the free space is taken from the superblock, and FAT blocks are
+ * read the first time a call needs them. Otherwise, the whole FAT is read and
+ * the free blocks are counted.
+ *
+ * Once the file system is mounted, the other functions can be called from
+ * several threads at the same time, except fs_umount(). Readers of different
+ * files never wait for each other, and neither do concurrent readers of the
+ * same file. Calls that use the offset of a file descriptor are serialized on
+ * that descriptor: threads should use their own descriptors, or fs_pread() and
+ * fs_pwrite().
+ *
+ * The file system becomes the one used by all the functions without an @fs
+ * parameter. Other file systems can be mounted at the same time with
+ * fs_mount_ex().
+ *
+ * Return: -1 if a file system is already mounted with fs_mount(), if virtual
+ * disk file @diskname cannot be opened, or if no valid file system can be
+ * located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
@@ -29,13 +216,167 @@ int fs_mount(const char *diskname);
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Version 2 disks whose metadata changed get their free space
+ * recorded in the superblock, for the next mount.
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
  * cannot be closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write back cached changes
+ *
+ * Write the FAT blocks and root directory changed since the last call, and
+ * every dirty cached block of the currently mounted file system, back to the
+ * virtual disk, then flush the virtual disk file.
+ *
+ * With a metadata journal, metadata changes are grouped in batches that are
+ * committed once they hold 64 operations or their oldest operation is 50 ms
+ * old (checked as each operation completes); fs_sync() commits the pending
+ * batch right away, however small. Without a journal, metadata changes are
+ * only written back by fs_sync() and fs_umount(), or when the cache evicts
+ * them.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if some blocks could
+ * not be written. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_cache_config - Configure the block cache
+ * @blocks: Number of blocks the cache can hold
+ * @policy: Replacement policy (%FS_CACHE_LRU or %FS_CACHE_CLOCK)
+ *
+ * Set the size and replacement policy of the block cache used by subsequent
+ * calls to fs_mount() and fs_mount_ex(). Each mounted file system has its own
+ * cache. A cache of 0 blocks makes every access go to the disk.
+ * By default, the cache holds %FS_CACHE_DEFAULT_BLOCKS blocks with LRU
+ * replacement.
+ *
+ * Return: -1 if a file system is currently mounted with fs_mount() or if
+ * @policy is invalid. 0 otherwise.
+ */
+int fs_cache_config(size_t blocks, int policy);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Counters to fill
+ *
+ * Counters are cumulative since the file system was mounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_stats - Get file system activity counters
+ * @stats: Counters to fill
+ *
+ * Counters are cumulative since the file system was mounted. The number and
+ * latency of the calls of the API, the transfers to the virtual disk and the
+ * free block searches are always counted, at the cost of a few atomic
+ * increments per call, unless libfs is built with %FS_NO_STATS defined (`make
+ * STATS=0`); they then stay at 0.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_print_stats - Display file system activity counters
+ *
+ * Display the counters of fs_stats() for the currently mounted file system,
+ * in the same format as fs_info(): calls of the API with their average and
+ * percentile latencies, then disk, allocation and cache counters.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_print_stats(void);
+
+/**
+ * fs_op_name - Get name of a call of the API
+ * @op: Call, as in enum fs_op
+ *
+ * Return: Name of the function (e.g. "fs_read"), or NULL if @op is invalid.
+ */
+const char *fs_op_name(int op);
+
+/**
+ * fs_discard_config - Choose how the blocks of deleted files are released
+ * @mode: %FS_DISCARD_NONE, %FS_DISCARD_ZERO or %FS_DISCARD_PUNCH
+ *
+ * fs_delete() only frees the blocks of the file in the FAT. The blocks are
+ * released later, in batches, once the deletion has reached the disk: at
+ * fs_sync() or fs_umount() time, or after a journal commit. They can be left
+ * untouched, overwritten with zeroes, or punched out of the virtual disk file
+ * so that they stop taking space on the host (falling back to zeroes if the
+ * host file system cannot punch holes). The mode applies to the file system
+ * mounted with fs_mount(), if any, and to the file systems mounted afterwards.
+ *
+ * Return: -1 if @mode is invalid. 0 otherwise.
+ */
+int fs_discard_config(int mode);
+
+/**
+ * fs_direct_config - Bypass the host page cache
+ * @enable: Non-zero to open virtual disk files with O_DIRECT
+ *
+ * Make subsequent calls to fs_mount() and fs_mount_ex() open the virtual disk
+ * file with O_DIRECT, for large sequential transfers that would only pollute
+ * the host page cache. The whole blocks spanned by fs_read() and fs_write()
+ * then go straight between the disk and the caller's buffer, without any copy,
+ * as long as that part of the buffer is aligned on 4096 bytes (it is staged
+ * through an aligned bounce buffer otherwise). Partial blocks at the head and
+ * tail of a transfer still go through the block cache. O_DIRECT is not used
+ * if the host file system does not support it. It is off by default.
+ *
+ * Return: 0.
+ */
+int fs_direct_config(int enable);
+
+/**
+ * fs_backend_config - Choose how the next virtual disks are accessed
+ * @backend: %FS_BACKEND_FD, %FS_BACKEND_MMAP, %FS_BACKEND_URING,
+ * %FS_BACKEND_THREADS, or %FS_BACKEND_DEFAULT to use the %FS_BACKEND
+ * environment variable instead
+ * @queue_depth: Maximum number of requests in flight with %FS_BACKEND_URING
+ * and %FS_BACKEND_THREADS, or 0 for the default of 32
+ *
+ * Make subsequent calls to fs_mount() and fs_mount_ex() access the virtual
+ * disk file with @backend. All backends behave the same; they only differ in
+ * speed. %FS_BACKEND_URING falls back to worker threads if the kernel does not
+ * allow io_uring. By default, the backend is named by the %FS_BACKEND
+ * environment variable at mount time ("fd", "mmap", "io_uring" or
+ * "threads"), and is fd if it is not set. Mounting fails if %FS_BACKEND names
+ * no backend.
+ *
+ * Return: -1 if @backend is invalid. 0 otherwise.
+ */
+int fs_backend_config(int backend, unsigned queue_depth);
+
+/**
+ * fs_trace_config - Record the activity of the next file systems mounted
+ * @path: Trace file to write, or NULL to use the %FS_TRACE environment
+ * variable instead
+ *
+ * Make subsequent calls to fs_mount() and fs_mount_ex() record every call of
+ * the API made on the new file system (with its arguments, return value, and
+ * start and end times) and every block read and written on its virtual disk,
+ * in a binary trace file that fs_replay.x can replay on a fresh image. The
+ * trace is complete once the file system is unmounted. When several file
+ * systems are traced in the same process, the second one records its trace in
+ * @path.1, the third one in @path.2, and so on. By default, the path is taken
+ * from the %FS_TRACE environment variable at mount time, and nothing is traced
+ * if it is not set. A trace file that cannot be created does not prevent the
+ * mount.
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int fs_trace_config(const char *path);
+
 /**
  * fs_info - Display information about file system
  *
@@ -55,8 +396,8 @@ int fs_info(void);
  * character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, or if the root directory is full
+ * (%FS_FILE_MAX_COUNT files on version 1 disks). 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -75,7 +416,9 @@ int fs_delete(const char *filename);
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files located in the root directory. Directory
+ * blocks are read one at a time, so large directories are listed without being
+ * brought into memory.
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
@@ -136,6 +479,25 @@ int fs_stat(int fd);
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @offset: Start of the byte range to reserve
+ * @len: Length of the byte range to reserve
+ *
+ * Make sure that the file referenced by file descriptor @fd has data blocks
+ * allocated for the bytes from @offset to @offset + @len - 1. Missing blocks
+ * are allocated at once, as contiguously as the free space allows, and linked
+ * at the end of the file. The file size is not changed: writes extending the
+ * file later on use the reserved blocks instead of allocating new ones.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @len is 0, if the range ends past %FS_FILE_MAX_SIZE bytes, or if
+ * the disk doesn't have enough free blocks (nothing is reserved then). 0
+ * otherwise.
+ */
+int fs_fallocate(int fd, size_t offset, size_t len);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -151,6 +513,12 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * Likewise, files never grow past %FS_FILE_MAX_SIZE bytes.
+ *
+ * Small appends that fit in the last block of the file are gathered in a
+ * buffer of the open file, and only written to the block once they fill it,
+ * or before the file is read, written elsewhere, closed or synced. The file
+ * size includes them right away.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -172,9 +540,131 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * While the reads of a file descriptor follow each other, the next blocks of
+ * the file are read ahead into the block cache, with a window that doubles at
+ * every read up to 64 blocks. A read anywhere else resets the window.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), except that the data is written at @offset and that the
+ * file offset of the file descriptor is neither used nor changed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is out of bounds (beyond the end of the file). Otherwise
+ * return the number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), except that the data is read from @offset and that the
+ * file offset of the file descriptor is neither used nor changed. Nothing is
+ * read if @offset is at or beyond the end of the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_import - Copy host files into the file system
+ * @paths: Paths of the host files
+ * @count: Number of paths
+ * @threads: Number of files copied at once (at most %FS_OPEN_MAX_COUNT), or 0
+ * for the default of 4
+ * @callback: Function called after each file, or NULL
+ * @arg: Argument passed to @callback
+ *
+ * Copy each host file into a new file of the mounted file system. The new file
+ * is named after the last component of the host path. Each thread (the
+ * calling one included) takes the next file in @paths and maps it into
+ * memory. The kernel reads the file in while its copy is created. The copy
+ * then gets all of its blocks at once with fs_fallocate(), and is written
+ * 1 MiB at a time. Files that are not regular, cannot be read, have a name
+ * that is too long, are larger than %FS_FILE_MAX_SIZE bytes, already exist on
+ * the file system or do not fit are skipped, and count as failed. Copies are
+ * never left incomplete. The metadata changes of the whole import (those of
+ * other threads meanwhile included) are committed to the journal once, at the
+ * end, instead of every few operations. They are committed earlier only if the
+ * cache of directory blocks fills up.
+ *
+ * @callback is called after each file, whether it was copied or not, and never
+ * by two threads at once.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the metadata
+ * cannot be committed. Otherwise return the number of files copied.
+ */
+int fs_import(const char *const *paths, size_t count, int threads,
+	      fs_import_cb callback, void *arg);
+
+/**
+ * fs_mount_ex - Mount one of several file systems
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as fs_mount(), except that the file system is returned instead of
+ * becoming the default one. Each file system has its own virtual disk, block
+ * cache, journal, open files and locks, so any number of them can be mounted
+ * in one process and used from any thread. Passing the result of this
+ * function to the fs_*_ex() functions below is the same as calling their
+ * counterparts on the default file system.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located, or if memory cannot be allocated. The file
+ * system otherwise.
+ */
+fs_t *fs_mount_ex(const char *diskname);
+
+/**
+ * fs_umount_ex - Unmount a file system
+ * @fs: File system returned by fs_mount_ex()
+ *
+ * Same as fs_umount(). @fs is released, even if an error is reported.
+ *
+ * Return: -1 if @fs is NULL, or if the virtual disk cannot be written back or
+ * closed. 0 otherwise.
+ */
+int fs_umount_ex(fs_t *fs);
+
+/*
+ * Each of the following functions behaves like the function of the same name
+ * without the _ex suffix, on file system @fs instead of the default one.
+ * They return -1 if @fs is NULL. File descriptors are only meaningful for
+ * the file system they were opened on.
+ */
+int fs_sync_ex(fs_t *fs);
+int fs_cache_stats_ex(fs_t *fs, struct fs_cache_stats *stats);
+int fs_stats_ex(fs_t *fs, struct fs_stats *stats);
+int fs_print_stats_ex(fs_t *fs);
+int fs_discard_config_ex(fs_t *fs, int mode);
+int fs_info_ex(fs_t *fs);
+int fs_create_ex(fs_t *fs, const char *filename);
+int fs_delete_ex(fs_t *fs, const char *filename);
+int fs_ls_ex(fs_t *fs);
+int fs_open_ex(fs_t *fs, const char *filename);
+int fs_close_ex(fs_t *fs, int fd);
+int fs_stat_ex(fs_t *fs, int fd);
+int fs_lseek_ex(fs_t *fs, int fd, size_t offset);
+int fs_fallocate_ex(fs_t *fs, int fd, size_t offset, size_t len);
+int fs_write_ex(fs_t *fs, int fd, void *buf, size_t count);
+int fs_read_ex(fs_t *fs, int fd, void *buf, size_t count);
+int fs_pwrite_ex(fs_t *fs, int fd, void *buf, size_t count, size_t offset);
+int fs_pread_ex(fs_t *fs, int fd, void *buf, size_t count, size_t offset);
+int fs_import_ex(fs_t *fs, const char *const *paths, size_t count, int threads,
+		 fs_import_cb callback, void *arg);
+
 #endif /* _FS_H */
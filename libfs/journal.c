@@ -0,0 +1,340 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "journal.h"
+
+#define journal_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define JOURNAL_HEADER_MAGIC "ECS150JH"
+#define JOURNAL_DESC_MAGIC "ECS150JD"
+
+/* Most blocks a single descriptor can describe */
+#define JOURNAL_DESC_MAX_BLOCKS \
+	((BLOCK_SIZE - sizeof(struct journal_desc)) / sizeof(uint32_t))
+
+/* First block of the journal region */
+struct __attribute__((__packed__)) journal_header {
+	char magic[8];
+	/* Oldest sequence number that may be replayed */
+	uint64_t seq;
+};
+
+/*
+ * First block of a part of a transaction, followed by @count block copies.
+ * Transactions of more blocks than a descriptor can describe are made of
+ * several consecutive parts with the same sequence number.
+ */
+struct __attribute__((__packed__)) journal_desc {
+	char magic[8];
+	uint64_t seq;
+	uint32_t count;
+	/* Non-zero if another part of the transaction follows */
+	uint32_t more;
+	/* Checksum of the descriptor block (with this field zeroed) and copies */
+	uint64_t checksum;
+	/* Home location of each copy */
+	uint32_t blocks[];
+};
+
+/* Journal description */
+struct journal {
+	/* Virtual disk holding the region, and cache in front of it */
+	struct disk *disk;
+	struct cache *cache;
+	/* Journal region */
+	size_t start;
+	size_t nblocks;
+	/* Position of the next transaction in the region */
+	size_t pos;
+	/* Sequence number of the next transaction */
+	uint64_t seq;
+	/* Descriptor block being built or checked */
+	struct journal_desc *desc;
+};
+
+static uint64_t checksum(uint64_t sum, const void *buf, size_t len)
+{
+	const uint64_t *words = buf;
+
+	/* FNV-1a over 64-bit words */
+	for (size_t i = 0; i < len / sizeof(uint64_t); i++)
+		sum = (sum ^ words[i]) * 0x100000001b3ULL;
+
+	return sum;
+}
+
+static uint64_t desc_checksum(struct journal_desc *desc, void *const *data)
+{
+	uint64_t saved = desc->checksum, sum;
+
+	desc->checksum = 0;
+	sum = checksum(0xcbf29ce484222325ULL, desc, BLOCK_SIZE);
+	desc->checksum = saved;
+	for (size_t i = 0; i < desc->count; i++)
+		sum = checksum(sum, data[i], BLOCK_SIZE);
+
+	return sum;
+}
+
+static int write_header(struct journal *j, uint64_t seq)
+{
+	struct journal_header *header = (void *)j->desc;
+
+	memset(header, 0, BLOCK_SIZE);
+	memcpy(header->magic, JOURNAL_HEADER_MAGIC, 8);
+	header->seq = seq;
+
+	return block_write(j->disk, j->start, header);
+}
+
+int journal_format(struct disk *disk, size_t start, size_t nblocks)
+{
+	struct journal j = { .disk = disk, .start = start, .nblocks = nblocks };
+	int ret;
+
+	/* Header, plus room for a descriptor and at least one block */
+	if (nblocks < 3) {
+		journal_error("journal too small (%zu blocks)", nblocks);
+		return -1;
+	}
+
+	if (posix_memalign((void **)&j.desc, BLOCK_SIZE, BLOCK_SIZE))
+		return -1;
+
+	ret = write_header(&j, 1);
+	free(j.desc);
+	return ret;
+}
+
+struct journal *journal_open(struct disk *disk, struct cache *cache,
+			     size_t start, size_t nblocks)
+{
+	struct journal *j;
+	struct journal_header *header;
+
+	if (nblocks < 3) {
+		journal_error("journal too small (%zu blocks)", nblocks);
+		return NULL;
+	}
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return NULL;
+	/* Aligned, for virtual disks opened with O_DIRECT */
+	if (posix_memalign((void **)&j->desc, BLOCK_SIZE, BLOCK_SIZE)) {
+		free(j);
+		return NULL;
+	}
+
+	header = (void *)j->desc;
+	if (block_read(disk, start, header)
+	    || memcmp(header->magic, JOURNAL_HEADER_MAGIC, 8)) {
+		journal_error("invalid journal header");
+		journal_close(j);
+		return NULL;
+	}
+
+	j->disk = disk;
+	j->cache = cache;
+	j->start = start;
+	j->nblocks = nblocks;
+	j->pos = 1;
+	j->seq = header->seq;
+
+	return j;
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+
+	free(j->desc);
+	free(j);
+}
+
+size_t journal_min_blocks(size_t count)
+{
+	size_t parts = (count + JOURNAL_DESC_MAX_BLOCKS - 1)
+		/ JOURNAL_DESC_MAX_BLOCKS;
+
+	/* Header, descriptors and copies */
+	return 1 + (parts ? parts : 1) + (count ? count : 1);
+}
+
+/* Read the transaction part at @pos into @buf, and check it follows @seq */
+static int read_transaction(struct journal *j, size_t pos, uint64_t seq,
+			    int first, void *buf, void **data)
+{
+	struct journal_desc *desc = j->desc;
+
+	if (pos + 1 >= j->nblocks || block_read(j->disk, j->start + pos, desc))
+		return -1;
+
+	/*
+	 * The first transaction may be newer than the header says, if the header
+	 * of the last checkpoint was lost; the following ones must be in order.
+	 */
+	if (memcmp(desc->magic, JOURNAL_DESC_MAGIC, 8)
+	    || (first ? desc->seq < seq : desc->seq != seq)
+	    || !desc->count || desc->count > JOURNAL_DESC_MAX_BLOCKS
+	    || pos + 1 + desc->count > j->nblocks)
+		return -1;
+
+	for (size_t i = 0; i < desc->count; i++)
+		data[i] = buf + i * BLOCK_SIZE;
+	if (block_read_range(j->disk, j->start + pos + 1, desc->count,
+			     buf))
+		return -1;
+
+	return desc_checksum(desc, data) == desc->checksum ? 0 : -1;
+}
+
+int journal_replay(struct journal *j)
+{
+	void *buf, **data;
+	uint32_t *homes;
+	size_t pos = 1, held = 0, disk_blocks = block_disk_count(j->disk);
+	uint64_t seq = j->seq;
+	int replayed = 0, ret = 0;
+
+	if (posix_memalign(&buf, BLOCK_SIZE, (j->nblocks - 2) * BLOCK_SIZE))
+		buf = NULL;
+	data = malloc((j->nblocks - 2) * sizeof(void *));
+	homes = malloc((j->nblocks - 2) * sizeof(uint32_t));
+	if (!buf || !data || !homes) {
+		free(buf);
+		free(data);
+		free(homes);
+		return -1;
+	}
+
+	/* Parts are held until the last one of their transaction is read */
+	while (!read_transaction(j, pos, seq, !replayed && !held,
+				 buf + held * BLOCK_SIZE, data + held)) {
+		struct journal_desc *desc = j->desc;
+
+		memcpy(homes + held, desc->blocks,
+		       desc->count * sizeof(uint32_t));
+		held += desc->count;
+		pos += 1 + desc->count;
+		seq = desc->seq;
+		if (desc->more)
+			continue;
+
+		for (size_t i = 0; i < held; i++) {
+			if (homes[i] >= disk_blocks
+			    || cache_write(j->cache, homes[i], data[i])) {
+				journal_error("cannot replay block %u",
+					      homes[i]);
+				ret = -1;
+				break;
+			}
+		}
+		if (ret)
+			break;
+
+		held = 0;
+		seq++;
+		replayed++;
+	}
+	free(buf);
+	free(data);
+	free(homes);
+	if (ret)
+		return -1;
+
+	/*
+	 * The parts of an incomplete transaction must never be mistaken for
+	 * the first parts of the next one, so its sequence number is skipped.
+	 */
+	j->seq = held ? seq + 1 : seq;
+	j->pos = 1;
+	if (replayed && journal_checkpoint(j))
+		return -1;
+
+	return replayed;
+}
+
+int journal_commit(struct journal *j, const size_t *blocks,
+		   void *const *data, size_t count)
+{
+	size_t parts = (count + JOURNAL_DESC_MAX_BLOCKS - 1)
+		/ JOURNAL_DESC_MAX_BLOCKS, done = 0, n = 0;
+	struct journal_desc *descs;
+	struct iovec *iov;
+	int ret;
+
+	if (!count || journal_min_blocks(count) > j->nblocks) {
+		journal_error("transaction of %zu blocks does not fit", count);
+		return -1;
+	}
+
+	if (j->pos + parts + count > j->nblocks && journal_checkpoint(j))
+		return -1;
+
+	iov = malloc((count + parts) * sizeof(*iov));
+	if (parts == 1)
+		descs = j->desc;
+	else if (posix_memalign((void **)&descs, BLOCK_SIZE, parts * BLOCK_SIZE))
+		descs = NULL;
+	if (!iov || !descs) {
+		free(iov);
+		return -1;
+	}
+
+	for (size_t p = 0; p < parts; p++) {
+		struct journal_desc *desc = (void *)descs + p * BLOCK_SIZE;
+		size_t part = count - done < JOURNAL_DESC_MAX_BLOCKS ?
+			count - done : JOURNAL_DESC_MAX_BLOCKS;
+
+		memset(desc, 0, BLOCK_SIZE);
+		memcpy(desc->magic, JOURNAL_DESC_MAGIC, 8);
+		desc->seq = j->seq;
+		desc->count = part;
+		desc->more = p + 1 < parts;
+		iov[n].iov_base = desc;
+		iov[n++].iov_len = BLOCK_SIZE;
+		for (size_t i = 0; i < part; i++) {
+			desc->blocks[i] = blocks[done + i];
+			iov[n].iov_base = data[done + i];
+			iov[n++].iov_len = BLOCK_SIZE;
+		}
+		desc->checksum = desc_checksum(desc, data + done);
+		done += part;
+	}
+
+	/* The checksums make up for the lack of ordering within the flush */
+	ret = block_writev(j->disk, j->start + j->pos, iov, n)
+		|| block_disk_sync(j->disk) ? -1 : 0;
+	free(iov);
+	if (descs != j->desc)
+		free(descs);
+	if (ret)
+		return -1;
+
+	j->pos += parts + count;
+	j->seq++;
+
+	return 0;
+}
+
+int journal_checkpoint(struct journal *j)
+{
+	/*
+	 * The new header only needs to reach the disk before the next
+	 * transaction does, and the flush of that transaction takes care of it.
+	 */
+	if (cache_flush(j->cache) || block_disk_sync(j->disk)
+	    || write_header(j, j->seq))
+		return -1;
+
+	j->pos = 1;
+	return 0;
+}
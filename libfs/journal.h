@@ -0,0 +1,108 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h>
+
+#include "cache.h"
+#include "disk.h"
+
+/*
+ * Write-ahead journal of metadata blocks, kept in a reserved region of the
+ * virtual disk. The first block of the region is a header holding the
+ * sequence number of the oldest transaction worth replaying. Transactions
+ * follow one after the other: a descriptor block (sequence number, home
+ * location of each block, checksum of the whole transaction), then a copy of
+ * each block. Larger transactions than a descriptor can describe are written
+ * as several such parts, and only replayed once all of them are there. A
+ * transaction is valid only if its checksums match, so it can be written and
+ * flushed in one go. When the region is full, the home locations are flushed
+ * and the journal starts over at its beginning.
+ */
+
+/** Opaque journal */
+struct journal;
+
+/**
+ * journal_format - Initialize a journal region
+ * @disk: Virtual disk
+ * @start: Index of the first block of the region
+ * @nblocks: Number of blocks in the region
+ *
+ * Write an empty journal header on virtual disk @disk.
+ *
+ * Return: -1 if the region is too small or if the header cannot be written. 0
+ * otherwise.
+ */
+int journal_format(struct disk *disk, size_t start, size_t nblocks);
+
+/**
+ * journal_min_blocks - Get size of the smallest journal for a transaction
+ * @count: Number of blocks of the transaction
+ *
+ * Return: Number of blocks a journal region needs to hold a transaction of
+ * @count blocks.
+ */
+size_t journal_min_blocks(size_t count);
+
+/**
+ * journal_open - Open the journal of a virtual disk
+ * @disk: Virtual disk
+ * @cache: Block cache in front of @disk
+ * @start: Index of the first block of the region
+ * @nblocks: Number of blocks in the region
+ *
+ * Return: NULL if the region is too small, if its header is invalid or cannot
+ * be read, or if memory cannot be allocated. The journal otherwise.
+ */
+struct journal *journal_open(struct disk *disk, struct cache *cache,
+			     size_t start, size_t nblocks);
+
+/**
+ * journal_close - Release a journal
+ * @j: Journal to release
+ */
+void journal_close(struct journal *j);
+
+/**
+ * journal_replay - Apply committed transactions
+ * @j: Journal
+ *
+ * Write every valid transaction of @j, oldest first, to its home locations
+ * through the block cache, then checkpoint the journal if any was found.
+ *
+ * Return: Number of transactions replayed, or -1 if the journal cannot be read
+ * or the home locations cannot be written.
+ */
+int journal_replay(struct journal *j);
+
+/**
+ * journal_commit - Log a transaction
+ * @j: Journal
+ * @blocks: Home location of each block
+ * @data: Content of each block
+ * @count: Number of blocks
+ *
+ * Write the transaction in the journal and flush the virtual disk once, which
+ * makes the transaction durable along with every write issued before. The
+ * caller can then write the blocks to their home locations in any order. If
+ * the journal is full, it is checkpointed first.
+ *
+ * Return: -1 if the transaction cannot fit in the journal or cannot be
+ * written. 0 otherwise.
+ */
+int journal_commit(struct journal *j, const size_t *blocks,
+		   void *const *data, size_t count);
+
+/**
+ * journal_checkpoint - Empty the journal
+ * @j: Journal
+ *
+ * Flush the block cache and the virtual disk, so that every committed block is
+ * at its home location, then mark the journal as empty.
+ *
+ * Return: -1 if the cache, the disk or the header cannot be flushed. 0
+ * otherwise.
+ */
+int journal_checkpoint(struct journal *j);
+
+#endif /* _JOURNAL_H */
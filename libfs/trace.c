@@ -0,0 +1,183 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Records are written to the file in chunks of this many bytes at most */
+#define TRACE_BUFFER_SIZE (64 << 10)
+
+/* Trace instance description */
+struct trace {
+	int fd;
+	/* trace_clock() when tracing started */
+	uint64_t start;
+	/* A write to the trace file failed */
+	int failed;
+	/* Records not written to the file yet */
+	char *buf;
+	size_t len;
+	/* Serializes the recording threads */
+	pthread_mutex_t lock;
+};
+
+/* Numbers of the threads, handed out on their first record */
+static uint16_t next_thread = 1;
+static __thread uint16_t thread_number;
+
+uint64_t trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Write @len bytes of @buf to the trace file */
+static void trace_write(struct trace *t, const void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(t->fd, buf, len);
+
+		if (n <= 0) {
+			if (!t->failed)
+				perror("write");
+			t->failed = 1;
+			return;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+}
+
+/* Append a record and the @len bytes of @name after it */
+static void trace_append(struct trace *t, struct trace_record *rec,
+			 const char *name, size_t len)
+{
+	if (!thread_number)
+		thread_number = __atomic_fetch_add(&next_thread, 1,
+						   __ATOMIC_RELAXED);
+	rec->thread = thread_number;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->len + sizeof(*rec) + len > TRACE_BUFFER_SIZE) {
+		trace_write(t, t->buf, t->len);
+		t->len = 0;
+	}
+	if (sizeof(*rec) + len > TRACE_BUFFER_SIZE) {
+		trace_write(t, rec, sizeof(*rec));
+		trace_write(t, name, len);
+	} else {
+		memcpy(t->buf + t->len, rec, sizeof(*rec));
+		memcpy(t->buf + t->len + sizeof(*rec), name, len);
+		t->len += sizeof(*rec) + len;
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+struct trace *trace_open(const char *path, struct trace_header *header)
+{
+	struct trace *t = calloc(1, sizeof(*t));
+
+	if (!t || !(t->buf = malloc(TRACE_BUFFER_SIZE))) {
+		perror("malloc");
+		free(t);
+		return NULL;
+	}
+
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (t->fd < 0) {
+		perror("open");
+		free(t->buf);
+		free(t);
+		return NULL;
+	}
+
+	memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+	header->record_size = sizeof(struct trace_record);
+	header->start_time = time(NULL);
+	trace_write(t, header, sizeof(*header));
+	t->start = trace_clock();
+	pthread_mutex_init(&t->lock, NULL);
+
+	return t;
+}
+
+int trace_close(struct trace *t)
+{
+	struct trace_record rec = {
+		.time = trace_clock() - t->start,
+		.type = TRACE_END,
+		.fd = -1,
+	};
+	int ret;
+
+	trace_append(t, &rec, NULL, 0);
+	trace_write(t, t->buf, t->len);
+	if (close(t->fd)) {
+		perror("close");
+		t->failed = 1;
+	}
+
+	ret = t->failed ? -1 : 0;
+	pthread_mutex_destroy(&t->lock);
+	free(t->buf);
+	free(t);
+
+	return ret;
+}
+
+void trace_call(struct trace *t, int op, uint64_t start, int fd,
+		uint64_t arg0, uint64_t arg1, const char *name, int ret)
+{
+	uint64_t end = trace_clock();
+	struct trace_record rec = {
+		.time = end - t->start,
+		.duration = end - start > UINT32_MAX ? UINT32_MAX : end - start,
+		.type = TRACE_CALL,
+		.op = op,
+		.fd = fd,
+		.ret = ret,
+		.arg0 = arg0,
+		.arg1 = arg1,
+	};
+	size_t len = 0;
+
+	if (name) {
+		len = strlen(name);
+		rec.arg1 = len;
+	}
+	trace_append(t, &rec, name, len);
+}
+
+void trace_block(struct trace *t, int write, size_t block, size_t count)
+{
+	struct trace_record rec = {
+		.time = trace_clock() - t->start,
+		.type = write ? TRACE_WRITE : TRACE_READ,
+		.fd = -1,
+		.arg0 = block,
+		.arg1 = count,
+	};
+
+	trace_append(t, &rec, NULL, 0);
+}
+
+void trace_file(struct trace *t, const char *name, size_t size)
+{
+	struct trace_record rec = {
+		.time = trace_clock() - t->start,
+		.type = TRACE_FILE,
+		.fd = -1,
+		.arg0 = size,
+	};
+	size_t len = strlen(name);
+
+	rec.arg1 = len;
+	trace_append(t, &rec, name, len);
+}
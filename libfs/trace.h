@@ -0,0 +1,135 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary trace of the calls made to a mounted file system and of the block
+ * transfers they caused. A trace file starts with a header describing the
+ * image, followed by fixed-size records in the order they completed. Records
+ * with a filename are followed by the name (@arg1 bytes, not terminated). All
+ * fields are in host byte order.
+ */
+
+/** First bytes of a trace file */
+#define TRACE_MAGIC "FSTRACE1"
+
+/** Kinds of trace records */
+enum trace_type {
+	/* Call of the API: @op is an enum fs_op */
+	TRACE_CALL,
+	/* Block transfer issued to the virtual disk */
+	TRACE_READ,
+	TRACE_WRITE,
+	/* File already on the image when tracing started, of size @arg0 */
+	TRACE_FILE,
+	/* Unmount, last record of a complete trace */
+	TRACE_END,
+};
+
+/** Trace file header */
+struct __attribute__((__packed__)) trace_header {
+	char magic[8];
+	/* Size of each record, so that readers can skip unknown fields */
+	uint32_t record_size;
+	/* Geometry of the traced image, as passed to fs_format() */
+	uint32_t data_blocks;
+	uint32_t journal_blocks;
+	/* On-disk format version (FS_VERSION_1 or FS_VERSION_2) */
+	uint32_t version;
+	/* Block cache of the traced mount */
+	uint32_t cache_blocks;
+	uint32_t cache_policy;
+	uint32_t direct;
+	/* Wall-clock time when tracing started, in seconds since the Epoch */
+	uint64_t start_time;
+};
+
+/** Trace record */
+struct __attribute__((__packed__)) trace_record {
+	/* Nanoseconds since tracing started, at the end of the call */
+	uint64_t time;
+	/* Duration of the call in nanoseconds (saturated), 0 for transfers */
+	uint32_t duration;
+	/* Small number of the calling thread, from 1 */
+	uint16_t thread;
+	/* enum trace_type, and enum fs_op for %TRACE_CALL */
+	uint8_t type;
+	uint8_t op;
+	/* Descriptor argument of the call, -1 if none */
+	int32_t fd;
+	/* Return value of the call */
+	int32_t ret;
+	/* Offset of the call, first block of the transfer or size of the file */
+	uint64_t arg0;
+	/* Byte count or filename length of the call, or blocks transferred */
+	uint64_t arg1;
+};
+
+/** Opaque trace being recorded */
+struct trace;
+
+/**
+ * trace_open - Start recording a trace
+ * @path: Trace file to create (truncated if it exists)
+ * @header: Header to write, whose @magic, @record_size and @start_time are
+ * filled in
+ *
+ * Return: NULL if the file cannot be created or memory cannot be allocated.
+ * The trace otherwise.
+ */
+struct trace *trace_open(const char *path, struct trace_header *header);
+
+/**
+ * trace_close - Stop recording a trace
+ * @t: Trace
+ *
+ * Write a %TRACE_END record and the records still buffered, then close the
+ * trace file.
+ *
+ * Return: -1 if writing failed at any point since trace_open(). 0 otherwise.
+ */
+int trace_close(struct trace *t);
+
+/**
+ * trace_clock - Read the clock of trace timestamps
+ *
+ * Return: Monotonic time in nanoseconds.
+ */
+uint64_t trace_clock(void);
+
+/**
+ * trace_call - Record a call of the API
+ * @t: Trace
+ * @op: Call, as in enum fs_op
+ * @start: trace_clock() when the call started
+ * @fd: Descriptor argument, -1 if none
+ * @arg0: Offset argument, 0 if none
+ * @arg1: Byte count argument, 0 if none
+ * @name: Filename argument, NULL if none
+ * @ret: Return value
+ *
+ * Several threads can record at once.
+ */
+void trace_call(struct trace *t, int op, uint64_t start, int fd,
+		uint64_t arg0, uint64_t arg1, const char *name, int ret);
+
+/**
+ * trace_block - Record a block transfer
+ * @t: Trace
+ * @write: Non-zero for a write, zero for a read
+ * @block: Index of the first block
+ * @count: Number of blocks
+ */
+void trace_block(struct trace *t, int write, size_t block, size_t count);
+
+/**
+ * trace_file - Record a file present when tracing starts
+ * @t: Trace
+ * @name: Filename
+ * @size: Size of the file in bytes
+ */
+void trace_file(struct trace *t, const char *name, size_t size);
+
+#endif /* _TRACE_H */
@@ -1,11 +1,16 @@
+#include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -81,7 +86,7 @@ void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
-	int fs_fd;
+	int fs_fd, ret;
 	size_t stat, read;
 
 	if (t_arg->argc < 2)
@@ -116,7 +121,13 @@ void thread_fs_cat(void *arg)
 		die("Cannot malloc");
 	}
 
-	read = fs_read(fs_fd, buf, stat);
+	/* Stream the file the way a reader would, in 4 KiB chunks */
+	for (read = 0; read < stat; read += ret) {
+		ret = fs_read(fs_fd, buf + read, stat - read < 4096 ?
+			      stat - read : 4096);
+		if (ret <= 0)
+			break;
+	}
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -203,6 +214,11 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
+	/* Reserve the whole file up front so that it ends up contiguous. If
+	 * there is not enough room, still write as much as possible. */
+	if (st.st_size)
+		fs_fallocate(fs_fd, 0, st.st_size);
+
 	written = fs_write(fs_fd, buf, st.st_size);
 
 	if (fs_close(fs_fd)) {
@@ -220,6 +236,42 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t data_blocks, journal_blocks = FS_JOURNAL_AUTO;
+	int version = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [<journal block count>|auto [<format version>]]");
+
+	diskname = t_arg->argv[0];
+	data_blocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2 && strcmp(t_arg->argv[2], "auto"))
+		journal_blocks = get_argv(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		version = get_argv(t_arg->argv[3]);
+
+	if (fs_format_version(diskname, data_blocks, journal_blocks, version))
+		die("Cannot format diskname");
+
+	if (journal_blocks == FS_JOURNAL_AUTO)
+		printf("Created virtual disk '%s' with '%zu' data blocks and a default journal\n",
+		       diskname, data_blocks);
+	else
+		printf("Created virtual disk '%s' with '%zu' data blocks and '%zu' journal blocks\n",
+		       diskname, data_blocks, journal_blocks);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -258,12 +310,889 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
+/* Blocks in each file of the stress test, and size of each access */
+#define STRESS_FILE_BLOCKS	32
+#define STRESS_CHUNK		4096
+#define STRESS_READS		20000
+
+struct stress_thread {
+	pthread_t thread;
+	int id;
+	/* Descriptors shared by all threads, one per file */
+	int *fds;
+	int nfiles;
+	/* Reads to perform, and bytes actually checked */
+	int nreads;
+	size_t bytes;
+	int errors;
+};
+
+static uint8_t stress_byte(int file, size_t offset)
 {
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
+	return (uint8_t)(file * 31 + offset / STRESS_CHUNK * 7 + offset);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill file @id through its shared descriptor, chunk by chunk */
+static void *stress_writer(void *arg)
+{
+	struct stress_thread *t = arg;
+	uint8_t buf[STRESS_CHUNK];
+
+	for (size_t off = 0; off < STRESS_FILE_BLOCKS * 4096; off += STRESS_CHUNK) {
+		for (size_t i = 0; i < STRESS_CHUNK; i++)
+			buf[i] = stress_byte(t->id, off + i);
+		if (fs_pwrite(t->fds[t->id], buf, STRESS_CHUNK, off) != STRESS_CHUNK)
+			t->errors++;
+	}
+
+	return NULL;
+}
+
+/* Read random chunks of random files, checking their content */
+static void *stress_reader(void *arg)
+{
+	struct stress_thread *t = arg;
+	uint8_t buf[STRESS_CHUNK];
+	unsigned int seed = t->id + 1;
+
+	for (int r = 0; r < t->nreads; r++) {
+		int file = rand_r(&seed) % t->nfiles;
+		size_t off = (size_t)(rand_r(&seed) % STRESS_FILE_BLOCKS) * STRESS_CHUNK;
+
+		if (fs_pread(t->fds[file], buf, STRESS_CHUNK, off) != STRESS_CHUNK
+		    || buf[0] != stress_byte(file, off)
+		    || buf[STRESS_CHUNK - 1] != stress_byte(file, off + STRESS_CHUNK - 1)) {
+			t->errors++;
+			continue;
+		}
+		t->bytes += STRESS_CHUNK;
+	}
+
+	return NULL;
+}
+
+/* Create, fill, check and delete a private file over and over */
+static void *stress_churn(void *arg)
+{
+	struct stress_thread *t = arg;
+	char name[FS_FILENAME_LEN];
+	uint8_t buf[STRESS_CHUNK], check[STRESS_CHUNK];
+
+	snprintf(name, sizeof(name), "churn%d", t->id);
+	memset(buf, t->id, sizeof(buf));
+	for (int r = 0; r < t->nreads; r++) {
+		int fd;
+
+		if (fs_create(name) || (fd = fs_open(name)) < 0) {
+			t->errors++;
+			continue;
+		}
+		if (fs_write(fd, buf, sizeof(buf)) != sizeof(buf)
+		    || fs_pread(fd, check, sizeof(check), 0) != sizeof(check)
+		    || memcmp(buf, check, sizeof(buf)))
+			t->errors++;
+		if (fs_close(fd) || fs_delete(name))
+			t->errors++;
+	}
+
+	return NULL;
+}
+
+static int stress_run(struct stress_thread *threads, int nthreads,
+		      void *(*func)(void *))
+{
+	int errors = 0;
+
+	for (int i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i].thread, NULL, func, &threads[i]))
+			die_perror("pthread_create");
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		errors += threads[i].errors;
+	}
+
+	return errors;
+}
+
+void thread_fs_stress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct stress_thread *threads;
+	char *diskname, name[FS_FILENAME_LEN];
+	int max_threads = 8, nfiles, *fds, errors;
+	double start, elapsed, base = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max threads>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_threads = get_argv(t_arg->argv[1]);
+	if (max_threads < 1 || max_threads > FS_OPEN_MAX_COUNT / 2)
+		die("Thread count must be between 1 and %d",
+		    FS_OPEN_MAX_COUNT / 2);
+	nfiles = max_threads;
+
+	threads = calloc(2 * max_threads, sizeof(*threads));
+	fds = calloc(nfiles, sizeof(*fds));
+	if (!threads || !fds)
+		die_perror("calloc");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* One file per writer, all filled at the same time */
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "stress%d", i);
+		if (fs_create(name) || (fds[i] = fs_open(name)) < 0) {
+			fs_umount();
+			die("Cannot create file '%s'", name);
+		}
+		threads[i].id = i;
+		threads[i].fds = fds;
+		threads[i].nfiles = nfiles;
+	}
+	start = now_sec();
+	errors = stress_run(threads, nfiles, stress_writer);
+	printf("Wrote %d files of %d blocks in %.3f s (%d errors)\n", nfiles,
+	       STRESS_FILE_BLOCKS, now_sec() - start, errors);
+
+	/* Random reads over all the files, through the shared descriptors */
+	printf("threads  reads/s      MiB/s  speedup  errors\n");
+	for (int n = 1; n <= max_threads; n *= 2) {
+		for (int i = 0; i < n; i++) {
+			threads[i].id = i;
+			threads[i].nreads = STRESS_READS / n;
+			threads[i].bytes = threads[i].errors = 0;
+		}
+		start = now_sec();
+		errors = stress_run(threads, n, stress_reader);
+		elapsed = now_sec() - start;
+		if (n == 1)
+			base = elapsed;
+		printf("%7d  %7.0f  %9.1f  %7.2f  %6d\n", n,
+		       STRESS_READS / n * n / elapsed,
+		       STRESS_READS / n * n * (double)STRESS_CHUNK / elapsed / (1 << 20),
+		       base / elapsed * (STRESS_READS / n * n) / STRESS_READS,
+		       errors);
+		if (n < max_threads && n * 2 > max_threads)
+			n = max_threads / 2;
+	}
+
+	/* Readers alongside threads creating and deleting files */
+	for (int i = 0; i < 2 * max_threads; i++) {
+		threads[i].id = i % max_threads;
+		threads[i].fds = fds;
+		threads[i].nfiles = nfiles;
+		threads[i].nreads = i < max_threads ? STRESS_READS / max_threads : 200;
+		threads[i].bytes = threads[i].errors = 0;
+	}
+	start = now_sec();
+	errors = 0;
+	for (int i = 0; i < 2 * max_threads; i++)
+		if (pthread_create(&threads[i].thread, NULL,
+				   i < max_threads ? stress_reader : stress_churn,
+				   &threads[i]))
+			die_perror("pthread_create");
+	for (int i = 0; i < 2 * max_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		errors += threads[i].errors;
+	}
+	printf("Mixed reads and create/delete in %.3f s (%d errors)\n",
+	       now_sec() - start, errors);
+
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "stress%d", i);
+		if (fs_close(fds[i]) || fs_delete(name))
+			test_fs_error("Cannot delete file '%s'", name);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	free(threads);
+	free(fds);
+}
+
+/* Jobs run by the pool of the multi test, per image */
+#define MULTI_JOBS		64
+#define MULTI_THREADS		4
+
+struct multi_pool {
+	fs_t **images;
+	int nimages;
+	/* Next job to hand out, and jobs that failed */
+	int next;
+	int errors;
+};
+
+/* Create, fill, check and delete a file on each image in turn */
+static void *multi_worker(void *arg)
+{
+	struct multi_pool *pool = arg;
+	uint8_t buf[3 * 4096], check[sizeof(buf)];
+	char name[FS_FILENAME_LEN];
+	int job;
+
+	while ((job = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED))
+	       < MULTI_JOBS * pool->nimages) {
+		fs_t *fs = pool->images[job % pool->nimages];
+		int fd, failed;
+
+		snprintf(name, sizeof(name), "job%d", job);
+		memset(buf, job, sizeof(buf));
+		if (fs_create_ex(fs, name) || (fd = fs_open_ex(fs, name)) < 0) {
+			__atomic_fetch_add(&pool->errors, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		failed = fs_write_ex(fs, fd, buf, sizeof(buf)) != sizeof(buf)
+			|| fs_pread_ex(fs, fd, check, sizeof(check), 0)
+			   != sizeof(check)
+			|| memcmp(buf, check, sizeof(buf));
+		if (fs_close_ex(fs, fd) || fs_delete_ex(fs, name) || failed)
+			__atomic_fetch_add(&pool->errors, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+void thread_fs_multi(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct multi_pool pool = { 0 };
+	pthread_t threads[MULTI_THREADS];
+	double start;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<diskname>...]");
+
+	pool.nimages = t_arg->argc;
+	pool.images = calloc(pool.nimages, sizeof(*pool.images));
+	if (!pool.images)
+		die_perror("calloc");
+
+	/* Every image is mounted at once, in this single process */
+	for (int i = 0; i < pool.nimages; i++) {
+		pool.images[i] = fs_mount_ex(t_arg->argv[i]);
+		if (!pool.images[i])
+			die("Cannot mount '%s'", t_arg->argv[i]);
+	}
+
+	start = now_sec();
+	for (int i = 0; i < MULTI_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, multi_worker, &pool))
+			die_perror("pthread_create");
+	for (int i = 0; i < MULTI_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	printf("Ran %d jobs over %d images with %d threads in %.3f s "
+	       "(%d errors)\n", MULTI_JOBS * pool.nimages, pool.nimages,
+	       MULTI_THREADS, now_sec() - start, pool.errors);
+
+	for (int i = 0; i < pool.nimages; i++)
+		if (fs_umount_ex(pool.images[i]))
+			die("Cannot unmount '%s'", t_arg->argv[i]);
+
+	free(pool.images);
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, buf[4096];
+	int fs_fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Read the given files through, so that there is activity to show */
+	for (int i = 1; i < t_arg->argc; i++) {
+		fs_fd = fs_open(t_arg->argv[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file '%s'", t_arg->argv[i]);
+		}
+		while (fs_read(fs_fd, buf, sizeof(buf)) > 0)
+			;
+		fs_close(fs_fd);
+	}
+
+	fs_info();
+	fs_print_stats();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Size of each transfer of the direct test, and offset of the misaligned ones */
+#define DIRECT_CHUNK (1 << 20)
+#define DIRECT_SKEW 100
+
+static uint8_t direct_byte(size_t offset)
+{
+	return (offset * 131 + offset / 4093) & 0xFF;
+}
+
+/* Compare @len bytes of @buf with the pattern at file offset @offset */
+static int direct_check(const uint8_t *buf, size_t offset, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (buf[i] != direct_byte(offset + i))
+			return -1;
+	return 0;
+}
+
+void thread_fs_direct(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	uint8_t *buf;
+	size_t size = 16 << 20, off, len;
+	int fs_fd, errors = 0;
+	double start;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<MiB>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		size = get_argv(t_arg->argv[1]) << 20;
+	if (!size)
+		die("Size must be at least 1 MiB");
+
+	/* Page aligned, with room for the misaligned accesses */
+	if (posix_memalign((void **)&buf, 4096, DIRECT_CHUNK + 4096))
+		die("Cannot allocate buffer");
+
+	fs_direct_config(1);
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("direct") || (fs_fd = fs_open("direct")) < 0) {
+		fs_umount();
+		die("Cannot create file 'direct'");
+	}
+
+	/* Aligned sequential transfers: whole blocks only, no copy */
+	start = now_sec();
+	for (off = 0; off < size; off += DIRECT_CHUNK) {
+		for (size_t i = 0; i < DIRECT_CHUNK; i++)
+			buf[i] = direct_byte(off + i);
+		if (fs_write(fs_fd, buf, DIRECT_CHUNK) != DIRECT_CHUNK)
+			break;
+	}
+	size = off;
+	printf("Wrote %zu MiB in %.3f s\n", size >> 20, now_sec() - start);
+
+	fs_lseek(fs_fd, 0);
+	start = now_sec();
+	for (off = 0; off < size; off += DIRECT_CHUNK) {
+		memset(buf, 0, DIRECT_CHUNK);
+		if (fs_read(fs_fd, buf, DIRECT_CHUNK) != DIRECT_CHUNK
+		    || direct_check(buf, off, DIRECT_CHUNK))
+			errors++;
+	}
+	printf("Read %zu MiB in %.3f s\n", size >> 20, now_sec() - start);
+
+	/* Misaligned file offsets and buffers: head and tail fragments, and
+	 * whole blocks staged through the bounce buffer */
+	for (off = DIRECT_SKEW; off + DIRECT_CHUNK <= size; off += 3 * DIRECT_CHUNK + DIRECT_SKEW) {
+		len = DIRECT_CHUNK - DIRECT_SKEW;
+		for (size_t i = 0; i < len; i++)
+			buf[DIRECT_SKEW + i] = direct_byte(off + i);
+		fs_lseek(fs_fd, off);
+		if (fs_write(fs_fd, buf + DIRECT_SKEW, len) != (int)len)
+			errors++;
+
+		memset(buf, 0, DIRECT_CHUNK + 4096);
+		fs_lseek(fs_fd, off - DIRECT_SKEW);
+		if (fs_read(fs_fd, buf + 1, DIRECT_CHUNK) != DIRECT_CHUNK
+		    || direct_check(buf + 1, off - DIRECT_SKEW, DIRECT_CHUNK))
+			errors++;
+	}
+
+	if (fs_close(fs_fd) || fs_delete("direct")) {
+		fs_umount();
+		die("Cannot remove file 'direct'");
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	fs_direct_config(0);
+	free(buf);
+
+	printf("Checked aligned and misaligned transfers (%d errors)\n", errors);
+}
+
+/* Records of the append test, in a file read back while it grows */
+#define APPEND_RECORDS 20000
+
+void thread_fs_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_cache_stats stats;
+	char *diskname, rec[256], check[256];
+	int fs_fd, rd_fd, errors = 0;
+	size_t rec_size = 100, size;
+	double start;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<record size>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		rec_size = get_argv(t_arg->argv[1]);
+	if (!rec_size || rec_size > sizeof(rec))
+		die("Record size must be between 1 and %zu", sizeof(rec));
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("append") || (fs_fd = fs_open("append")) < 0
+	    || (rd_fd = fs_open("append")) < 0) {
+		fs_umount();
+		die("Cannot create file 'append'");
+	}
+
+	start = now_sec();
+	for (int i = 0; i < APPEND_RECORDS; i++) {
+		memset(rec, 'a' + i % 26, rec_size);
+		if (fs_write(fs_fd, rec, rec_size) != (int)rec_size)
+			errors++;
+
+		/* Another descriptor reads every so often what was appended */
+		if (i % 1000 == 999) {
+			fs_lseek(rd_fd, (size_t)i * rec_size);
+			if (fs_read(rd_fd, check, rec_size) != (int)rec_size
+			    || memcmp(check, rec, rec_size))
+				errors++;
+		}
+	}
+	size = fs_stat(fs_fd);
+	fs_cache_stats(&stats);
+	printf("Appended %d records of %zu bytes in %.3f s "
+	       "(%" PRIu64 " misses, %" PRIu64 " writebacks)\n", APPEND_RECORDS,
+	       rec_size, now_sec() - start, stats.misses, stats.writebacks);
+
+	if (fs_close(fs_fd) || fs_close(rd_fd) || fs_umount())
+		die("Cannot close file 'append'");
+
+	/* Everything must have reached the disk once closed */
+	if (fs_mount(diskname) || (fs_fd = fs_open("append")) < 0)
+		die("Cannot reopen file 'append'");
+	if (size != APPEND_RECORDS * rec_size || fs_stat(fs_fd) != (int)size)
+		errors++;
+	for (int i = 0; i < APPEND_RECORDS; i++) {
+		memset(rec, 'a' + i % 26, rec_size);
+		if (fs_read(fs_fd, check, rec_size) != (int)rec_size
+		    || memcmp(check, rec, rec_size))
+			errors++;
+	}
+	if (fs_close(fs_fd) || fs_delete("append") || fs_umount())
+		die("Cannot remove file 'append'");
+
+	printf("Read back %zu bytes (%d errors)\n", size, errors);
+}
+
+/* Free data blocks, as displayed by fs_info() */
+static int info_free_blocks(void)
+{
+	FILE *out = tmpfile();
+	char line[64];
+	int saved, free_blocks = -1, total;
+
+	if (!out)
+		die_perror("tmpfile");
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	dup2(fileno(out), STDOUT_FILENO);
+	fs_info();
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	rewind(out);
+	while (fgets(line, sizeof(line), out))
+		sscanf(line, "fat_free_ratio=%d/%d", &free_blocks, &total);
+	fclose(out);
+
+	return free_blocks;
+}
+
+#define FALLOC_BLOCK 4096
+
+void thread_fs_fallocate(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	int odd_fd, even_fd, big_fd, errors = 0;
+	int free_start, free_frag, free_blocks;
+	size_t i;
+	double start;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	free_start = info_free_blocks();
+	if (fs_create("odd") || fs_create("even") || fs_create("big")
+	    || (odd_fd = fs_open("odd")) < 0 || (even_fd = fs_open("even")) < 0
+	    || (big_fd = fs_open("big")) < 0) {
+		fs_umount();
+		die("Cannot create files");
+	}
+
+	/* Two files growing a block at a time take every other block, and
+	 * deleting one of them leaves the free space in single blocks */
+	for (i = 0; ; i++) {
+		int fd = i % 2 ? odd_fd : even_fd;
+
+		if (fs_fallocate(fd, i / 2 * FALLOC_BLOCK, FALLOC_BLOCK))
+			break;
+	}
+	if (info_free_blocks() != 0)
+		errors++;
+	if (fs_close(even_fd) || fs_delete("even")) {
+		fs_umount();
+		die("Cannot remove file 'even'");
+	}
+	free_frag = info_free_blocks();
+	printf("Fragmented %d free blocks out of %d\n", free_frag, free_start);
+
+	/* Asking for more than is free reserves nothing */
+	if (!fs_fallocate(big_fd, 0, (size_t)(free_frag + 1) * FALLOC_BLOCK)
+	    || info_free_blocks() != free_frag)
+		errors++;
+
+	/* Everything that is free, in as many pieces as it takes */
+	start = now_sec();
+	if (fs_fallocate(big_fd, 0, (size_t)free_frag * FALLOC_BLOCK))
+		errors++;
+	printf("Reserved %d fragmented blocks in %.3f s\n", free_frag,
+	       now_sec() - start);
+
+	/* The disk is full: nothing more fits, and nothing leaks */
+	free_blocks = info_free_blocks();
+	if (free_blocks != 0
+	    || !fs_fallocate(big_fd, 0, (size_t)(free_frag + 1) * FALLOC_BLOCK)
+	    || info_free_blocks() != free_blocks)
+		errors++;
+
+	if (fs_close(odd_fd) || fs_close(big_fd) || fs_delete("odd")
+	    || fs_delete("big")) {
+		fs_umount();
+		die("Cannot remove files");
+	}
+	if (info_free_blocks() != free_start)
+		errors++;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Checked reservations on a full disk (%d errors)\n", errors);
+}
+
+#define LARGE_CHUNK (64 << 20)
+#define LARGE_PROBE 4096
+
+static uint8_t large_byte(size_t offset)
+{
+	return offset / LARGE_CHUNK + offset % 251;
+}
+
+void thread_fs_large(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	uint8_t *buf, check[LARGE_PROBE];
+	size_t total = 0, offsets[3];
+	int fd, ret, errors = 0;
+	double start;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	buf = malloc(LARGE_CHUNK);
+	if (!buf)
+		die_perror("malloc");
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	if (fs_create("large") || (fd = fs_open("large")) < 0) {
+		fs_umount();
+		die("Cannot create file 'large'");
+	}
+
+	/* Write until the size limit stops the file */
+	start = now_sec();
+	for (;;) {
+		for (size_t i = 0; i < LARGE_CHUNK; i++)
+			buf[i] = large_byte(total + i);
+		ret = fs_write(fd, buf, LARGE_CHUNK);
+		if (ret < 0) {
+			printf("Write at %zu returned %d\n", total, ret);
+			errors++;
+			break;
+		}
+		total += ret;
+		if (ret < LARGE_CHUNK)
+			break;
+	}
+	printf("Wrote %zu bytes in %.3f s\n", total, now_sec() - start);
+
+	/* Nothing goes past the limit, and the size stays positive */
+	if (total != FS_FILE_MAX_SIZE || fs_stat(fd) != FS_FILE_MAX_SIZE
+	    || fs_write(fd, buf, 1) != 0
+	    || !fs_fallocate(fd, FS_FILE_MAX_SIZE, 1))
+		errors++;
+
+	/* Data at the start, across 1 GiB and at the very end reads back */
+	offsets[0] = 0;
+	offsets[1] = (1 << 30) - LARGE_PROBE / 2;
+	offsets[2] = FS_FILE_MAX_SIZE - LARGE_PROBE;
+	for (int i = 0; i < 3; i++) {
+		if (fs_pread(fd, check, LARGE_PROBE, offsets[i]) != LARGE_PROBE)
+			errors++;
+		for (size_t j = 0; j < LARGE_PROBE; j++)
+			if (check[j] != large_byte(offsets[i] + j)) {
+				errors++;
+				break;
+			}
+	}
+
+	if (fs_close(fd) || fs_delete("large") || fs_umount())
+		die("Cannot remove file 'large'");
+	free(buf);
+
+	printf("Checked the size limit (%d errors)\n", errors);
+}
+
+/* Block accesses through the cache and transfers to the disk so far */
+static void bigdir_counters(uint64_t *blocks, uint64_t *transfers)
+{
+	struct fs_stats stats;
+
+	fs_stats(&stats);
+	*blocks = stats.cache.hits + stats.cache.misses;
+	*transfers = stats.disk_reads + stats.disk_writes;
+}
+
+/* Print the time and the blocks per file of a phase of the bigdir test */
+static void bigdir_report(const char *what, int count, double start,
+			  uint64_t blocks, uint64_t transfers)
+{
+	uint64_t b, t;
+
+	bigdir_counters(&b, &t);
+	printf("%s %d files in %.3f s (%.2f us, %.2f blocks accessed and "
+	       "%.2f disk transfers per file)\n", what, count,
+	       now_sec() - start, (now_sec() - start) * 1e6 / count,
+	       (double)(b - blocks) / count, (double)(t - transfers) / count);
+}
+
+void thread_fs_bigdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, name[FS_FILENAME_LEN];
+	int count, fs_fd, errors = 0, left = 0;
+	uint64_t blocks, transfers;
+	double start;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <count>");
+
+	diskname = t_arg->argv[0];
+	count = get_argv(t_arg->argv[1]);
+	if (count <= 0)
+		die("Count must be positive");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	bigdir_counters(&blocks, &transfers);
+	start = now_sec();
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "dir%07d", i);
+		if (fs_create(name)) {
+			fs_umount();
+			die("Cannot create file '%s'", name);
+		}
+	}
+	bigdir_report("Created", count, start, blocks, transfers);
+
+	/* Look the names up in an order unrelated to their creation */
+	bigdir_counters(&blocks, &transfers);
+	start = now_sec();
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "dir%07d",
+			 (int)(((uint64_t)i * 2654435761u) % count));
+		if ((fs_fd = fs_open(name)) < 0 || fs_stat(fs_fd) != 0
+		    || fs_close(fs_fd))
+			errors++;
+	}
+	bigdir_report("Opened", count, start, blocks, transfers);
+
+	bigdir_counters(&blocks, &transfers);
+	start = now_sec();
+	for (int i = 1; i < count; i += 2) {
+		snprintf(name, sizeof(name), "dir%07d", i);
+		if (fs_delete(name))
+			errors++;
+	}
+	bigdir_report("Deleted", count / 2, start, blocks, transfers);
+
+	/* Names must still be unique, and deleted files gone */
+	if (!fs_create("dir0000000") || (count > 1 && fs_open("dir0000001") >= 0))
+		errors++;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (fs_mount(diskname))
+		die("Cannot remount diskname");
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "dir%07d", i);
+		fs_fd = fs_open(name);
+		if ((fs_fd >= 0) != !(i & 1))
+			errors++;
+		if (fs_fd >= 0) {
+			fs_close(fs_fd);
+			left++;
+		}
+	}
+	fs_info();
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%d files left after remounting (%d errors)\n", left, errors);
+}
+
+/* Paths of the files to import, gathered from the command line */
+struct import_list {
+	char **paths;
+	size_t count, capacity;
+};
+
+static void import_list_add(struct import_list *list, char *path)
+{
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 256;
+		list->paths = realloc(list->paths,
+				      list->capacity * sizeof(char *));
+		if (!list->paths)
+			die_perror("realloc");
+	}
+	list->paths[list->count++] = path;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Add @path, or the entries of directory @path in name order */
+static void import_list_expand(struct import_list *list, char *path)
+{
+	struct dirent *ent;
+	size_t first = list->count;
+	struct stat st;
+	DIR *dir;
+
+	if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+		import_list_add(list, strdup(path));
+		return;
+	}
+
+	dir = opendir(path);
+	if (!dir)
+		die_perror("opendir");
+	while ((ent = readdir(dir))) {
+		char *entry;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		entry = malloc(strlen(path) + strlen(ent->d_name) + 2);
+		if (!entry)
+			die_perror("malloc");
+		sprintf(entry, "%s/%s", path, ent->d_name);
+		import_list_add(list, entry);
+	}
+	closedir(dir);
+	qsort(list->paths + first, list->count - first, sizeof(char *),
+	      cmp_path);
+}
+
+/* Last progress of an import, and when it was printed */
+struct import_report {
+	struct fs_import_progress progress;
+	double printed;
+};
+
+/* Print a progress line on stderr, at most every 100 ms and after the last
+ * file */
+static void import_progress(const struct fs_import_progress *p, void *arg)
+{
+	struct import_report *report = arg;
+	double elapsed = p->elapsed_ns / 1e9;
+
+	report->progress = *p;
+	if (p->files_done + p->files_failed < p->files_total
+	    && elapsed - report->printed < 0.1)
+		return;
+	report->printed = elapsed;
+	fprintf(stderr, "\rImported %zu/%zu files, %.1f/%.1f MiB "
+		"(%.1f MiB/s, %zu failed)", p->files_done, p->files_total,
+		p->bytes_done / 1048576.0, p->bytes_total / 1048576.0,
+		elapsed > 0 ? p->bytes_done / 1048576.0 / elapsed : 0,
+		p->files_failed);
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct import_list list = { 0 };
+	struct import_report report = { 0 };
+	int threads = 0, first = 1, ret;
+	double elapsed;
+
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[1], "-j")) {
+		threads = get_argv(t_arg->argv[2]);
+		first = 3;
+	}
+	if (t_arg->argc <= first)
+		die("Usage: <diskname> [-j <threads>] "
+		    "<host file or directory>...");
+
+	for (int i = first; i < t_arg->argc; i++)
+		import_list_expand(&list, t_arg->argv[i]);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	ret = fs_import((const char *const *)list.paths, list.count, threads,
+			import_progress, &report);
+	if (list.count)
+		fprintf(stderr, "\n");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	if (ret < 0)
+		die("Cannot commit the imported files");
+
+	elapsed = report.progress.elapsed_ns / 1e9;
+	printf("Imported %d/%zu files (%" PRIu64 " bytes) in %.3f s: "
+	       "%.1f MiB/s, %.0f files/s\n", ret, list.count,
+	       report.progress.bytes_done, elapsed,
+	       elapsed > 0 ? report.progress.bytes_done / 1048576.0 / elapsed : 0,
+	       elapsed > 0 ? ret / elapsed : 0);
+
+	for (size_t i = 0; i < list.count; i++)
+		free(list.paths[i]);
+	free(list.paths);
 }
 
 static struct {
@@ -276,6 +1205,16 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "format",	thread_fs_format },
+	{ "stress",	thread_fs_stress },
+	{ "multi",	thread_fs_multi },
+	{ "direct",	thread_fs_direct },
+	{ "append",	thread_fs_append },
+	{ "fallocate",	thread_fs_fallocate },
+	{ "large",	thread_fs_large },
+	{ "stats",	thread_fs_stats },
+	{ "bigdir",	thread_fs_bigdir },
+	{ "import",	thread_fs_import },
 };
 
 void usage(void)